@@ -0,0 +1,107 @@
+//@file bltbackup.cpp
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+/*
+*  Offline incremental backup and restore of a BLTree index file.
+*
+*    bltbackup -f dbname -b backupfile [-e since]
+*        copy pages written since epoch 'since' (0 = full backup)
+*        and print the epoch to pass as 'since' next time
+*
+*    bltbackup -f dbname -r full,incr_1,incr_2,..
+*        apply a full backup followed by its chain of incrementals
+*/
+
+#include "bufmgr.h"
+#include "common.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace mongo;
+
+void usage( const char* arg0 ) {
+    cout << "Usage: " << arg0 << " OPTIONS\n"
+            "  -f dbname      - the name of the index file\n"
+            "  -b file        - write a backup of dbname to file\n"
+            "  -e since       - backup epoch to start from; default 0 (full)\n"
+            "  -r f_1,f_2,..  - restore backup files f_i into dbname, in order" << endl;
+}
+
+int main( int argc, char* argv[] ) {
+    const char* dbname = NULL;
+    const char* backup = NULL;
+    char* restore = NULL;
+    uid since = 0;
+
+    int c;
+    while ((c = getopt( argc, argv, "f:b:e:r:" )) != -1) {
+        switch (c) {
+        case 'f': dbname = optarg; break;
+        case 'b': backup = optarg; break;
+        case 'e': since = strtoull( optarg, NULL, 10 ); break;
+        case 'r': restore = optarg; break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if (!dbname || !(backup || restore)) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if (restore) {
+        char sep[] = ",";
+        for (char* tok = strtok( restore, sep ); tok; tok = strtok( 0, sep )) {
+            if (BufMgr::restore( dbname, tok )) return 1;
+            cout << "restored " << tok << endl;
+        }
+        return 0;
+    }
+
+    // page size is taken from the existing file
+    BufMgr* mgr = BufMgr::create( dbname, MINBITS, 16 );
+    if (!mgr) return 1;
+
+    // keep the database's own hot page set
+    free( mgr->warmname );
+    mgr->warmname = NULL;
+
+    uid next = mgr->backup( backup, since );
+    mgr->close();
+
+    if (!next) return 1;
+    cout << "next backup since epoch " << next << endl;
+    return 0;
+}
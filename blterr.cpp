@@ -48,6 +48,7 @@ namespace mongo {
         case BLTERR_map: return "mmap error";
         case BLTERR_write: return "write error";
         case BLTERR_eof: return "eof error";
+        case BLTERR_crc: return "checksum error";
         default: return "!!internal problem: unrecognized error code";
         }
     }
@@ -40,7 +40,8 @@ namespace mongo {
     	BLTERR_map,
     	BLTERR_read,
     	BLTERR_wrt,
-    	BLTERR_atomic
+    	BLTERR_atomic,
+    	BLTERR_crc
     } BLTERR;
 
 }   // namespace mongo
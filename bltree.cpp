@@ -59,6 +59,7 @@
 #include "bltree.h"
 #endif
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
@@ -69,6 +70,7 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <vector>
 
 namespace mongo {
 
@@ -122,6 +124,8 @@ namespace mongo {
     *  close and release memory
     */
     BLTree::~BLTree() {
+        if (mem) mgr->freeextent( extent );
+
     #ifdef unix
         if (mem) free( mem );
     #else
@@ -129,6 +133,24 @@ namespace mongo {
     #endif
     }
     
+    /**
+    *  FUNCTION:  close
+    *
+    *  release page buffers
+    */
+    void BLTree::close() {
+
+        // hand back the rest of our extent
+        if (mem) mgr->freeextent( extent );
+
+    #ifdef unix
+        if (mem) free( mem );
+    #else
+        if (mem) VirtualFree( mem, 0, MEM_RELEASE );
+    #endif
+        mem = NULL;
+    }
+
     /**
     *  FUNCTION:  create
     *
@@ -228,7 +250,12 @@ namespace mongo {
             BufMgr::lockpage( LockWrite, child->latch );
         
             memcpy( root->page, child->page, mgr->page_size );
-            root->latch->dirty = 1;
+
+            // the root must reach disk before its old child is freed
+            if (mgr->flushpage( root->latch )) {
+                root->latch->dirty = 1;
+            }
+
             freepage( child );
         
         } while (root->page->lvl > 1 && root->page->act == 1);
@@ -238,6 +265,16 @@ namespace mongo {
         return BLTERR_ok;
     }
     
+    /**
+    *  FUNCTION:  freepage
+    *
+    *  return a delete and write locked page
+    *  to the buffer manager's free list
+    */
+    void BLTree::freepage( PageSet* set ) {
+        mgr->freepage( set );
+    }
+    
     /**
     *  FUNCTION:  deletepage
     *
@@ -279,9 +316,13 @@ namespace mongo {
             return (err = BLTERR_struct);
         }
     
-        // pull contents of right peer into our empty page
+        // pull contents of right peer into our empty page,
+        // and write it before the right page can reach disk killed
         memcpy( set->page, right->page, mgr->page_size );
-        set->latch->dirty = 1;
+
+        if (mgr->flushpage( set->latch )) {
+            set->latch->dirty = 1;
+        }
     
         // mark right page deleted and point it to left page
         // until we can post parent updates that remove access
@@ -323,6 +364,449 @@ namespace mongo {
     }
     
     
+    /**
+    *  FUNCTION:  relocate
+    *
+    *  move a live page to a free page, the next page of ext
+    *  when given. The old page is left killed, pointing to the
+    *  copy, while its left sibling and parent are relinked,
+    *  then freed.
+    *  @return 1 if moved, 0 if not a live page, -1 if the page
+    *  cannot be moved now
+    */
+    int BLTree::relocate( uid page_no, PageExtent* ext ) {
+        uchar fence[KEYARRAY];
+        uchar value[BtId];
+        PageSet left[1];
+        PageSet dest[1];
+        PageSet set[1];
+        uid extnext;
+        uid left_no;
+        BLTKey* ptr;
+        uint lvl;
+
+        // pages in reserved extents may not be written yet
+    #ifdef unix
+        off64_t off;
+        uint file = mgr->pagefile( page_no, &off );
+
+        // a short read is a page past the end of the file
+        memset( frame, 0, mgr->page_size );
+        if (pread( mgr->files[file], frame, mgr->page_size, off ) < 0) {
+            err = BLTERR_read;
+            return -1;
+        }
+
+        if (mgr->unpackpage( frame, mgr->page_size, page_no )) return 0;
+    #else
+        if (mgr->readpage( frame, page_no )) return 0;
+    #endif
+
+        if (!frame->bits || frame->free || frame->kill || !frame->cnt) {
+            return 0;
+        }
+
+        // the fence key posted for the page in its parent
+        if ( (set->latch = mgr->pinlatch( page_no, 1, &reads, &writes )) ) {
+            set->page = mgr->mappage( set->latch );
+        }
+        else {
+            return -1;
+        }
+
+        BufMgr::lockpage( LockRead, set->latch );
+        lvl = set->page->lvl;
+
+        if (!set->page->free && !set->page->kill) {
+            ptr = keyptr( set->page, set->page->cnt );
+            memcpy( fence, ptr, ptr->len + sizeof(BLTKey) );
+        }
+
+        BufMgr::unlockpage( LockRead, set->latch );
+
+        if (set->page->free || set->page->kill) {
+            mgr->unpinlatch( set->latch );
+            return 0;
+        }
+
+        if ( !(left_no = leftsibling( (BLTKey*)fence, lvl, page_no )) ) {
+            mgr->unpinlatch( set->latch );
+            return -1;
+        }
+
+        // lock left to right, as deletepage does
+        if ( (left->latch = mgr->pinlatch( left_no, 1, &reads, &writes )) ) {
+            left->page = mgr->mappage( left->latch );
+        }
+        else {
+            mgr->unpinlatch( set->latch );
+            return -1;
+        }
+
+        BufMgr::lockpage( LockWrite, left->latch );
+        BufMgr::lockpage( LockWrite, set->latch );
+
+        ptr = keyptr( set->page, set->page->cnt );
+        extnext = ext ? ext->next : 0;
+
+        if (left->page->free || left->page->kill || left->page->lvl != lvl
+                || BLTVal::getid( left->page->right ) != page_no
+                || set->page->free || set->page->kill || set->page->lvl != lvl
+                || BLTKey::keycmp( ptr, ((BLTKey*)fence)->key, ((BLTKey*)fence)->len )) {
+            BufMgr::unlockpage( LockWrite, set->latch );
+            BufMgr::unlockpage( LockWrite, left->latch );
+            mgr->unpinlatch( set->latch );
+            mgr->unpinlatch( left->latch );
+            return -1;
+        }
+
+        // copy the page into a free page, written through, and
+        // hold off posting its splits until the parent points to it
+        if (mgr->newpage( dest, set->page, &reads, &writes, ext )) {
+            // hand a page the extent gave out back to it
+            if (ext && ext->next != extnext) {
+                ext->next--;
+            }
+
+            BufMgr::unlockpage( LockWrite, set->latch );
+            BufMgr::unlockpage( LockWrite, left->latch );
+            mgr->unpinlatch( set->latch );
+            mgr->unpinlatch( left->latch );
+            return -1;
+        }
+
+        BufMgr::lockpage( LockParent, dest->latch );
+
+        // kill the old page pointing to the copy, and write it
+        // before the left sibling can reach disk skipping it
+        BLTVal::putid( set->page->right, dest->latch->page_no );
+        set->page->kill = 1;
+
+        if (mgr->flushpage( set->latch )) {
+            set->latch->dirty = 1;
+        }
+
+        BLTVal::putid( left->page->right, dest->latch->page_no );
+
+        if (mgr->flushpage( left->latch )) {
+            left->latch->dirty = 1;
+        }
+
+        BufMgr::unlockpage( LockWrite, left->latch );
+        mgr->unpinlatch( left->latch );
+
+        BufMgr::lockpage( LockParent, set->latch );
+        BufMgr::unlockpage( LockWrite, set->latch );
+
+        // redirect the fence key to the copy
+        BLTVal::putid( value, dest->latch->page_no );
+        ptr = (BLTKey*)fence;
+
+        // the parent still points to the killed page, which
+        // leads readers right to the copy, so leave it in place
+        if (insertkey( ptr->key, ptr->len, lvl+1, value, BtId, 1 )) {
+            BufMgr::unlockpage( LockParent, dest->latch );
+            mgr->unpinlatch( dest->latch );
+            BufMgr::unlockpage( LockParent, set->latch );
+            mgr->unpinlatch( set->latch );
+            return -1;
+        }
+
+        BufMgr::unlockpage( LockParent, dest->latch );
+        mgr->unpinlatch( dest->latch );
+
+        // free the old page once no reader can reach it,
+        // the caller hands it to punchfree
+        BufMgr::unlockpage( LockParent, set->latch );
+        BufMgr::lockpage( LockDelete, set->latch );
+        BufMgr::lockpage( LockWrite, set->latch );
+
+        set->page->free = 1;
+        set->page->min = 0;
+        set->page->cnt = 1;
+
+        if (mgr->flushpage( set->latch )) {
+            set->latch->dirty = 1;
+        }
+
+        BufMgr::unlockpage( LockDelete, set->latch );
+        BufMgr::unlockpage( LockWrite, set->latch );
+        mgr->unpinlatch( set->latch );
+        return 1;
+    }
+
+    /**
+    *  FUNCTION:  leftsibling
+    *
+    *  find the left sibling of a page from the previous live
+    *  slot in its parent, or for a first child, the last
+    *  child of the parent's left sibling
+    *  @return left sibling page number, or zero
+    */
+    uid BLTree::leftsibling( BLTKey* fence, uint lvl, uid page_no ) {
+        uchar parentfence[KEYARRAY];
+        PageSet parent[1];
+        uid parent_no = 0;
+        uid left_no = 0;
+        BLTKey* ptr;
+        uint slot;
+
+        if ( !(slot = mgr->loadpage( parent, fence->key, fence->len, lvl+1, LockRead, &reads, &writes )) ) {
+            return 0;
+        }
+
+        if (Slot::Librarian == slotptr( parent->page, slot )->type) {
+            slot++;
+        }
+
+        if (slot <= parent->page->cnt && !BLTKey::keycmp( keyptr( parent->page, slot ), fence->key, fence->len )
+                && BLTVal::getid( valptr( parent->page, slot )->value ) == page_no) {
+            while (--slot) {
+                if (!slotptr( parent->page, slot )->dead) {
+                    left_no = BLTVal::getid( valptr( parent->page, slot )->value );
+                    break;
+                }
+            }
+
+            if (!left_no && parent->latch->page_no != ROOT_page) {
+                ptr = keyptr( parent->page, parent->page->cnt );
+                memcpy( parentfence, ptr, ptr->len + sizeof(BLTKey) );
+                parent_no = parent->latch->page_no;
+            }
+        }
+
+        BufMgr::unlockpage( LockRead, parent->latch );
+        mgr->unpinlatch( parent->latch );
+
+        if (left_no || !parent_no) {
+            return left_no;
+        }
+
+        if ( !(parent_no = leftsibling( (BLTKey*)parentfence, lvl+1, parent_no )) ) {
+            return 0;
+        }
+
+        if ( (parent->latch = mgr->pinlatch( parent_no, 1, &reads, &writes )) ) {
+            parent->page = mgr->mappage( parent->latch );
+        }
+        else {
+            return 0;
+        }
+
+        BufMgr::lockpage( LockRead, parent->latch );
+
+        if (!parent->page->free && !parent->page->kill && parent->page->lvl == lvl+1) {
+            for (slot = parent->page->cnt; slot; slot--) {
+                if (!slotptr( parent->page, slot )->dead) {
+                    left_no = BLTVal::getid( valptr( parent->page, slot )->value );
+                    break;
+                }
+            }
+        }
+
+        BufMgr::unlockpage( LockRead, parent->latch );
+        mgr->unpinlatch( parent->latch );
+        return left_no;
+    }
+
+    /**
+    *  FUNCTION:  shrink
+    *
+    *  punch out the free pages, then move up to maxmoves live
+    *  pages from the end of the file into free pages below
+    *  them, and truncate the file after the last live page
+    *  @return number of pages truncated off the file
+    */
+    uid BLTree::shrink( uint maxmoves ) {
+        std::vector< uid > moved;
+        PageExtent into[1];
+        uid total = 0;
+        uint cnt;
+
+        if (mgr->readonly || mgr->memory || (mgr->shmhdr && !mgr->shmowner)) {
+            return 0;
+        }
+
+        // our own reserved pages may sit at the end
+        mgr->freeextent( extent );
+
+        uid trimmed = mgr->punchfree( NULL, 0 );
+        uid page_no = BLTVal::getid( mgr->pagezero->alloc->right );
+
+        into->next = into->end = 0;
+
+        while (moved.size() < maxmoves && --page_no > LEAF_page) {
+
+            // move only into the lowest free extent, the free chain
+            // hands out pages that may lie above this one. Once the
+            // map runs dry, punching the moved pages refills it
+            // from the chain.
+            if (into->next >= into->end) {
+                if (!mgr->pagezero->extcnt && moved.size()) {
+                    trimmed += mgr->punchfree( &moved[0], moved.size() );
+                    moved.clear();
+                }
+
+                cnt = EXT_pages;
+                SpinLatch::spinwritelock( mgr->lock );
+                into->next = mgr->takeextent( LEAF_page, &cnt );
+                into->end = into->next + cnt;
+                SpinLatch::spinreleasewrite( mgr->lock );
+            }
+
+            // stop when there is no free page left below this one
+            if (!into->next || into->next >= page_no) {
+                break;
+            }
+
+            // a page splitting or moving meanwhile gets two retries
+            int moves = relocate( page_no, into );
+
+            for (uint retry = 0; moves < 0 && retry < 2; retry++) {
+                moves = relocate( page_no, into );
+            }
+
+            if (moves < 0) break;
+            if (moves) {
+                moved.push_back( page_no );
+                total++;
+            }
+        }
+
+        if (into->next) {
+            mgr->freeextent( into );
+        }
+
+        if (moved.size()) {
+            trimmed += mgr->punchfree( &moved[0], moved.size() );
+        }
+
+        std::cerr << total << " pages moved, " << trimmed
+                    << " pages truncated" << std::endl;
+        return trimmed;
+    }
+
+    /**
+    *  FUNCTION:  defrag
+    *
+    *  walk the leaves in key order, moving each leaf that does
+    *  not directly follow its left sibling on disk, nor head a
+    *  run of its own, into runs of contiguous pages, so range
+    *  scans read sequentially. At most maxmoves leaves are
+    *  moved, sleeping pause microseconds after each move.
+    *  @return number of leaves moved
+    */
+    uid BLTree::defrag( uint maxmoves, uint pause ) {
+        std::vector< uid > moved;
+        PageExtent run[1];
+        PageSet set[1];
+        uid page_no = LEAF_page;
+        uid scanned = 0;
+        uid total = 0;
+        uid prev = 0;
+        uid dest = 0;
+        uid next;
+        uint live;
+
+        if (mgr->readonly || mgr->memory || (mgr->shmhdr && !mgr->shmowner)) {
+            return 0;
+        }
+
+        run->next = run->end = 0;
+
+        while (page_no && total < maxmoves) {
+            if ( (set->latch = mgr->pinlatch( page_no, 1, &reads, &writes )) ) {
+                set->page = mgr->mappage( set->latch );
+            }
+            else {
+                break;
+            }
+
+            BufMgr::lockpage( LockRead, set->latch );
+            next = BLTVal::getid( set->page->right );
+            live = !set->page->kill && !set->page->lvl;
+
+            // a freed page links into the free chain, not the leaves
+            if (set->page->free) {
+                next = 0;
+                live = 0;
+            }
+
+            BufMgr::unlockpage( LockRead, set->latch );
+            mgr->unpinlatch( set->latch );
+            scanned++;
+
+            // only a leaf that breaks the run its left sibling
+            // ends moves, one heading a run of its own stays
+            if (live && prev && page_no != prev + 1 && next != page_no + 1) {
+                int moves = -1;
+
+                // a leaf splitting meanwhile gets two retries
+                for (uint retry = 0; moves < 0 && retry < 3; retry++) {
+
+                    // a run that no longer follows the left sibling
+                    // goes back to the free extent map
+                    if (run->next < run->end && run->next != prev + 1) {
+                        mgr->freeextent( run );
+                    }
+
+                    // the page after the left sibling, else a free
+                    // extent long enough to hold a run
+                    if (run->next >= run->end) {
+                        mgr->growextent( run, prev + 1, DEFRAG_least );
+                    }
+
+                    dest = run->next;
+                    moves = relocate( page_no, run );
+                }
+
+                if (moves > 0) {
+                    moved.push_back( page_no );
+                    page_no = dest;
+                    total++;
+
+                    // vacated pages are reused by later runs rather
+                    // than growing the file by every leaf moved
+                    if (moved.size() == EXT_pages) {
+                        mgr->freeextent( run );
+                        mgr->punchfree( &moved[0], moved.size() );
+                        moved.clear();
+                    }
+
+                    if (!(total % DEFRAG_report)) {
+                        std::cerr << "defrag: " << scanned << " leaves scanned, "
+                                    << total << " moved" << std::endl;
+                    }
+
+                    if (pause) {
+    #ifdef unix
+                        usleep( pause );
+    #else
+                        Sleep( (pause + 999) / 1000 );
+    #endif
+                    }
+                }
+            }
+
+            if (live) {
+                prev = page_no;
+            }
+
+            page_no = next;
+        }
+
+        // return the unused tail of the run and the vacated pages
+        mgr->freeextent( run );
+
+        if (moved.size()) {
+            mgr->punchfree( &moved[0], moved.size() );
+        }
+
+        std::cerr << "defrag: " << scanned << " leaves scanned, "
+                    << total << " moved" << std::endl;
+        return total;
+    }
+
     /**
     *  FUNCTION:  deletekey
     *
@@ -337,7 +821,13 @@ namespace mongo {
         PageSet set[1];
         BLTKey* ptr;
         BLTVal* val;
-    
+
+        // neither a read-only btree nor a process that joined
+        // a shared pool takes changes, the latter logs no redo
+        if (mgr->readonly || (mgr->shmhdr && !mgr->shmowner)) {
+            return (err = BLTERR_wrt);
+        }
+
         if (slot = mgr->loadpage( set, key, len, lvl, LockWrite, &reads, &writes )) {
             ptr = keyptr( set->page, slot );
         }
@@ -345,6 +835,10 @@ namespace mongo {
             return err;
         }
     
+        if (logredo( set, RedoLog::Delete, 0, key, len, NULL, 0 )) {
+            return err;
+        }
+    
         // if librarian slot, advance to real slot
         if (Slot::Librarian == slotptr( set->page, slot )->type) {
             ptr = keyptr(set->page, ++slot);
@@ -359,6 +853,12 @@ namespace mongo {
                 slotptr(set->page, slot)->dead = 1;
                 set->page->garbage += ptr->len + val->len + sizeof(BLTKey) + sizeof(BLTVal);
                 set->page->act--;
+
+                // no reader can follow the chain while we hold the page
+                if (slotptr(set->page, slot)->ovfl) {
+                    ovflfree( slotptr(set->page, slot)->ovfl, val->value );
+                    slotptr(set->page, slot)->ovfl = 0;
+                }
         
                 // collapse empty slots beneath the fence
                 while (idx = set->page->cnt - 1) {
@@ -409,6 +909,55 @@ namespace mongo {
     BLTKey* BLTree::foundkey() {
         return (BLTKey*)key;
     }
+
+    /**
+    *  FUNCTION:  foundvalue
+    *
+    *  copy up to valmax value bytes of a cursor slot. A value
+    *  spilled to overflow pages is read through the leaf page,
+    *  as the cached copy's chain may have been replaced since.
+    *  @return number of value bytes copied, or (-1) if the
+    *  key is gone
+    */
+    int BLTree::foundvalue( uint slot, uchar* value, uint valmax ) {
+        BLTKey* ptr = keyptr( cursor, slot );
+        BLTVal* val = valptr( cursor, slot );
+        PageSet set[1];
+        int ret = -1;
+
+        if (!slotptr( cursor, slot )->ovfl) {
+            if (valmax > val->len) valmax = val->len;
+            memcpy( value, val->value, valmax );
+            return valmax;
+        }
+
+        if ( !(slot = mgr->loadpage( set, ptr->key, ptr->len, 0, mgr->readmode, &reads, &writes )) ) {
+            return ret;
+        }
+
+        // skip librarian slot place holder
+        if (Slot::Librarian == slotptr(set->page, slot)->type) {
+            slot++;
+        }
+
+        if (!slotptr(set->page, slot)->dead
+                && !BLTKey::keycmp( keyptr(set->page, slot), ptr->key, ptr->len )) {
+            val = valptr(set->page, slot);
+
+            if (slotptr(set->page, slot)->ovfl) {
+                ret = ovflread( slotptr(set->page, slot)->ovfl, val->value, value, valmax );
+            }
+            else {
+                if (valmax > val->len) valmax = val->len;
+                memcpy( value, val->value, valmax );
+                ret = valmax;
+            }
+        }
+
+        BufMgr::unlockpage( mgr->readmode, set->latch );
+        mgr->unpinlatch( set->latch );
+        return ret;
+    }
     
     /**
     *  FUNCTION:  findnext
@@ -425,6 +974,8 @@ namespace mongo {
                 set->page = mgr->mappage( set->latch );
             }
             else {
+                // the caller still holds and releases this page
+                set->latch = prevlatch;
                 return 0;
             }
         }
@@ -433,6 +984,12 @@ namespace mongo {
             return 0;
         }
     
+        // a read-only btree needs no lock chaining
+        if (mgr->readonly) {
+            mgr->unpinlatch( prevlatch );
+            return 1;
+        }
+
         // obtain access lock using lock chaining with Access mode
         BufMgr::lockpage( LockAccess, set->latch );
         BufMgr::unlockpage( LockRead, prevlatch );
@@ -456,8 +1013,10 @@ namespace mongo {
         int ret = -1;
         BLTKey *ptr;
         BLTVal *val;
+
+        set->latch = NULL;
     
-        if ( (slot = mgr->loadpage( set, key, keylen, 0, LockRead, &reads, &writes )) ) {
+        if ( (slot = mgr->loadpage( set, key, keylen, 0, mgr->readmode, &reads, &writes )) ) {
             do {
                 ptr = keyptr(set->page, slot);
             
@@ -466,8 +1025,6 @@ namespace mongo {
                     ptr = keyptr(set->page, ++slot);
                 }
             
-                // return actual key found
-                memcpy( key, ptr, ptr->len + sizeof(BLTKey) );
                 len = ptr->len;
             
                 if (Slot::Duplicate == slotptr(set->page, slot)->type) {
@@ -488,9 +1045,16 @@ namespace mongo {
                 if (keylen == len) {
                     if (!memcmp( ptr->key, key, len )) {
                         val = valptr(set->page,slot);
-                        if (valmax > val->len ) valmax = val->len;
-                        memcpy( value, val->value, valmax );
-                        ret = valmax;
+
+                        // stream a spilled value straight to the caller
+                        if (slotptr(set->page, slot)->ovfl) {
+                            ret = ovflread( slotptr(set->page, slot)->ovfl, val->value, value, valmax );
+                        }
+                        else {
+                            if (valmax > val->len ) valmax = val->len;
+                            memcpy( value, val->value, valmax );
+                            ret = valmax;
+                        }
                     }
                 }
             
@@ -498,8 +1062,13 @@ namespace mongo {
             
             } while( (slot = findnext( set, slot )) );
         }
+
+        // a page that could not be pinned left nothing to release
+        if (!set->latch) {
+            return ret;
+        }
     
-        BufMgr::unlockpage( LockRead, set->latch );
+        BufMgr::unlockpage( mgr->readmode, set->latch );
         mgr->unpinlatch( set->latch );
         return ret;
     }
@@ -531,6 +1100,23 @@ namespace mongo {
         // if there's not enough garbage to bother with.
         if (page->garbage < nxt / 5) return 0;
     
+        // the cleaned page gets a librarian slot for every key,
+        // so split instead if the result will not fit
+        while (cnt++ < max) {
+            if (cnt < max && slotptr(page,cnt)->dead) continue;
+            nxt -= keyptr(page, cnt)->len + sizeof(BLTKey);
+            nxt -= valptr(page, cnt)->len + sizeof(BLTVal);
+            idx += idx ? 2 : 1;
+        }
+    
+        if (nxt < (idx+2) * sizeof(Slot)
+                            + sizeof(*page)
+                            + keylen + sizeof(BLTKey)
+                            + vallen + sizeof(BLTVal)) { return 0; }
+    
+        nxt = mgr->page_size;
+        cnt = idx = 0;
+    
         memcpy( frame, page, mgr->page_size );
     
         // skip page info and set rest of page to zero
@@ -564,6 +1150,7 @@ namespace mongo {
             // set up the slot
             slotptr(page, ++idx)->off = nxt;
             slotptr(page, idx)->type = slotptr(frame, cnt)->type;
+            slotptr(page, idx)->ovfl = slotptr(frame, cnt)->ovfl;
     
             if (!(slotptr(page, idx)->dead = slotptr(frame, cnt)->dead)) page->act++;
         }
@@ -602,7 +1189,12 @@ namespace mongo {
     
         //  Obtain an empty page to use, and copy the current
         //  root contents into it, e.g. lower keys
-        if (mgr->newpage( left, root->page, &reads, &writes )) return err; 
+        if (mgr->newpage( left, root->page, &reads, &writes, extent, ROOT_page )) {
+            BufMgr::unlockpage( LockWrite, root->latch );
+            mgr->unpinlatch( root->latch );
+            mgr->unpinlatch( right );
+            return (err = mgr->err);
+        }
     
         left_page_no = left->latch->page_no;
         mgr->unpinlatch( left->latch );
@@ -656,7 +1248,8 @@ namespace mongo {
     *  FUNCTION:  splitpage
     *
     *  split already locked full node; leave it locked.
-    *  @return pool entry for new right page, unlocked
+    *  @return pool entry for new right page, unlocked,
+    *  or zero with err set
     */
     uint BLTree::splitpage( PageSet* set ) {
         uint cnt = 0;
@@ -699,6 +1292,7 @@ namespace mongo {
             //  add actual slot
             slotptr( frame, ++idx )->off = nxt;
             slotptr( frame, idx )->type = slotptr( set->page, cnt )->type;
+            slotptr( frame, idx )->ovfl = slotptr( set->page, cnt )->ovfl;
     
             if (!(slotptr( frame, idx )->dead = slotptr( set->page, cnt )->dead)) {
                 frame->act++;
@@ -716,7 +1310,8 @@ namespace mongo {
         }
     
         // get new free page and write higher keys to it.
-        if (mgr->newpage( right, frame, &reads, &writes )) {
+        if (mgr->newpage( right, frame, &reads, &writes, extent, set->latch->page_no )) {
+            err = mgr->err;
             return 0;
         }
     
@@ -754,6 +1349,7 @@ namespace mongo {
             // add actual slot
             slotptr(set->page, ++idx)->off = nxt;
             slotptr(set->page, idx)->type = slotptr(frame, cnt)->type;
+            slotptr(set->page, idx)->ovfl = slotptr(frame, cnt)->ovfl;
             set->page->act++;
         }
     
@@ -769,13 +1365,14 @@ namespace mongo {
     *
     *  fix keys for newly split page
     *  call with page locked,
-    *  @return unlocked
+    *  @return unlocked, and unpinned
     */
     BLTERR BLTree::splitkeys( PageSet* set, LatchSet* right) {
         uchar leftkey[KEYARRAY];
         uchar rightkey[KEYARRAY];
         uchar value[BtId];
         uint lvl = set->page->lvl;
+        BLTERR status = BLTERR_ok;
     
         // if current page is the root page, split it
         if (ROOT_page == set->latch->page_no) {
@@ -800,22 +1397,24 @@ namespace mongo {
         ptr = (BLTKey *)leftkey;
     
         if (insertkey( ptr->key, ptr->len, lvl+1, value, BtId, 1 )) {
-            return err;
+            status = err;
         }
     
         // switch fence for right block of larger keys to new right page
         BLTVal::putid( value, right->page_no );
         ptr = (BLTKey *)rightkey;
     
-        if (insertkey( ptr->key, ptr->len, lvl+1, value, BtId, 1 )) {
-            return err;
+        if (!status && insertkey( ptr->key, ptr->len, lvl+1, value, BtId, 1 )) {
+            status = err;
         }
+
     
+        // the split pages are released even when a fence failed
         BufMgr::unlockpage( LockParent, set->latch );
         mgr->unpinlatch( set->latch );
         BufMgr::unlockpage( LockParent, right );
         mgr->unpinlatch( right );
-        return BLTERR_ok;
+        return status;
     }
     
     /**
@@ -827,7 +1426,7 @@ namespace mongo {
     BLTERR BLTree::insertslot( PageSet* set, uint slot,
                                 uchar *key, uint keylen,
                                 uchar* value, uint vallen,
-                                uint type, uint release)
+                                uint type, uint release, uint ovfl)
     {
         uint idx;
         uint librarian;
@@ -882,6 +1481,7 @@ namespace mongo {
             node->off = set->page->min;
             node->type = Slot::Librarian;
             node->dead = 1;
+            node->ovfl = 0;
         }
     
         // fill in new slot
@@ -889,6 +1489,7 @@ namespace mongo {
         node->off = set->page->min;
         node->type = type;
         node->dead = 0;
+        node->ovfl = ovfl;
     
         if (release) {
             BufMgr::unlockpage( LockWrite, set->latch );
@@ -918,16 +1519,15 @@ namespace mongo {
     BLTERR BLTree::insertkey( uchar* key, uint keylen, uint lvl,
                               uchar* value, uint vallen, uint uniq ) {
         uchar newkey[KEYARRAY];
-        uint slot;
-        uint idx;
-        uint len;
-        uint entry;
-        PageSet set[1];
-        BLTKey* ptr;
         BLTKey* ins;
         uid sequence;
-        BLTVal* val;
         uint type;
+
+        // a read-only btree takes no changes, nor do processes
+        // that joined a shared pool, they log no redo
+        if (mgr->readonly || (mgr->shmhdr && !mgr->shmowner)) {
+            return (err = BLTERR_wrt);
+        }
     
         // set up the key we're working on
         ins = (BLTKey*)newkey;
@@ -944,6 +1544,89 @@ namespace mongo {
             BLTVal::putid( ins->key + ins->len + sizeof(BLTKey), sequence );
             ins->len += BtId;
         }
+
+        return insertentry( ins, lvl, value, vallen, type, uniq );
+    }
+
+    /**
+    *  FUNCTION: logredo
+    *
+    *  log a leaf level change while its page is write locked,
+    *  so the log order of each key matches the page order.
+    *  On failure the page is unlocked and unpinned.
+    */
+    BLTERR BLTree::logredo( PageSet* set, uint op, uint type,
+                            uchar* key, uint keylen, uchar* value, uint vallen ) {
+        if (!mgr->redo || set->page->lvl) {
+            return BLTERR_ok;
+        }
+
+        if ( (err = mgr->redo->append( op, type, key, keylen, value, vallen )) ) {
+            BufMgr::unlockpage( LockWrite, set->latch );
+            mgr->unpinlatch( set->latch );
+        }
+
+        return err;
+    }
+
+    /**
+    *  FUNCTION: insertentry
+    *
+    *  insert a prepared key of the given slot type at given level.
+    *    uniq == 0 always adds a new slot, otherwise an existing
+    *    key has its value replaced. A leaf value longer than
+    *    MAXVAL, or than the value log threshold, is written to
+    *    overflow pages or the value log first, the whole value
+    *    is logged.
+    */
+    BLTERR BLTree::insertentry( BLTKey* ins, uint lvl,
+                                uchar* value, uint vallen, uint type, uint uniq ) {
+        uchar stub[OVFL_stub];
+        uint ovfl = OVFL_pages;
+        BLTERR status;
+
+        if (vallen <= MAXVAL && (!mgr->vlogmin || vallen <= mgr->vlogmin)) {
+            return insertvalue( ins, lvl, value, vallen, type, uniq, value, vallen, 0 );
+        }
+
+        if (lvl || vallen > OVFL_max) {
+            return (err = BLTERR_ovflw);
+        }
+
+        // the collector only looks at log records below a tail it
+        // read with no append waiting to be linked into its leaf
+        if (mgr->vlogmin && vallen > mgr->vlogmin) {
+            BLT_RWLock::ReadLock( mgr->vloglatch );
+            ovfl = OVFL_vlog;
+        }
+
+        if ( !(status = ovflwrite( ins, value, vallen, stub, ovfl )) ) {
+            status = insertvalue( ins, lvl, stub, OVFL_stub, type, uniq, value, vallen, ovfl );
+        }
+
+        if (OVFL_vlog == ovfl) {
+            BLT_RWLock::ReadRelease( mgr->vloglatch );
+        }
+        return status;
+    }
+
+    /**
+    *  FUNCTION: insertvalue
+    *
+    *  insert a key with its slot value, the stub of a spilled
+    *  value of the given ovfl kind, logging logval instead.
+    */
+    BLTERR BLTree::insertvalue( BLTKey* ins, uint lvl, uchar* value, uint vallen,
+                                uint type, uint uniq, uchar* logval, uint loglen, uint ovfl ) {
+        uchar old[OVFL_stub];
+        uchar* key = ins->key;
+        uint keylen = ins->len;
+        uint slot;
+        uint len;
+        uint entry;
+        PageSet set[1];
+        BLTKey* ptr;
+        BLTVal* val;
       
         while ( true ) { // find the page and slot for the current key
             if (slot = mgr->loadpage( set, ins->key, ins->len, lvl, LockWrite, &reads, &writes) )
@@ -962,38 +1645,61 @@ namespace mongo {
         
             len = ptr->len;
         
-            if (Slot::Duplicate == slotptr(set->page, slot)->type) len -= BtId;
+            // a replayed duplicate is matched on its full suffixed key
+            if (Slot::Duplicate == slotptr(set->page, slot)->type
+                    && Slot::Duplicate != type) len -= BtId;
         
             // if inserting a duplicate key or unique key
             //   check for adequate space on the page
             //   and insert the new key before slot.
             if (uniq && (len != ins->len || memcmp( ptr->key, ins->key, ins->len )) || !uniq ) {
-                if (!(slot = cleanpage( set, ins->len, slot, vallen )) ) {
-                    if ( !(entry = splitpage( set )) ) {
-                        return err;
-                    }
-                    else if (splitkeys( set, mgr->latchsets + entry )) {
+                if ( (slot = cleanpage( set, ins->len, slot, vallen )) ) {
+                    if (logredo( set, RedoLog::Insert, type, ins->key, ins->len, logval, loglen )) {
                         return err;
                     }
+                    return insertslot( set, slot, ins->key, ins->len, value, vallen, type, 1, ovfl );
                 }
-                else {
-                    continue;
+
+                // split page and retry the insert
+                if ( !(entry = splitpage( set )) ) {
+                    BufMgr::unlockpage( LockWrite, set->latch );
+                    mgr->unpinlatch( set->latch );
+                    return err;
                 }
-                return insertslot( set, slot, ins->key, ins->len, value, vallen, type, 1 );
+                else if (splitkeys( set, mgr->latchsets + entry )) {
+                    return err;
+                }
+                continue;
             }
         
             // if key already exists, update value and return
             val = valptr(set->page, slot);
+
+            // the overflow pages or logged bytes of a live value
+            // being replaced, freed once no reader can reach them
+            uint freeit = slotptr(set->page, slot)->dead ? 0 : slotptr(set->page, slot)->ovfl;
+
+            if (freeit) {
+                memcpy( old, val->value, OVFL_stub );
+            }
         
             if (val->len >= vallen) {
+                if (logredo( set, RedoLog::Insert, type, ins->key, ins->len, logval, loglen )) {
+                    return err;
+                }
                 if (slotptr(set->page, slot)->dead) set->page->act++;
                 set->page->garbage += val->len - vallen;
                 set->latch->dirty = 1;
                 slotptr(set->page, slot)->dead = 0;
+                slotptr(set->page, slot)->ovfl = ovfl;
                 val->len = vallen;
                 memcpy (val->value, value, vallen);
                 BufMgr::unlockpage( LockWrite, set->latch );
                 mgr->unpinlatch( set->latch );
+
+                if (freeit) {
+                    ovflfree( freeit, old );
+                }
                 return BLTERR_ok;
             }
         
@@ -1005,40 +1711,376 @@ namespace mongo {
                 slotptr(set->page, slot)->dead = 0;
                 set->page->act++;
             }
-        
-            if ( !(slot = cleanpage( set, keylen, slot, vallen )) ) {
-                if ( !(entry = splitpage( set )) ) {
-                    return err;
-                }
-                else if( splitkeys( set, mgr->latchsets + entry )) {
-                    return err;
-                }
-                else {
-                    continue;
+        
+            if ( !(slot = cleanpage( set, keylen, slot, vallen )) ) {
+                if ( !(entry = splitpage( set )) ) {
+                    BufMgr::unlockpage( LockWrite, set->latch );
+                    mgr->unpinlatch( set->latch );
+                    return err;
+                }
+                else if( splitkeys( set, mgr->latchsets + entry )) {
+                    return err;
+                }
+                else {
+                    continue;
+                }
+            }
+        
+            if (logredo( set, RedoLog::Insert, type, ins->key, ins->len, logval, loglen )) {
+                return err;
+            }
+        
+            set->page->min -= vallen + sizeof(BLTVal);
+            val = (BLTVal*)((uchar *)set->page + set->page->min);
+            memcpy (val->value, value, vallen);
+            val->len = vallen;
+        
+            set->latch->dirty = 1;
+            set->page->min -= keylen + sizeof(BLTKey);
+            ptr = (BLTKey*)((uchar *)set->page + set->page->min);
+            memcpy (ptr->key, key, keylen);
+            ptr->len = keylen;
+            
+            slotptr(set->page, slot)->off = set->page->min;
+            slotptr(set->page, slot)->ovfl = ovfl;
+            BufMgr::unlockpage( LockWrite, set->latch );
+            mgr->unpinlatch( set->latch );
+
+            if (freeit) {
+                ovflfree( freeit, old );
+            }
+            return BLTERR_ok;
+    
+        }   // end while
+    
+        return BLTERR_ok;
+    }
+    
+    /**
+    *  FUNCTION: ovflwrite
+    *
+    *  write a value to a chain of new overflow pages, last
+    *  page first so each is written once, linked to the one
+    *  after it, or append it with its key to the value log,
+    *  and set up the stub for its slot
+    */
+    BLTERR BLTree::ovflwrite( BLTKey* ins, uchar* value, uint vallen, uchar* stub, uint ovfl ) {
+        uint room = mgr->page_size - sizeof(Page);
+        uint pages = (vallen + room - 1) / room;
+        PageSet set[1];
+        uid next = 0;
+
+        if (OVFL_vlog == ovfl) {
+            if (mgr->vlog->append( ins->key, ins->len, value, vallen, &next )) {
+                return (err = BLTERR_wrt);
+            }
+            pages = 0;
+        }
+
+        while (pages--) {
+            uint off = pages * room;
+            uint len = vallen - off < room ? vallen - off : room;
+
+            memset( frame, 0, mgr->page_size );
+            frame->bits = mgr->page_bits;
+            frame->ovfl = 1;
+            frame->min = len;
+            BLTVal::putid( frame->right, next );
+            memcpy( frame + 1, value + off, len );
+
+            if (mgr->newpage( set, frame, &reads, &writes, extent )) {
+                return (err = mgr->err);
+            }
+
+            next = set->latch->page_no;
+            mgr->unpinlatch( set->latch );
+        }
+
+        BLTVal::putid( stub, vallen );
+        BLTVal::putid( stub + BtId, next );
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: ovflread
+    *
+    *  copy up to valmax bytes of a spilled value from its
+    *  overflow pages or the value log, call with the leaf
+    *  page locked
+    *  @return number of value bytes copied, or -1 with err
+    *  set when they cannot all be read
+    */
+    int BLTree::ovflread( uint ovfl, uchar* stub, uchar* value, uint valmax ) {
+        uid page_no = BLTVal::getid( stub + BtId );
+        uint len = BLTVal::getid( stub );
+        LatchSet* latch;
+        uint amt = 0;
+
+        if (valmax > len) valmax = len;
+
+        if (OVFL_vlog == ovfl) {
+            if (mgr->vlog->fetch( page_no, value, valmax )) {
+                err = BLTERR_read;
+                return -1;
+            }
+            return valmax;
+        }
+
+        while (amt < valmax && page_no) {
+            if ( !(latch = mgr->pinlatch( page_no, 1, &reads, &writes )) ) {
+                err = mgr->err;
+                return -1;
+            }
+
+            Page* page = mgr->mappage( latch );
+            uint cnt = valmax - amt < page->min ? valmax - amt : page->min;
+
+            memcpy( value + amt, page + 1, cnt );
+            page_no = BLTVal::getid( page->right );
+            mgr->unpinlatch( latch );
+            amt += cnt;
+        }
+
+        return amt;
+    }
+
+    /**
+    *  FUNCTION: ovflfree
+    *
+    *  return the overflow pages of a replaced or deleted
+    *  value to the free list, or count its logged bytes as
+    *  garbage for the value log collector
+    */
+    void BLTree::ovflfree( uint ovfl, uchar* stub ) {
+        uid page_no = BLTVal::getid( stub + BtId );
+        PageSet set[1];
+
+        if (OVFL_vlog == ovfl) {
+        #ifdef unix
+            __sync_fetch_and_add( &mgr->vloggarbage, (uid)BLTVal::getid( stub ) );
+        #else
+            _InterlockedExchangeAdd64( (volatile __int64*)&mgr->vloggarbage, BLTVal::getid( stub ) );
+        #endif
+            return;
+        }
+
+        if (replaying) return;
+
+        while (page_no) {
+            if ( (set->latch = mgr->pinlatch( page_no, 1, &reads, &writes )) ) {
+                set->page = mgr->mappage( set->latch );
+            }
+            else {
+                return;
+            }
+
+            page_no = BLTVal::getid( set->page->right );
+            BufMgr::lockpage( LockDelete, set->latch );
+            BufMgr::lockpage( LockWrite, set->latch );
+            mgr->freepage( set );
+        }
+    }
+
+    /**
+    *  FUNCTION: vlogmove
+    *
+    *  find the live leaf slot of key whose value is logged at
+    *  off, and relink it to newoff unless newoff is zero
+    *  @return 1 if the slot still holds the value at off
+    */
+    uint BLTree::vlogmove( uchar* key, uint keylen, uid off, uid newoff ) {
+        BLTLockMode mode = newoff ? LockWrite : LockRead;
+        PageSet set[1];
+        uint found = 0;
+        uint slot;
+
+        if ( !(slot = mgr->loadpage( set, key, keylen, 0, mode, &reads, &writes )) ) {
+            return 0;
+        }
+
+        // skip librarian slot place holder
+        if (Slot::Librarian == slotptr(set->page, slot)->type) {
+            slot++;
+        }
+
+        if (slot <= set->page->cnt && !slotptr(set->page, slot)->dead
+                && OVFL_vlog == slotptr(set->page, slot)->ovfl
+                && !BLTKey::keycmp( keyptr(set->page, slot), key, keylen )) {
+            BLTVal* val = valptr(set->page, slot);
+
+            if ( (found = BLTVal::getid( val->value + BtId ) == off) && newoff ) {
+                BLTVal::putid( val->value + BtId, newoff );
+                set->latch->dirty = 1;
+            }
+        }
+
+        BufMgr::unlockpage( mode, set->latch );
+        mgr->unpinlatch( set->latch );
+        return found;
+    }
+
+    /**
+    *  value log record relinked by a collection pass
+    */
+    struct VlogMove {
+        uid off;                    // offset of the value bytes being collected
+        uid newoff;                 // offset of their copy at the log tail
+        uint keylen;                // length of the record key
+        uchar key[KEYARRAY];        // record key
+    };
+
+    /**
+    *  FUNCTION: vlogcollect
+    *
+    *  collect up to bytes of the value log from its head: the
+    *  values their leaves still link are copied to the tail,
+    *  synced, then relinked. The head on disk advances, and
+    *  its file space is released, at the next checkpoint.
+    *  @return number of log bytes collected
+    */
+    uid BLTree::vlogcollect( uid bytes ) {
+        uint max = sizeof(ValueRec) + KEYARRAY + OVFL_max + VLOG_align;
+        std::vector< VlogMove > moves;
+        ValueLog* vlog = mgr->vlog;
+        uid start, off, stop;
+        uid live = 0;
+        uint len;
+
+        if (!mgr->vlogmin) {
+            return 0;
+        }
+
+        if (!SpinLatch::spinwritetry( mgr->gclatch )) {
+            return 0;
+        }
+
+        // every append below this tail is linked into its leaf,
+        // or its insert failed and it is garbage
+        BLT_RWLock::WriteLock( mgr->vloglatch );
+        stop = vlog->tail;
+        BLT_RWLock::WriteRelease( mgr->vloglatch );
+
+        start = off = mgr->vlogpending;
+        if (stop - off > bytes) stop = off + bytes;
+
+        ValueRec* rec = (ValueRec*)malloc( max );
+
+        while (off < stop) {
+            // skip the space of a torn or failed append
+            if ( !(len = vlog->read( off, rec, max )) ) {
+                off += VLOG_align;
+                continue;
+            }
+
+            uid valoff = off + sizeof(ValueRec) + rec->keylen;
+
+            if (vlogmove( rec->data, rec->keylen, valoff, 0 )) {
+                VlogMove move;
+
+                if (vlog->append( rec->data, rec->keylen, rec->data + rec->keylen,
+                                    rec->vallen, &move.newoff )) {
+                    break;
                 }
+
+                move.off = valoff;
+                move.keylen = rec->keylen;
+                memcpy( move.key, rec->data, rec->keylen );
+                moves.push_back( move );
+                live += len;
             }
-        
-            set->page->min -= vallen + sizeof(BLTVal);
-            val = (BLTVal*)((uchar *)set->page + set->page->min);
-            memcpy (val->value, value, vallen);
-            val->len = vallen;
-        
-            set->latch->dirty = 1;
-            set->page->min -= keylen + sizeof(BLTKey);
-            ptr = (BLTKey*)((uchar *)set->page + set->page->min);
-            memcpy (ptr->key, key, keylen);
-            ptr->len = keylen;
-            
-            slotptr(set->page, slot)->off = set->page->min;
-            BufMgr::unlockpage( LockWrite, set->latch );
-            mgr->unpinlatch( set->latch );
+
+            off += len;
+        }
+
+        free( rec );
+
+        // the copies are durable before any leaf links them
+        if (vlog->sync()) {
+            SpinLatch::spinreleasewrite( mgr->gclatch );
+            return 0;
+        }
+
+        // a value replaced since it was copied keeps its new link
+        for (uint idx = 0; idx < moves.size(); idx++) {
+            vlogmove( moves[idx].key, moves[idx].keylen, moves[idx].off, moves[idx].newoff );
+        }
+
+        uid dead = off - start - live;
+        uid garbage = mgr->vloggarbage;
+
+    #ifdef unix
+        __sync_fetch_and_sub( &mgr->vloggarbage, dead < garbage ? dead : garbage );
+    #else
+        _InterlockedExchangeAdd64( (volatile __int64*)&mgr->vloggarbage,
+                                    -(__int64)(dead < garbage ? dead : garbage) );
+    #endif
+
+        mgr->vlogpending = off;
+        SpinLatch::spinreleasewrite( mgr->gclatch );
+        return off - start;
+    }
+
+    /**
+    *  FUNCTION: collector
+    *
+    *  start background value log collection, checked every
+    *  secs seconds, collecting while replaced and deleted
+    *  values are more than pct percent of the log
+    */
+    BLTERR BLTree::collector( BufMgr* mgr, uint secs, uint pct ) {
+        if (mgr->gctid || !mgr->vlogmin || !secs) {
             return BLTERR_ok;
-    
-        }   // end while
-    
+        }
+
+        mgr->gcsecs = secs;
+        mgr->gcpct = pct;
+        mgr->gcstop = 0;
+
+    #ifdef unix
+        if (pthread_create( &mgr->gctid, NULL, BLTree::gcthread, mgr )) {
+            mgr->gctid = 0;
+            return BLTERR_struct;
+        }
+    #else
+        if ( !(mgr->gctid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BLTree::gcthread,
+                                        mgr, 0, NULL )) ) {
+            return BLTERR_struct;
+        }
+    #endif
+
         return BLTERR_ok;
     }
-    
+
+    /**
+    *  FUNCTION: gcthread
+    */
+    void* BLTree::gcthread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+        BLTree* tree = create( mgr );
+        time_t last = time( NULL );
+
+        while (!mgr->gcstop) {
+    #ifdef unix
+            usleep( 100000 );
+    #else
+            Sleep( 100 );
+    #endif
+
+            if (time( NULL ) - last < mgr->gcsecs) continue;
+
+            while (!mgr->gcstop && mgr->vloggarbage * 100
+                    > (uid)mgr->gcpct * (mgr->vlog->tail - mgr->vlogpending)) {
+                if (!tree->vlogcollect( VLOG_chunk )) break;
+            }
+
+            last = time( NULL );
+        }
+
+        tree->close();
+        free( tree );
+        return NULL;
+    }
+
     /**
     *  FUNCTION: atomicpage
     *
@@ -1127,17 +2169,26 @@ namespace mongo {
         uint slot;
         PageSet set[1];
     
-        if ( (slot = atomicpage( source, locks, src, set )) ) {
-            slotptr(set->page, slot)->dead = 1;
-        }
-        else {
+        if ( !(slot = atomicpage( source, locks, src, set )) ) {
             return (err = BLTERR_struct);
         }
+
+        // the key of a librarian slot is that of the slot after it
+        if (Slot::Librarian == slotptr(set->page, slot)->type) {
+            slot++;
+        }
+
+        slotptr(set->page, slot)->dead = 1;
     
         BLTKey* ptr = keyptr( set->page, slot );
         BLTVal* val = valptr( set->page, slot );
         set->page->garbage += ptr->len + val->len + sizeof(BLTKey) + sizeof(BLTVal);
         set->page->act--;
+
+        if (slotptr(set->page, slot)->ovfl) {
+            ovflfree( slotptr(set->page, slot)->ovfl, val->value );
+            slotptr(set->page, slot)->ovfl = 0;
+        }
     
         // collapse empty slots beneath the fence
         while (idx = set->page->cnt - 1) {
@@ -1190,6 +2241,11 @@ namespace mongo {
         int result = 0;
         BLTVal* val;
     
+        if (mgr->readonly || (mgr->shmhdr && !mgr->shmowner)) {
+            err = BLTERR_wrt;
+            return -1;
+        }
+
         // one lock per source page entry
         locks = (AtomicMod*)calloc( source->cnt + 1, sizeof(AtomicMod) );
         AtomicKey* head = NULL;
@@ -1217,7 +2273,7 @@ namespace mongo {
                 // skip initial step ('set' uninitialized), otherwise see if key is on set->page
                 if ( (samepage = !BLTVal::getid( set->page->right )
                       || BLTKey::keycmp( keyptr( set->page, set->page->cnt ),
-                                            key->key, key->len ) > 0) ) {
+                                            key->key, key->len ) >= 0) ) {
                     slot = Page::findslot( set->page, key->key, key->len );
                 }
                 else { // release read on previous page
@@ -1313,6 +2369,7 @@ namespace mongo {
                     src--;
                 }
         
+                free( locks );
                 return result;
             }
             }   // end switch
@@ -1324,13 +2381,60 @@ namespace mongo {
         if (source->cnt > 1) {
             BufMgr::unlockpage( LockRead, set->latch );
         }
-    
+
         // obtain write lock for each page
         for (uint src = 0; src++ < source->cnt; ) {
             if (locks[src].entry) {
                 BufMgr::lockpage( LockWrite, mgr->latchsets + locks[src].entry );
             }
         }
+
+        // log the validated batch for crash recovery, under the page
+        // locks, as one record replayed whole or not at all
+        if (mgr->redo) {
+            uint size = 0;
+            uint off = 0;
+
+            for (uint src = 0; src++ < source->cnt; ) {
+                size += RedoLog::format( NULL, 0, 0, 0, NULL, keyptr(source, src)->len,
+                                            NULL, valptr(source, src)->len );
+            }
+
+            uchar* batch = (uchar*)malloc( size );
+
+            for (uint src = 0; src++ < source->cnt; ) {
+                key = keyptr(source, src);
+                val = valptr(source, src);
+
+                if (Slot::Delete == slotptr( source, src )->type) {
+                    off += RedoLog::format( (RedoRec*)(batch + off), 0, RedoLog::Delete, 0,
+                                            key->key, key->len, NULL, 0 );
+                }
+                else {
+                    off += RedoLog::format( (RedoRec*)(batch + off), 0, RedoLog::Insert,
+                                            slotptr( source, src )->type,
+                                            key->key, key->len, val->value, val->len );
+                }
+            }
+
+            err = mgr->redo->append( RedoLog::Batch, 0, NULL, 0, batch, off );
+            free( batch );
+
+            // nothing was applied, release every page
+            if (err) {
+                for (uint src = 0; src++ < source->cnt; ) {
+                    if (locks[src].entry) {
+                        set->latch = mgr->latchsets + locks[src].entry;
+                        BufMgr::unlockpage( LockWrite, set->latch );
+                        BufMgr::unlockpage( LockAtomic, set->latch );
+                        mgr->unpinlatch( set->latch );
+                    }
+                }
+
+                free( locks );
+                return -1;
+            }
+        }
     
         // insert or delete each key
         for (uint src = 0; src++ < source->cnt; ) {
@@ -1381,12 +2485,16 @@ namespace mongo {
                 if (!prev->page->act) {
     
                     // recycle prev: pull 'set' content into prev, free 'set'
+                    // prev is written first so it never links to a free page
                     memcpy( prev->page, set->page, mgr->page_size );
+
+                    if (mgr->flushpage( prev->latch )) {
+                        prev->latch->dirty = 1;
+                    }
+
                     BufMgr::lockpage( LockDelete, set->latch );
                     freepage( set );
             
-                    prev->latch->dirty = 1;
-            
                     if (prev->page->act) {
                         locks[src].emptied = 0;
                     }
@@ -1421,6 +2529,11 @@ namespace mongo {
                 // remove empty block from the split chain
                 if (!set->page->act) {
                     memcpy( prev->page->right, set->page->right, BtId );
+
+                    if (mgr->flushpage( prev->latch )) {
+                        prev->latch->dirty = 1;
+                    }
+
                     BufMgr::lockpage( LockDelete, set->latch );
                     freepage( set );
                     continue;
@@ -1539,6 +2652,7 @@ namespace mongo {
         
             if (!right) break;
             cursor_page = right;
+            uint before = reads;
         
             if ( (set->latch = mgr->pinlatch( right, 1, &reads, &writes )) ) {
                 set->page = mgr->mappage( set->latch );
@@ -1547,10 +2661,11 @@ namespace mongo {
                 return 0;
             }
         
-            BufMgr::lockpage( LockRead, set->latch);
+            BufMgr::lockpage( mgr->readmode, set->latch);
             memcpy( cursor, set->page, mgr->page_size );
-            BufMgr::unlockpage( LockRead, set->latch);
+            BufMgr::unlockpage( mgr->readmode, set->latch);
             mgr->unpinlatch( set->latch );
+            readahead( reads != before );
             slot = 0;
       
         } while( 1 );
@@ -1568,7 +2683,7 @@ namespace mongo {
         uint slot;
     
         // cache page for retrieval
-        if ( (slot = mgr->loadpage( set, key, len, 0, LockRead, &reads, &writes )) ) {
+        if ( (slot = mgr->loadpage( set, key, len, 0, mgr->readmode, &reads, &writes )) ) {
             memcpy( cursor, set->page, mgr->page_size );
         }
         else {
@@ -1576,10 +2691,48 @@ namespace mongo {
         }
     
         cursor_page = set->latch->page_no;
-        BufMgr::unlockpage( LockRead, set->latch );
+        BufMgr::unlockpage( mgr->readmode, set->latch );
         mgr->unpinlatch( set->latch );
+
+        // a new scan starts out random
+        rarun = 0;
+        rawindow = 0;
+        raleft = 0;
         return slot;
     }
+
+    /**
+    *  FUNCTION:  readahead
+    *
+    *  the cursor stepped right onto a new page, read from disk
+    *  when missed. From the second step on, prefetch the pages
+    *  to its right, again when half the window is consumed.
+    *  The window doubles while the scan outruns the prefetch,
+    *  up to a sixteenth of the pool.
+    */
+    void BLTree::readahead( uint missed ) {
+        uint max = std::min( (uint)RA_max, mgr->latchactive / 16 );
+        uid right = BLTVal::getid( cursor->right );
+
+        if (++rarun < 2 || !right || max < RA_min) {
+            return;
+        }
+
+        if (!rawindow) {
+            rawindow = RA_min;
+        }
+        else if (missed) {
+            rawindow = std::min( 2 * rawindow, max );
+        }
+
+        if (raleft && !missed) {
+            raleft--;
+            return;
+        }
+
+        mgr->prefetch( right, rawindow );
+        raleft = rawindow / 2;
+    }
     
     
     BLTKey* BLTree::getKey( uint slot ) { return keyptr( cursor, slot ); }
@@ -1592,49 +2745,53 @@ namespace mongo {
     uint BLTree::latchaudit() {
         LatchSet* latch;
         uint cnt = 0;
+
+        // a shared pool's latches may be held by other processes,
+        // they are reported but left alone
+        uint reset = !mgr->shmhdr;
     
         if (*(ushort *)(mgr->lock)) {
             std::cerr <<  "Alloc page locked" << std::endl;
         }
     
-        *(ushort *)(mgr->lock) = 0;
+        if (reset) *(ushort *)(mgr->lock) = 0;
     
-        for (ushort idx = 1; idx <= mgr->latchdeployed; idx++) {
+        for (uint idx = 1; idx < mgr->latchtotal; idx++) {
             latch = mgr->latchsets + idx;
             if (*latch->readwr->rin & MASK) {
                 std::cerr <<  "latchset " << idx << " rwlocked for page "
                             << latch->page_no << std::endl;
             }
     
-            memset( (ushort *)latch->readwr, 0, sizeof(BLT_RWLock) );
+            if (reset) memset( (ushort *)latch->readwr, 0, sizeof(BLT_RWLock) );
     
             if (*latch->access->rin & MASK) {
                 std::cerr <<  "latchset " << idx << " accesslocked for page "
                             << latch->page_no << std::endl;
             }
     
-            memset( (ushort *)latch->access, 0, sizeof(BLT_RWLock) );
+            if (reset) memset( (ushort *)latch->access, 0, sizeof(BLT_RWLock) );
     
             if (*latch->parent->rin & MASK) {
                 std::cerr <<  "latchset " << idx << " parentlocked for page "
                             << latch->page_no << std::endl;
             }
     
-            memset( (ushort *)latch->parent, 0, sizeof(BLT_RWLock) );
+            if (reset) memset( (ushort *)latch->parent, 0, sizeof(BLT_RWLock) );
     
             if (latch->pin) {
                 std::cerr <<  "latchset " << idx << " pinned for page "
                             << latch->page_no << std::endl;
-                latch->pin = 0;
+                if (reset) latch->pin = 0;
             }
         }
     
-        for (ushort hashidx = 0; hashidx < mgr->latchhash; hashidx++) {
+        for (uint hashidx = 0; hashidx < mgr->latchhash; hashidx++) {
             if (*(ushort *)(mgr->hashtable[hashidx].latch)) {
                   std::cerr <<  "hash entry " << hashidx << " locked" << std::endl;
             }
       
-            *(ushort *)(mgr->hashtable[hashidx].latch) = 0;
+            if (reset) *(ushort *)(mgr->hashtable[hashidx].latch) = 0;
       
             ushort idx;
             if ( (idx = mgr->hashtable[hashidx].slot) ) {
@@ -1649,16 +2806,38 @@ namespace mongo {
         }
     
         uid page_no = LEAF_page;
+
+        // an in-memory btree's pages are its pool frames
+        if (mgr->memory) {
+            uid maxpage = std::min( (uid)mgr->memnext, (uid)mgr->latchtotal );
+
+            for ( ; page_no < maxpage; page_no++) {
+                Page* page = (Page*)(mgr->pagepool + (page_no << mgr->page_bits));
+
+                if (!page->free && !page->lvl) {
+                    cnt += page->act;
+                }
+            }
+            page_no = BLTVal::getid( mgr->pagezero->alloc->right );
+        }
     
         while (page_no < BLTVal::getid( mgr->pagezero->alloc->right)) {
-            uid off = page_no << mgr->page_bits;
+            off64_t off;
+            uint file = mgr->pagefile( page_no, &off );
 
     #ifdef unix
-            pread (mgr->idx, frame, mgr->page_size, off);
+            // pages reserved in an extent may not be written yet,
+            // and a compressed last page ends the file early
+            memset( frame, 0, mgr->page_size );
+            pread (mgr->files[file], frame, mgr->page_size, off);
+
+            if (mgr->unpackpage( frame, mgr->page_size, page_no )) {
+                memset( frame, 0, mgr->page_size );
+            }
     #else
             DWORD amt[1];
-            SetFilePointer (mgr->idx, (long)off, (long*)(&off)+1, FILE_BEGIN);
-            if (!ReadFile(mgr->idx, frame, mgr->page_size, amt, NULL)) {
+            SetFilePointer (mgr->files[file], (long)off, (long*)(&off)+1, FILE_BEGIN);
+            if (!ReadFile(mgr->files[file], frame, mgr->page_size, amt, NULL)) {
                 return (err = BLTERR_map);
             }
             if (*amt <  mgr->page_size ) {
@@ -1678,5 +2857,270 @@ namespace mongo {
         return 0;
     }
 
+    //
+    //  crash recovery
+    //
+
+    /**
+    *  redo replay thread argument
+    */
+    struct RedoArg {
+        BufMgr* mgr;                    // buffer manager being recovered
+        std::vector< RedoRec* > recs;   // records for this thread, in lsn order
+        BLTERR err;                     // replay result
+    };
+
+    #define REDO_batch  (16 * REDO_buff)    // redo records read per replay pass
+
+    /**
+    *  FUNCTION:  recover
+    *
+    *  bring the btree to a consistent state after an unclean close:
+    *  complete fence postings of interrupted splits and deletes, then
+    *  replay the redo log from the last clean point. Records are
+    *  partitioned across threads by key, so each key is replayed in
+    *  log order.
+    */
+    BLTERR BLTree::recover( BufMgr* mgr, uint threads ) {
+        RedoLog* redo = mgr->redo;
+        BLTERR err;
+
+        if (!mgr->unclean) return BLTERR_ok;
+        if (!threads) threads = 1;
+
+        std::cerr << "Recovering from unclean shutdown" << std::endl;
+
+        BLTree* tree = create( mgr );
+
+        // replayed changes must not be logged again
+        mgr->redo = NULL;
+        err = tree->recoverfences();
+        tree->close();
+        free( tree );
+
+        if (err || !redo) {
+            mgr->redo = redo;
+            return err;
+        }
+
+        uchar* batch = (uchar*)malloc( REDO_batch );
+        RedoArg* args = new RedoArg[threads];
+        pthread_t tid[threads];
+        uid lsn = *mgr->pagezero->redolsn;
+        uid maxdup = 0;
+        uid count = 0;
+        uint len = 1;
+
+        while (len && !err) {
+            uint off = 0;
+
+            for (uint idx = 0; idx < threads; idx++) {
+                args[idx].mgr = mgr;
+                args[idx].recs.clear();
+                args[idx].err = BLTERR_ok;
+            }
+
+            // read a batch of records and partition them by key,
+            // the records of an atomic batch are partitioned singly
+            while ( (len = redo->read( lsn, (RedoRec*)(batch + off), REDO_batch - off )) ) {
+                RedoRec* rec = (RedoRec*)(batch + off);
+                uchar* next = (uchar*)rec;
+                uchar* end = next + len;
+
+                if (RedoLog::Batch == rec->op) {
+                    next = rec->data;
+                    end = next + rec->vallen;
+                }
+
+                while (next < end) {
+                    rec = (RedoRec*)next;
+                    next += rec->len;
+
+                    if (RedoLog::Insert == rec->op && Slot::Duplicate == rec->type) {
+                        uid dup = BLTVal::getid( rec->data + rec->keylen - BtId );
+                        if (dup > maxdup) maxdup = dup;
+                    }
+
+                    args[RedoLog::checksum( rec->data, rec->keylen ) % threads].recs.push_back( rec );
+                    count++;
+                }
+
+                lsn += len;
+                off += len;
+            }
+
+            // a record too big for the rest of the batch is read next pass
+            if (off) len = 1;
+
+            for (uint idx = 0; idx < threads; idx++) {
+                pthread_create( &tid[idx], NULL, BLTree::replay, &args[idx] );
+            }
+
+            for (uint idx = 0; idx < threads; idx++) {
+                pthread_join( tid[idx], NULL );
+                if (args[idx].err) err = args[idx].err;
+            }
+        }
+
+        free( batch );
+        delete [] args;
+
+        if (maxdup > *mgr->pagezero->dups) {
+            *mgr->pagezero->dups = maxdup;
+        }
+
+        std::cerr << count << " redo records replayed" << std::endl;
+
+        // once the replayed tree is on disk the log is
+        // discarded, including any torn tail
+        if (!err) {
+            err = mgr->flushpages();
+        }
+
+        if (!err && !(err = redo->truncate( 0 ))) {
+            *mgr->pagezero->redolsn = 0;
+            mgr->unclean = 0;
+        }
+
+        mgr->redo = redo;
+        return err;
+    }
+
+    /**
+    *  FUNCTION:  replay
+    *
+    *  redo thread: apply one partition of a batch of log records
+    */
+    void* BLTree::replay( void* arg ) {
+        RedoArg* args = (RedoArg*)arg;
+        uchar newkey[KEYARRAY];
+        BLTKey* ins = (BLTKey*)newkey;
+        BLTree* tree = create( args->mgr );
+
+        // a value's overflow pages on disk may predate pages
+        // freed and reused before the crash, so they are leaked
+        tree->replaying = 1;
+
+        for (uint idx = 0; idx < args->recs.size() && !args->err; idx++) {
+            RedoRec* rec = args->recs[idx];
+
+            if (RedoLog::Delete == rec->op) {
+                args->err = tree->deletekey( rec->data, rec->keylen, 0 );
+                continue;
+            }
+
+            memcpy( ins->key, rec->data, rec->keylen );
+            ins->len = rec->keylen;
+            args->err = tree->insertentry( ins, 0, rec->data + rec->keylen, rec->vallen,
+                                            rec->type, 1 );
+        }
+
+        tree->close();
+        free( tree );
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION:  recoverfences
+    *
+    *  walk each level left to right, and post any fence key missing
+    *  from the parent level, completing interrupted splits and
+    *  deletes. Right links are checked before they are followed.
+    */
+    BLTERR BLTree::recoverfences() {
+        uchar fence[KEYARRAY];
+        uchar value[BtId];
+        PageSet parent[1];
+        PageSet set[1];
+        uint fixed = 0;
+        uid page_no;
+        uid right;
+        BLTKey* ptr;
+        uint slot;
+
+        if ( (set->latch = mgr->pinlatch( ROOT_page, 1, &reads, &writes )) ) {
+            set->page = mgr->mappage( set->latch );
+        }
+        else {
+            return (err = mgr->err);
+        }
+
+        uint height = set->page->lvl;
+        mgr->unpinlatch( set->latch );
+
+        for (uint lvl = 0; lvl < height; lvl++) {
+
+            // start with the leftmost page of the level
+            if ( !mgr->loadpage( set, (uchar*)"", 0, lvl, LockRead, &reads, &writes ) ) {
+                return (err = mgr->err);
+            }
+
+            do {
+                page_no = set->latch->page_no;
+                ptr = keyptr(set->page, set->page->cnt);
+                memcpy( fence, ptr, ptr->len + sizeof(BLTKey) );
+                right = BLTVal::getid( set->page->right );
+
+                BufMgr::unlockpage( LockRead, set->latch );
+                mgr->unpinlatch( set->latch );
+
+                // is our fence posted in the parent, pointing at us?
+                ptr = (BLTKey*)fence;
+
+                if ( !(slot = mgr->loadpage( parent, ptr->key, ptr->len, lvl+1, LockRead,
+                                                &reads, &writes )) ) {
+                    return (err = mgr->err);
+                }
+
+                if (Slot::Librarian == slotptr(parent->page, slot)->type) slot++;
+
+                uint posted = !slotptr(parent->page, slot)->dead
+                    && !BLTKey::keycmp( keyptr(parent->page, slot), ptr->key, ptr->len )
+                    && BLTVal::getid( valptr(parent->page, slot)->value ) == page_no;
+
+                BufMgr::unlockpage( LockRead, parent->latch );
+                mgr->unpinlatch( parent->latch );
+
+                if (!posted) {
+                    BLTVal::putid( value, page_no );
+                    if (insertkey( ptr->key, ptr->len, lvl+1, value, BtId, 1 )) {
+                        return err;
+                    }
+                    fixed++;
+                }
+
+                if (!right) break;
+
+                if (right >= BLTVal::getid( mgr->pagezero->alloc->right )) {
+                    std::cerr << "Page " << page_no << " links to unallocated page "
+                                << right << std::endl;
+                    return (err = BLTERR_struct);
+                }
+
+                if ( (set->latch = mgr->pinlatch( right, 1, &reads, &writes )) ) {
+                    set->page = mgr->mappage( set->latch );
+                }
+                else {
+                    return (err = mgr->err);
+                }
+
+                BufMgr::lockpage( LockRead, set->latch );
+
+                if (set->page->free || set->page->kill || set->page->lvl != lvl) {
+                    std::cerr << "Page " << page_no << " links to invalid page "
+                                << right << std::endl;
+                    BufMgr::unlockpage( LockRead, set->latch );
+                    mgr->unpinlatch( set->latch );
+                    return (err = BLTERR_struct);
+                }
+
+            } while ( true );
+        }
+
+        std::cerr << fixed << " fence keys reposted" << std::endl;
+        return BLTERR_ok;
+    }
+
 }   // namespace mongo
 
+
@@ -82,12 +82,19 @@ namespace mongo {
     };
 
 
+    #define DEFRAG_report   1024    // leaves moved between defrag progress reports
+    #define DEFRAG_least    8       // fewest free pages a defrag run starts in
+    #define OVFL_max        (1 << 23)   // largest value, its redo record must fit a replay batch
+
     class BLTree {
     public:
         // factory method
         static BLTree* create( BufMgr* mgr );
         void close();
 
+        // crash recovery at open
+        static BLTERR recover( BufMgr* mgr, uint threads );
+
         ~BLTree();
 
     public:
@@ -106,6 +113,19 @@ namespace mongo {
         // return current key
         BLTKey* foundkey();
 
+        // copy the value of a cursor slot
+        int foundvalue( uint slot, uchar* val, uint valmax );
+
+        // move live pages off the end of the file and shrink it
+        uid shrink( uint maxmoves );
+
+        // move leaves into key order on disk, online
+        uid defrag( uint maxmoves, uint pause );
+
+        // collect the head of the value log, or in the background
+        uid vlogcollect( uid bytes );
+        static BLTERR collector( BufMgr* mgr, uint secs, uint pct );
+
         // for debugging
         uint latchaudit();
         //void scan( std::ostream& );
@@ -115,6 +135,8 @@ namespace mongo {
         Status collapseroot( PageSet *root );
         Status splitroot( PageSet* root, LatchSet* right);
         Status deletepage( PageSet* set, BLTLockMode mode );
+        int    relocate( uid page_no, PageExtent* ext = NULL );
+        uid    leftsibling( BLTKey* fence, uint lvl, uid page_no );
         uint   splitpage( PageSet* set );
         uint   cleanpage( PageSet* set, uint keylen, uint slot, uint vallen );
 
@@ -126,14 +148,33 @@ namespace mongo {
         Status atomicdelete( Page* source, AtomicMod* locks, uint src );
         Status atomicinsert( Page* source, AtomicMod* locks, uint src );
     
+        BLTERR logredo( PageSet* set, uint op, uint type,
+                        uchar* key, uint keylen, uchar* value, uint vallen );
+        BLTERR insertentry( BLTKey* ins, uint lvl, uchar* value, uint vallen,
+                                uint type, uint uniq );
+        BLTERR insertvalue( BLTKey* ins, uint lvl, uchar* value, uint vallen,
+                                uint type, uint uniq, uchar* logval, uint loglen, uint ovfl );
+
+        // crash recovery support
+        BLTERR recoverfences();
+        static void* replay( void* arg );
+
         Status insertslot( PageSet* set, uint slot,
                                 uchar *key, uint keylen,
                                 uchar* value, uint vallen,
-                                uint type, uint release);
+                                uint type, uint release, uint ovfl = 0);
+
+        // values spilled to overflow pages or the value log
+        BLTERR ovflwrite( BLTKey* ins, uchar* value, uint vallen, uchar* stub, uint ovfl );
+        int    ovflread( uint ovfl, uchar* stub, uchar* value, uint valmax );
+        void   ovflfree( uint ovfl, uchar* stub );
+        uint   vlogmove( uchar* key, uint keylen, uid off, uid newoff );
+        static void* gcthread( void* arg );
 
         Status splitkeys( PageSet* set, LatchSet* right );
 
         uint findnext( PageSet* set, uint slot );
+        void readahead( uint missed );
         void freepage( PageSet* set );
 
         BLTKey* getKey( uint slot );
@@ -150,6 +191,11 @@ namespace mongo {
         uchar   key[KEYARRAY];      // last found complete key
         uint     reads;             // number of reads from the btree
         uint     writes;            // number of reads to   the btree
+        PageExtent extent[1];       // pages reserved for this thread's splits
+        uint    rarun;              // pages the cursor has stepped right
+        uint    rawindow;           // current read-ahead window in pages
+        uint    raleft;             // cursor steps before the next read-ahead
+        uint    replaying;          // redo replay, replaced overflow pages are left alone
     };
 
 }   // namespace mongo
@@ -51,6 +51,10 @@ namespace mongo {
     *       poolSize    4096
     *       segBits     5
     *       hashSize    4096
+    *       ckptSecs    60
+    *       ckptBytes   268435456
+    *       residentLvl 1
+    *       residentLock 0
     */
     Status BLTreeEngine::parseConfig(
         const std::string& path,    // expected to include trailing '/'
@@ -78,16 +82,70 @@ namespace mongo {
             else if ("poolSize"==key) conf->_poolSize = strtoul( val.c_str(), NULL, 10 );
             else if ("segBits" ==key) conf->_segBits  = strtoul( val.c_str(), NULL, 10 );
             else if ("hashSize"==key) conf->_hashSize = strtoul( val.c_str(), NULL, 10 );
+            else if ("ckptSecs"==key) conf->_ckptSecs = strtoul( val.c_str(), NULL, 10 );
+            else if ("ckptBytes"==key) conf->_ckptBytes = strtoull( val.c_str(), NULL, 10 );
+            else if ("residentLvl"==key) conf->_residentLvl = strtoul( val.c_str(), NULL, 10 );
+            else if ("residentLock"==key) conf->_residentLock = strtoul( val.c_str(), NULL, 10 );
+            else if ("syncSecs"==key) conf->_syncSecs = strtoul( val.c_str(), NULL, 10 );
+            else if ("tierBytes"==key) conf->_tierBytes = strtoull( val.c_str(), NULL, 10 );
+            else if ("cacheFile"==key) conf->_cacheFile = val;
+            else if ("cacheBytes"==key) conf->_cacheBytes = strtoull( val.c_str(), NULL, 10 );
+            else if ("durability"==key) {
+                     if ("none"==val) conf->_durable = DURABLE_none;
+                else if ("periodic"==val) conf->_durable = DURABLE_periodic;
+                else if ("commit"==val) conf->_durable = DURABLE_commit;
+            }
         }
     }
 
     BLTreeEngine::BLTreeEngine( const std::string& path ) : _path( path )
+    {
+    }
+
+    Status BLTreeEngine::open()
     {
         BLTConfig conf;
+        conf._ckptSecs = 0;
+        conf._ckptBytes = 0;
+        conf._residentLvl = 1;
+        conf._residentLock = 0;
+        conf._durable = DURABLE_periodic;
+        conf._syncSecs = 1;
+        conf._tierBytes = 0;
+        conf._cacheBytes = 0;
         parseConfig( _path, &conf );
         BufMgr* mgr = BufMgr::create( conf._metaName, conf._openMode, conf._pageBits,
                                       conf._poolSize, conf._segBits, conf._hashSize );
-        _blt = BLTree::create( mgr );
+        if (!mgr) {
+            return Status( ErrorCodes::InternalError, "BLTree buffer manager open error" );
+        }
+
+        // replay the redo log if the last shutdown was unclean,
+        // serving an unrecovered tree would lose acknowledged writes
+        if (BLTree::recover( mgr, 4 )) {
+            mgr->close();
+            return Status( ErrorCodes::InternalError, "BLTree redo log recovery error" );
+        }
+
+        if (mgr->checkpointer( conf._ckptSecs, conf._ckptBytes ) ||
+            mgr->durability( conf._durable, conf._syncSecs ) ||
+            mgr->tier( conf._tierBytes )) {
+            mgr->close();
+            return Status( ErrorCodes::InternalError, "BLTree buffer manager setup error" );
+        }
+        mgr->residency( conf._residentLvl, conf._residentLock );
+
+        if (conf._cacheBytes && conf._cacheFile.length()) {
+            if (mgr->cachefile( conf._cacheFile.c_str(), conf._cacheBytes )) {
+                mgr->close();
+                return Status( ErrorCodes::InternalError, "BLTree cache file open error" );
+            }
+        }
+
+        // warm the pool from the last hot page set while serving
+        mgr->warmup( 4, 1 );
+        _blt.reset( BLTree::create( mgr ) );
+        return Status::OK();
     }
 
     BLTreeEngine::~BLTreeEngine() {
@@ -180,8 +238,14 @@ namespace mongo {
     //
     int BLTreeEngine::flushAllFiles( bool sync )
     {
-        // stubbed
-        return 0;
+        uint num = 0;
+
+        // write back the dirty pages, waiting for the disk if sync
+        if (_blt->mgr->writeback( &num, sync ? 2 : 1 )) {
+            return 0;
+        }
+
+        return 1;
     }
 
     Status BLTreeEngine::repairDatabase(
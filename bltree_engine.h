@@ -54,6 +54,9 @@ namespace mongo {
         BLTreeEngine( const std::string& path );
         virtual ~BLTreeEngine();
 
+        // open the tree and replay its redo log, call before any other use
+        Status open();
+
         virtual void           listDatabases   ( DBNameList* ) const;
         virtual int            flushAllFiles   ( bool sync );
         virtual RecoveryUnit*  newRecoveryUnit ( OperationContext* );
@@ -104,6 +107,15 @@ namespace mongo {
         uint _poolSize;             // number of segments
         uint _segBits;              // lg( segment size in pages )
         uint _hashSize;             // segment hash table size
+        uint _ckptSecs;             // seconds between checkpoints, or zero
+        uid _ckptBytes;             // dirty bytes that force a checkpoint, or zero
+        uint _residentLvl;          // levels from here up stay in the pool, or zero
+        uint _residentLock;         // also mlock the resident levels
+        uint _durable;              // DURABLE_ mode of the btree file
+        uint _syncSecs;             // seconds between periodic syncs
+        uid _tierBytes;             // compressed tier of evicted pages, or zero
+        std::string _cacheFile;     // secondary cache file on local storage
+        uid _cacheBytes;            // secondary cache file size, or zero
 
    };
 
@@ -34,6 +34,7 @@
 #include "mongo/base/init.h"
 #include "mongo/db/global_environment_experiment.h"
 #include "mongo/db/storage_options.h"
+#include "mongo/util/assert_util.h"
 
 namespace mongo {
 
@@ -42,7 +43,13 @@ namespace mongo {
         public:
             virtual ~BLTreeFactory(){}
             virtual StorageEngine* create( const StorageGlobalParams& params ) const {
-                return new BLTreeEngine( params.dbpath );
+                BLTreeEngine* engine = new BLTreeEngine( params.dbpath );
+                Status status = engine->open();
+                if (!status.isOK()) {
+                    delete engine;
+                    uassertStatusOK( status );
+                }
+                return engine;
             }
         };
     } // namespace
@@ -103,6 +103,9 @@ namespace mongo {
             if (_depth == change.getDepth()) change->commit();
         }
         changev.clear();
+
+        // make the unit durable when the engine syncs on commit
+        _db->mgr->commit();
     }
 
     void BLTreeRecoveryUnit::endUnitOfWork() {
@@ -129,7 +132,7 @@ namespace mongo {
     }
 
     bool BLTreeRecoveryUnit::awaitCommit() {
-        return true;
+        return !_db->mgr->sync( 1 );
     }
 
     // stubs
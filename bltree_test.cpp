@@ -53,9 +53,7 @@
 #include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/bltree/common.h"
 #include "mongo/db/storage/bltree/blterr.h"
-#include "mongo/db/storage/bltree/bltkey.h"
 #include "mongo/db/storage/bltree/bltree.h"
-#include "mongo/db/storage/bltree/bltval.h"
 #include "mongo/db/storage/bltree/bufmgr.h"
 #include "mongo/db/storage/bltree/logger.h"
 #include "mongo/db/storage/record_store.h"
@@ -63,13 +61,12 @@
 #else
 #include "common.h"
 #include "blterr.h"
-#include "bltkey.h"
 #include "bltree.h"
-#include "bltval.h"
 #include "bufmgr.h"
 #include "logger.h"
 #endif
 
+#include <algorithm>
 #include <errno.h>
 #include <fstream>
 #include <iostream>
@@ -134,12 +131,28 @@ namespace mongo {
 
         }
 
+        //
+        // print write latency percentiles in microseconds
+        //
+        static void printLatency( vector<uint>& lat ) {
+            if (lat.empty()) return;
+
+            std::sort( lat.begin(), lat.end() );
+            cout << " write latency usecs:"
+                 << " p50 " << lat[ lat.size() * 50 / 100 ]
+                 << " p90 " << lat[ lat.size() * 90 / 100 ]
+                 << " p99 " << lat[ lat.size() * 99 / 100 ]
+                 << " p99.9 " << lat[ lat.size() * 999 / 1000 ]
+                 << " max " << lat.back() << endl;
+        }
+
         typedef struct {
             char type;
             char idx;
             char *infile;
             BufMgr* mgr;
             const char* thread;
+            uint errors;            // keys missing or read back wrong
         } ThreadArg;
 
         //
@@ -151,17 +164,17 @@ namespace mongo {
             int cnt   = 0;
             int len   = 0;
 
-            uid next;
-            uid page_no = LEAF_page;   // start on first page of leaves
+            uint slot;
             unsigned char key[256];
-            PageSet set[1];
             BLTKey* ptr;
-            BLTVal* val;
             BufMgr* mgr = args->mgr;
             FILE* in;
             int ch;
         
             BLTree* bt = BLTree::create( mgr );
+
+            // spread the threads across the pool's NUMA nodes
+            mgr->bindthread( args->idx );
         
             switch(args->type | 0x20) {
             case 'a': {
@@ -179,13 +192,13 @@ namespace mongo {
                             count++;
 
                         #ifndef STANDALONE
-                            Status s = bt->insertkey( key, 10, 0, key + 10, len - 10 );
+                            Status s = bt->insertkey( key, 10, 0, key + 10, len - 10, 1 );
                             if (!s.isOK()) {
                                 cerr << "Error " << bt->err << " Line: " << count << endl;
                                 exit( -1 );
                             }
                         #else
-                            if (bt->insertkey( key, 10, 0, key + 10, len - 10 )) {
+                            if (bt->insertkey( key, 10, 0, key + 10, len - 10, 1 )) {
                                 cerr << "Error " << bt->err << " Line: " << count << endl;
                                 exit( -1 );
                             }
@@ -213,6 +226,8 @@ namespace mongo {
                     break;
                 }
                 string line;
+                vector<uint> lat;
+                timeval t0, t1;
                 while (!in.eof()) {
                     getline( in, line);
                     if (0==line.size()) continue;
@@ -224,23 +239,33 @@ namespace mongo {
                     string key = line.substr( 0, n );
                     string val = line.substr( n+1 );
                     size_t m = line.size() - (n+1);
+                    gettimeofday( &t0, NULL );
 
                 #ifndef STANDALONE
-                    Status s = bt->insertkey( (uchar*)key.c_str(), n, 0, (uchar*)val.c_str(), m );
+                    Status s = bt->insertkey( (uchar*)key.c_str(), n, 0, (uchar*)val.c_str(), m, 1 );
                     if (!s.isOK()) {
                         cerr << "Error on line: " << line << endl;
+                        args->errors++;
                     }
                 #else
-                    if (bt->insertkey( (uchar*)key.c_str(), n, 0, (uchar*)val.c_str(), m )) {
+                    if (bt->insertkey( (uchar*)key.c_str(), n, 0, (uchar*)val.c_str(), m, 1 )) {
                         cerr << "Error on line: " << line << endl;
+                        args->errors++;
                     }
                 #endif
+
+                    // each write commits under the durability mode
+                    mgr->commit();
+                    gettimeofday( &t1, NULL );
+                    lat.push_back( (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec );
                 }
+                printLatency( lat );
                 break;
             }
             case 'd': {
                 cout << "started deleting keys for " << args->infile << endl; 
                 uint32_t count = 0;
+                int intab = 0;      // past the key of a key<tab>value line
                 if ( (in = fopen( args->infile, "rb" )) ) {
                     while (ch = getc(in), ch != EOF) {
                         if( ch == '\n' ) {
@@ -260,8 +285,12 @@ namespace mongo {
                         #endif
 
                             len = 0;
+                            intab = 0;
                         }
-                        else if (len < 255) {
+                        else if (ch == '\t') {
+                            intab = 1;
+                        }
+                        else if (!intab && len < 255) {
                             key[len++] = ch;
                         }
                     }
@@ -283,8 +312,13 @@ namespace mongo {
                 string line;
                 uint32_t nlines = 0;
                 uint32_t found = 0;
-                char valbuf[128];
-                uint32_t vallen;
+                char* valbuf = (char *)malloc( OVFL_max );
+                int vallen;
+                if (!valbuf) {
+                    cerr << "unable to allocate a value buffer" << endl;
+                    args->errors++;
+                    break;
+                }
                 while (!in.eof()) {
                     getline( in, line );
                     if (0==line.size()) continue;
@@ -295,99 +329,142 @@ namespace mongo {
                     }
                     ++nlines;
                     string key = line.substr( 0, n );
-                    if ( (vallen = bt->findkey( (uchar*)key.c_str(), n, (uchar*)valbuf, 128 )) ) {
-                        cout << key << " -> " << string( valbuf, vallen ) << endl;
+
+                    // each key must read back the value written for it
+                    vallen = bt->findkey( (uchar*)key.c_str(), n, (uchar*)valbuf, OVFL_max );
+                    if (vallen >= 0 && string( valbuf, vallen ) == line.substr( n+1 )) {
                         found++;
                     }
+                    else {
+                        cerr << "key " << key << " read back wrong, length " << vallen << endl;
+                        args->errors++;
+                    }
                 }
+                free( valbuf );
                 cerr << "finished " << args->infile << " for " << nlines << " keys, found " << found << endl;
                 break;
             }
             case 's': {
                 cerr << "started scanning" << endl;
-                do {
-                    if ( (set->pool = bt->mgr->pinpool( page_no )) ) {
-                        set->page = bt->mgr->page( set->pool, page_no );
-                    }
-                    else {
-                        break;
-                    }
-                    set->latch = bt->mgr->pinlatch( page_no );
-                    bt->mgr->lockpage( LockRead, set->latch );
-                    next = BLTVal::getid( set->page->right );
-                    cnt += set->page->act;
-        
-                    for (unsigned int slot = 0; slot++ < set->page->cnt; ) {
-                        if (next || slot < set->page->cnt) {
-                            if (!slotptr(set->page, slot)->dead) {
-                                ptr = keyptr(set->page, slot);
-                                fwrite( ptr->key, ptr->len, 1, stdout );
-                                fputc( ' ', stdout );
-                                fputc( '-', stdout );
-                                fputc( '>', stdout );
-                                fputc( ' ', stdout );
-                                val = valptr( set->page, slot );
-                                fwrite( val->value, val->len, 1, stdout );
-                                fputc( '\n', stdout );
-                            }
+                uchar* valbuf = (uchar *)malloc( OVFL_max );
+                if (!valbuf) {
+                    cerr << "unable to allocate a value buffer" << endl;
+                    args->errors++;
+                    break;
+                }
+
+                // the cursor skips dead slots and the stopper key
+                if (bt->startkey( key, 0 )) {
+                    for (slot = bt->nextkey( 0 ); slot; slot = bt->nextkey( slot )) {
+                        ptr = keyptr(bt->cursor, slot);
+                        int vallen = bt->foundvalue( slot, valbuf, OVFL_max );
+                        fwrite( ptr->key, ptr->len, 1, stdout );
+                        fputc( ' ', stdout );
+                        fputc( '-', stdout );
+                        fputc( '>', stdout );
+                        fputc( ' ', stdout );
+                        if (vallen > 0) {
+                            fwrite( valbuf, vallen, 1, stdout );
                         }
+                        fputc( '\n', stdout );
+                        cnt++;
                     }
-                    bt->mgr->unlockpage( LockRead, set->latch );
-                    bt->mgr->unpinlatch( set->latch );
-                    bt->mgr->unpinpool( set->pool );
-                } while ( (page_no = next) );
-        
-                cnt--;    // remove stopper key
+                }
+
+                free( valbuf );
                 cout << " Total keys read " << cnt << endl;
                 break;
             }
             case 'c':
-                //posix_fadvise( bt->mgr->idx, 0, 0, POSIX_FADV_SEQUENTIAL);
-        
                 cout << "started counting" << endl;
-                next = bt->mgr->latchmgr->nlatchpage + LATCH_page;
-                page_no = LEAF_page;
-        
-                while (page_no < BLTVal::getid( bt->mgr->latchmgr->alloc->right )) {
-                    uid off = page_no << bt->mgr->page_bits;
-                    pread( bt->mgr->idx, bt->frame, bt->mgr->page_size, off );
-                    if (!bt->frame->free && !bt->frame->lvl) {
-                        cnt += bt->frame->act;
-                    }
-                    if (page_no > LEAF_page) {
-                        next = page_no + 1;
+
+                if (bt->startkey( key, 0 )) {
+                    for (slot = bt->nextkey( 0 ); slot; slot = bt->nextkey( slot )) {
+                        cnt++;
                     }
-                    page_no = next;
                 }
-                
-                cnt--;    // remove stopper key
+
                 cout << " Total keys read " << cnt  << endl;
                 break;
+            case 'k': {
+                // the source names the most pages to move
+                uint maxmoves = strtoul( args->infile, NULL, 10 );
+                cout << "started shrinking the file, moving up to " << maxmoves << " pages" << endl;
+                uid trimmed = bt->shrink( maxmoves );
+                cout << "finished shrinking, " << trimmed << " pages truncated" << endl;
+                break;
+            }
+            case 'g': {
+                // the source names the most leaves to move
+                uint maxmoves = strtoul( args->infile, NULL, 10 );
+                cout << "started defragmenting the leaves, moving up to " << maxmoves << " leaves" << endl;
+                uid moved = bt->defrag( maxmoves, 0 );
+                cout << "finished defragmenting, " << moved << " leaves moved" << endl;
+                break;
+            }
+            case 'o': {
+                // the source names the most MB of the value log to collect
+                uid bytes = (uid)strtoul( args->infile, NULL, 10 ) << 20;
+                cout << "started collecting the value log, up to " << bytes << " bytes" << endl;
+                uid collected = bt->vlogcollect( bytes );
+                cout << "finished collecting, " << collected << " bytes of the value log collected" << endl;
+                break;
+            }
+            case 'r': {
+                // the source names the new pool size in pages
+                uint nodemax = strtoul( args->infile, NULL, 10 );
+                cout << "started resizing the pool to " << nodemax << " pages" << endl;
+
+                if (mgr->resize( nodemax )) {
+                    cerr << "Error resizing the pool to " << nodemax << endl;
+                    args->errors++;
+                }
+                break;
+            }
             }
         
             bt->close();
             return NULL;
         }
 
+        //
+        // thread command letter, the first letter unless
+        // another command already has it
+        //
+        static char cmdtype( const std::string& cmd ) {
+            if (cmd == "Shrink") return 'k';
+            if (cmd == "Defrag") return 'g';
+            if (cmd == "Collect") return 'o';
+            return cmd[0];
+        }
+
         typedef struct timeval timer;
 
         Status drive( const std::string& dbname,  // index file name
                       const std::vector<std::string>& cmdv,  // cmd list 
                       const std::vector<std::string>& srcv,  // source key file list
                       uint pageBits,     // (i.e.) 32KB per page
-                      uint poolSize,     // (i.e.) 4096 segments -> 4GB
-                      uint segBits )     // (i.e.) 32 pages per segment -> 1MB 
+                      uint poolSize,     // (i.e.) 4096 pages -> 128MB
+                      uint ckptSecs = 0,  // checkpoint interval, zero for none
+                      uint durable = DURABLE_none,  // when writes reach the disk
+                      uint tierMB = 0,    // compressed tier of evicted pages
+                      uint cacheMB = 0,   // local cache file of evicted pages
+                      uint flags = 0,     // BUF_ options
+                      uint poolMax = 0,   // largest pool size a Resize may grow to
+                      const std::vector<uint>& phasev = std::vector<uint>(),  // commands per phase
+                      uint gcSecs = 0 )   // background value log collection interval
         {
-            if (poolSize > 65536) {
-                cout << "poolSize too large, defaulting to 65536" << endl;
-                poolSize = 65536;
-            }
-            
             cout <<
                 " dbname = " << dbname <<
                 "\n pageBits = " << pageBits <<
                 "\n poolSize = " << poolSize <<
-                "\n segBits = "  << segBits << std::endl;
+                "\n ckptSecs = " << ckptSecs <<
+                "\n durable = " << durable <<
+                "\n tierMB = " << tierMB <<
+                "\n cacheMB = " << cacheMB <<
+                "\n flags = " << flags <<
+                "\n poolMax = " << poolMax <<
+                "\n gcSecs = " << gcSecs << std::endl;
         
             if (cmdv.size() != srcv.size()) {
 
@@ -395,7 +472,7 @@ namespace mongo {
                 return Status( ErrorCodes::InternalError,
                                 "Need one command per source key file (per thread)." );
             #else
-                return BTERR_struct;
+                return BLTERR_struct;
             #endif
 
             }
@@ -412,7 +489,7 @@ namespace mongo {
             #ifndef STANDALONE
                 return Status::OK();
             #else
-                return BTERR_ok;
+                return BLTERR_ok;
             #endif
 
             }
@@ -425,7 +502,7 @@ namespace mongo {
             #ifndef STANDALONE
                 return Status( ErrorCodes::InternalError, "Cmd count exceeds 100." );
             #else
-                return BTERR_struct;
+                return BLTERR_struct;
             #endif
 
             }
@@ -455,47 +532,101 @@ namespace mongo {
             // allocate buffer pool manager
             char* name = (char *)dbname.c_str();
             BufMgr* mgr = BufMgr::create( name,         // index file name
-                                          BT_rw,        // file open mode
                                           pageBits,     // page size in bits
-                                          poolSize,     // number of segments
-                                          segBits,      // segment size in pages in bits
-                                          poolSize );   // hashSize
+                                          poolSize,     // number of pool pages
+                                          flags,        // BUF_ options
+                                          poolMax );    // largest resized pool
         
             if (!mgr) {
 
             #ifndef STANDALONE
                 return Status( ErrorCodes::InternalError, "Buffer pool create failed." );
             #else
-                return BTERR_struct;
+                return BLTERR_struct;
             #endif
 
             }
 
-            // start threads
-            std::cout << " Starting:" << std::endl;
-            for (uint i = 0; i < cnt; ++i) {
-                std::cout << "  thread " << i << std::endl;
-                args[i].infile = (char *)srcv[i].c_str();
-                args[i].type = cmdv[i][0];   // (i.e.) A/W/D/F/S/C
-                args[i].mgr = mgr;
-                args[i].idx = i;
-                args[i].thread = threadNames[ i+1 ];
-                int err = pthread_create( &threads[i], NULL, BLTreeTestDriver::indexOp, &args[i] );
-                if (err) {
+            // replay the redo log if the last run crashed,
+            // running on an unrecovered tree would lose its writes
+            if (BLTree::recover( mgr, cnt )) {
+                mgr->close();
 
-                #ifndef STANDALONE
-                    return Status( ErrorCodes::InternalError, "Error creating thread" );
-                #else
-                    return BTERR_struct;
-                #endif
+            #ifndef STANDALONE
+                return Status( ErrorCodes::InternalError, "Recovery failed." );
+            #else
+                return BLTERR_struct;
+            #endif
 
-                }
             }
+
+            // never evict interior pages
+            mgr->residency( 1, 0 );
+
+            // reload the pages that were hot at the last close
+            mgr->warmup( cnt, 0 );
+
+            // bound the redo log with background checkpoints,
+            // sync every second for periodic durability,
+            // second chance for evicted pages, compressed in memory
+            int err = mgr->checkpointer( ckptSecs, 0 );
+            if (!err) err = mgr->durability( durable, 1 );
+            if (!err) err = mgr->tier( (uid)tierMB << 20 );
+
+            // collect the value log while half of it is garbage
+            if (!err) err = BLTree::collector( mgr, gcSecs, 50 );
+
+            // and in a cache file next to the index file
+            if (!err && cacheMB) {
+                std::string cachename = dbname + ".cache";
+                err = mgr->cachefile( cachename.c_str(), (uid)cacheMB << 20 );
+            }
+
+            if (err) {
+                mgr->close();
+
+            #ifndef STANDALONE
+                return Status( ErrorCodes::InternalError, "Buffer pool setup failed." );
+            #else
+                return BLTERR_struct;
+            #endif
+
+            }
+
+            // each phase's threads run together, and finish
+            // before the next phase starts
+            for (uint phase = 0, first = 0; first < cnt; ++phase) {
+                uint last = phase < phasev.size() ? std::min( first + phasev[phase], cnt ) : cnt;
+
+                // start threads
+                std::cout << " Starting:" << std::endl;
+                for (uint i = first; i < last; ++i) {
+                    std::cout << "  thread " << i << std::endl;
+                    args[i].infile = (char *)srcv[i].c_str();
+                    args[i].type = cmdtype( cmdv[i] );   // (i.e.) A/W/D/F/S/C
+                    args[i].mgr = mgr;
+                    args[i].idx = i;
+                    args[i].thread = threadNames[ i+1 ];
+                    args[i].errors = 0;
+                    int err = pthread_create( &threads[i], NULL, BLTreeTestDriver::indexOp, &args[i] );
+                    if (err) {
+
+                    #ifndef STANDALONE
+                        return Status( ErrorCodes::InternalError, "Error creating thread" );
+                    #else
+                        return BLTERR_struct;
+                    #endif
+
+                    }
+                }
         
-            // wait for termination
-            std::cout << " Waiting for thread terminations." << std::endl;
-            for (uint idx = 0; idx < cnt; ++idx) {
-                pthread_join( threads[idx], NULL );
+                // wait for termination
+                std::cout << " Waiting for thread terminations." << std::endl;
+                for (uint idx = first; idx < last; ++idx) {
+                    pthread_join( threads[idx], NULL );
+                }
+
+                first = last;
             }
         
             for (uint idx = 0; idx < cnt; ++idx) {
@@ -524,12 +655,28 @@ namespace mongo {
         
             printRUsage();
 
-            BufMgr::destroy( mgr );
+            mgr->close();
+
+            uint errors = 0;
+            for (uint idx = 0; idx < cnt; ++idx) {
+                errors += args[idx].errors;
+            }
+
+            if (errors) {
+                std::cerr << errors << " keys failed" << std::endl;
+
+            #ifndef STANDALONE
+                return Status( ErrorCodes::InternalError, "Keys failed to write or read back." );
+            #else
+                return BLTERR_struct;
+            #endif
+
+            }
 
         #ifndef STANDALONE
             return Status::OK();
         #else
-            return BTERR_ok;
+            return BLTERR_ok;
         #endif
 
         }
@@ -551,7 +698,7 @@ namespace mongo {
         // clear db
         cmdv.push_back( "Clear" );
         srcv.push_back( "" );
-        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096, 5 ) );
+        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096 ) );
         */
 
         // two insert threads
@@ -562,7 +709,7 @@ namespace mongo {
         srcv.push_back( "/home/paulpedersen/dev/bltree/kv.0" );
         srcv.push_back( "/home/paulpedersen/dev/bltree/kv.1" );
 
-        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096, 5 ) );
+        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096 ) );
 
         // five find threads, two insert threads
         /*
@@ -583,7 +730,7 @@ namespace mongo {
         srcv.push_back( "/home/paulpedersen/dev/bltree/keys.5" );
         srcv.push_back( "/home/paulpedersen/dev/bltree/keys.6" );
 
-        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096, 5 ) );
+        ASSERT_OK( driver.drive( "testdb", cmdv, srcv, 15, 4096 ) );
         */
 
     }
@@ -598,28 +745,55 @@ namespace mongo {
 void usage( const char* arg0 ) {
     cout << "Usage: " << arg0  << "OPTIONS\n"
             "  -f dbname      - the name of the index file(s)\n"
-            "  -c cmd         - one of: Audit, Write, Delete, Find, Scan, Count\n"
+            "  -c cmd,cmd,..  - list of: Audit, Write, Delete, Find, Scan, Count, Resize, Shrink, Defrag,\n"
+            "                   Collect,\n"
+            "                   one per thread; each -c is a phase run after the one before\n"
             "  -p PageBits    - page size in bits; default 16\n"
-            "  -n PoolEntrySize    - number of buffer pool mmapped page segments; default 8192\n"
-            "  -s SegBits     - segment size in pages in bits; default 5\n"
-            "  -k k_1,k_2,..  - list of source key files k_i, one per thread" << endl;
+            "  -n PoolSize    - number of buffer pool pages; default 8192\n"
+            "  -t CkptSecs    - seconds between checkpoints; default 0, none\n"
+            "  -y durability  - one of: none, periodic, commit; default none\n"
+            "  -z TierMB      - MB of evicted pages kept compressed in memory; default 0\n"
+            "  -l CacheMB     - MB of evicted pages kept in a local cache file; default 0\n"
+            "  -H             - back the buffer pool with huge pages\n"
+            "  -N             - one buffer pool shard per NUMA node, threads bound to nodes\n"
+            "  -Z             - store pages compressed on disk\n"
+            "  -M             - serve pages from a mapping of the file\n"
+            "  -R             - open read-only, pages are read unlatched\n"
+            "  -S             - share the buffer pool with other processes,\n"
+            "                   only the first process to open it writes\n"
+            "  -m             - keep the btree in the buffer pool only, no file\n"
+            "  -V             - keep long values in a value log beside the file\n"
+            "  -G GcSecs      - seconds between background value log collections; default 0, none\n"
+            "  -x PoolMax     - largest pool size in pages a Resize may grow to; default PoolSize\n"
+            "  -k k_1,k_2,..  - list of source key files k_i, one per thread;\n"
+            "                   the source of a Resize is the new pool size in pages,\n"
+            "                   of a Shrink the most pages to move,\n"
+            "                   of a Defrag the most leaves to move,\n"
+            "                   of a Collect the most MB of the value log to collect" << endl;
 }
 
 int main(int argc, char* argv[] ) {
 
-    string dbname;          // index file name
-    string cmd;             // command = { Audit|Write|Delete|Find|Scan|Count }
+    string dbname = "testdb";   // index file name
+    string cmd;             // command = { Audit|Write|Delete|Find|Scan|Count|Resize|Shrink|Defrag|Collect }
     uint pageBits = 16;     // (i.e.) 32KB per page
-    uint poolSize = 8192;   // (i.e.) 8192 segments
-    uint segBits  = 5;      // (i.e.) 32 pages per segment
+    uint poolSize = 8192;   // (i.e.) 8192 pages
+    uint ckptSecs = 0;      // no background checkpoints
+    uint durable = DURABLE_none;    // kernel write-back
+    uint tierMB = 0;        // no compressed tier
+    uint cacheMB = 0;       // no cache file
+    uint flags = 0;         // BUF_ options
+    uint poolMax = 0;       // no growing past poolSize
+    uint gcSecs = 0;        // no background value log collection
 
     mongo::BLTreeTestDriver driver;
     vector<string> srcv;    // source files containing keys
     vector<string> cmdv;    // corresponding commands
+    vector<uint> phasev;    // commands of each -c, run one phase after another
 
     opterr = 0;
-    char c;
-    while ((c = getopt( argc, argv, "f:c:p:n:s:k:" )) != -1) {
+    int c;
+    while ((c = getopt( argc, argv, "f:c:p:n:k:t:y:z:l:HNZMRSmVG:x:" )) != -1) {
         switch (c) {
         case 'f': { // -f dbName
             dbname = optarg;
@@ -629,11 +803,13 @@ int main(int argc, char* argv[] ) {
             //cmd = optarg;
             char sep[] = ",";
             char* tok = strtok( optarg, sep );
+            uint before = cmdv.size();
             while (tok) {
                 if (strspn( tok, " \t" ) == strlen(tok)) continue;
                 cmdv.push_back( tok );
                 tok = strtok( 0, sep );
             }
+            phasev.push_back( cmdv.size() - before );
             break;
         }
         case 'p': { // -p pageBits
@@ -644,8 +820,62 @@ int main(int argc, char* argv[] ) {
             poolSize = strtoul( optarg, NULL, 10 );
             break;
         }
-        case 's': { // -s segBits
-            segBits = strtoul( optarg, NULL, 10 );
+        case 't': { // -t ckptSecs
+            ckptSecs = strtoul( optarg, NULL, 10 );
+            break;
+        }
+        case 'y': { // -y none|periodic|commit
+            if (!strcmp( optarg, "periodic" )) durable = DURABLE_periodic;
+            else if (!strcmp( optarg, "commit" )) durable = DURABLE_commit;
+            else durable = DURABLE_none;
+            break;
+        }
+        case 'z': { // -z tierMB
+            tierMB = strtoul( optarg, NULL, 10 );
+            break;
+        }
+        case 'l': { // -l cacheMB
+            cacheMB = strtoul( optarg, NULL, 10 );
+            break;
+        }
+        case 'H': { // -H huge pages
+            flags |= BUF_hugepages;
+            break;
+        }
+        case 'N': { // -N NUMA shards
+            flags |= BUF_numa;
+            break;
+        }
+        case 'Z': { // -Z compressed pages
+            flags |= BUF_compress;
+            break;
+        }
+        case 'M': { // -M mapped file
+            flags |= BUF_mmap;
+            break;
+        }
+        case 'R': { // -R read-only
+            flags |= BUF_readonly;
+            break;
+        }
+        case 'S': { // -S shared pool
+            flags |= BUF_shared;
+            break;
+        }
+        case 'm': { // -m in-memory btree
+            flags |= BUF_memory;
+            break;
+        }
+        case 'V': { // -V value log
+            flags |= BUF_vlog;
+            break;
+        }
+        case 'G': { // -G gcSecs
+            gcSecs = strtoul( optarg, NULL, 10 );
+            break;
+        }
+        case 'x': { // -x poolMax
+            poolMax = strtoul( optarg, NULL, 10 );
             break;
         }
         case 'k': { // -k keyFile1,keyFile2,..
@@ -666,10 +896,11 @@ int main(int argc, char* argv[] ) {
         }
     }
 
-    if (driver.drive( "testdb", cmdv, srcv, pageBits, poolSize, segBits )) {
+    if (driver.drive( dbname, cmdv, srcv, pageBits, poolSize, ckptSecs, durable, tierMB, cacheMB, flags, poolMax, phasev, gcSecs )) {
         cout << "driver returned error" << endl;
+        return 1;
     }
-
+    return 0;
 }
 #endif
 
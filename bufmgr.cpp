@@ -67,17 +67,41 @@
 #include <assert.h>
 #endif
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <linux/falloc.h>
 #include <memory.h>
+#include <sched.h>
+#include <signal.h>
 #include <sstream>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#include <vector>
+#include <zlib.h>
 
 namespace mongo {
 
+    /**
+    *  FUNCTION: hashslots
+    *
+    *  @return number of latch hash table slots for a pool
+    *  of nodemax pages, filling whole pages
+    */
+    static uint hashslots( uint nodemax, uint bits ) {
+        uid pages = (nodemax/16 * sizeof(HashEntry) + (1 << bits) - 1) >> bits;
+        return (pages << bits) / sizeof(HashEntry);
+    }
+
     /**
     *   factory method
     *   open/create new BufMgr
@@ -85,8 +109,27 @@ namespace mongo {
     *   @param name  -  file name
     *   @param bits  -  page size in bits
     *   @param nodemax  -  size of page pool
+    *   @param flags  -  BUF_ options
+    *   @param poolmax  -  largest size of page pool after a resize
+    */
+    BufMgr* BufMgr::create( const char* name, uint bits, uint nodemax,
+                                uint flags, uint poolmax ) {
+        return create( &name, 1, bits, nodemax, flags, poolmax );
+    }
+
+    /**
+    *   factory method
+    *   open/create new BufMgr striped across several files
+    *   
+    *   @param names  -  file names, page zero goes in the first
+    *   @param cnt  -  number of files
+    *   @param bits  -  page size in bits
+    *   @param nodemax  -  size of page pool
+    *   @param flags  -  BUF_ options
+    *   @param poolmax  -  largest size of page pool after a resize
     */
-    BufMgr* BufMgr::create( const char* name, uint bits, uint nodemax ) {
+    BufMgr* BufMgr::create( const char** names, uint cnt, uint bits, uint nodemax,
+                                uint flags, uint poolmax ) {
         int flag;               // used for mmap flags
         bool initit = false;    // true => initialize new db
         PageZero* pagezero;     // page_no == 0, the metadata page
@@ -103,26 +146,111 @@ namespace mongo {
     		return NULL;
     	}
     
+    	if (!cnt || cnt > STRIPE_max) {
+    		std::cerr << "Unable to stripe a btree across " << cnt << " files" << std::endl;
+    		return NULL;
+    	}
+
+    	// a mapped file is used page for page as it stands
+    	if ((flags & BUF_mmap) && (cnt > 1 || (flags & BUF_compress))) {
+    		std::cerr << "Unable to map a striped or compressed btree" << std::endl;
+    		return NULL;
+    	}
+
+    	uint readonly = flags & BUF_readonly;
+    	uint memory = flags & BUF_memory;
+
+    	// an in-memory btree has no file to map, share or read
+    	if (memory && (flags & (BUF_mmap | BUF_readonly | BUF_shared))) {
+    		std::cerr << "Unable to map, share or read-only open an in-memory btree" << std::endl;
+    		return NULL;
+    	}
+
+    #ifndef unix
+    	if (memory) {
+    		std::cerr << "Unable to keep a btree in memory only" << std::endl;
+    		return NULL;
+    	}
+    #endif
+
+    	// logged values are appended beside the btree file,
+    	// by a single process
+    	if ((flags & BUF_vlog) && (flags & (BUF_memory | BUF_shared))) {
+    		std::cerr << "Unable to keep a value log for an in-memory or shared btree" << std::endl;
+    		return NULL;
+    	}
+
+    	// processes sharing a pool see each other's changes through it
+    	if ((flags & BUF_shared) && (flags & (BUF_mmap | BUF_readonly))) {
+    		std::cerr << "Unable to share the buffer pool of a mapped or read-only btree" << std::endl;
+    		return NULL;
+    	}
+
     #ifdef unix
     	mgr = (BufMgr*)calloc( 1, sizeof(BufMgr) );
-    	mgr->idx = open( (char*)name, O_RDWR | O_CREAT, 0666 );
+
+    	for (uint file = 0; !memory && file < cnt; file++) {
+    		mgr->files[file] = readonly ? open( (char*)names[file], O_RDONLY )
+                                        : open( (char*)names[file], O_RDWR | O_CREAT, 0666 );
     
-    	if (-1 == mgr->idx) {
-    		std::cerr << "Unable to open btree file" << std::endl;
-    		free( mgr );
-    		return NULL;
+    		if (-1 == mgr->files[file]) {
+    			std::cerr << "Unable to open btree file " << names[file] << std::endl;
+    			while (file--) {
+    				::close( mgr->files[file] );
+    			}
+    			free( mgr );
+    			return NULL;
+    		}
+    	}
+
+    	// an in-memory btree has no file at all
+    	if (memory) {
+    		mgr->files[0] = -1;
+    		cnt = 0;
     	}
+
+    	mgr->idx = mgr->files[0];
+    	mgr->nfiles = cnt;
+    	mgr->lock = mgr->alloclock;
     #else
     	mgr = GlobalAlloc (GMEM_FIXED|GMEM_ZEROINIT, sizeof(BufMgr));
     	uint attr = FILE_ATTRIBUTE_NORMAL;
-    	mgr->idx = CreateFile(name, GENERIC_READ | GENERIC_WRITE,
+
+    	for (uint file = 0; file < cnt; file++) {
+    		mgr->files[file] = CreateFile(names[file], GENERIC_READ | (readonly ? 0 : GENERIC_WRITE),
                                 FILE_SHARE_READ|FILE_SHARE_WRITE,
-                                NULL, OPEN_ALWAYS, attr, NULL);
+                                NULL, readonly ? OPEN_EXISTING : OPEN_ALWAYS, attr, NULL);
     
-    	if (INVALID_HANDLE_VALUE == mgr->idx) {
-    		GlobalFree( mgr );
-    		return NULL;
+    		if (INVALID_HANDLE_VALUE == mgr->files[file]) {
+    			while (file--) {
+    				CloseHandle( mgr->files[file] );
+    			}
+    			GlobalFree( mgr );
+    			return NULL;
+    		}
         }
+
+    	mgr->idx = mgr->files[0];
+    	mgr->nfiles = cnt;
+    	mgr->lock = mgr->alloclock;
+    #endif
+
+    	// page checksums are always written, and checked unless turned off
+    	mgr->verifycrc = !(flags & BUF_nocrc);
+    	mgr->compress = flags & BUF_compress;
+
+    	// a read-only btree changes under no one, so its
+    	// readers take no page latches
+    	mgr->readonly = readonly;
+    	mgr->readmode = readonly ? LockNone : LockRead;
+    	mgr->memory = memory;
+
+    #ifdef unix
+    	pthread_mutex_init( mgr->ramutex, NULL );
+    	pthread_cond_init( mgr->racond, NULL );
+    #else
+    	InitializeCriticalSection( mgr->ramutex );
+    	InitializeConditionVariable( mgr->racond );
     #endif
     
     #ifdef unix
@@ -131,7 +259,7 @@ namespace mongo {
     	// read minimum page size to get root info
     	//	to support raw disk partition files
     	//	check if bits == 0 on the disk.
-    	if ( (size = lseek( mgr->idx, 0L, 2 )) ) {
+    	if (!memory && (size = lseek( mgr->idx, 0L, 2 ))) {
     		if (pread( mgr->idx, pagezero, MINPAGE, 0 ) == MINPAGE) {
     			if (pagezero->alloc->bits) {
     				bits = pagezero->alloc->bits;
@@ -165,17 +293,105 @@ namespace mongo {
     		initit = true;
         }
     #endif
+
+    	// a file of another layout would be misread
+    	if (!initit && pagezero->version != FMT_version) {
+    		std::cerr << "Btree file format version " << pagezero->version
+                        << " is not " << FMT_version << std::endl;
+    #ifdef unix
+    		for (uint file = 0; file < cnt; file++) {
+    			::close( mgr->files[file] );
+    		}
+    		free( mgr );
+    		free( pagezero );
+    #else
+    		for (uint file = 0; file < cnt; file++) {
+    			CloseHandle( mgr->files[file] );
+    		}
+    		GlobalFree( mgr );
+    		VirtualFree( pagezero, 0, MEM_RELEASE );
+    #endif
+    		return NULL;
+    	}
     
     	mgr->page_size = 1 << bits;
     	mgr->page_bits = bits;
+
+    	// a new btree is striped across every file given, an
+    	// existing one opens only with the files it was made with
+    	if (initit && !readonly) {
+    		mgr->stripepages = EXT_pages;
+    	}
+    	else if (initit || std::max( pagezero->stripes, 1U ) != cnt) {
+    		if (initit) {
+    			std::cerr << "Unable to open an empty btree read-only" << std::endl;
+    		}
+    		else {
+    			std::cerr << "Btree is striped across " << std::max( pagezero->stripes, 1U )
+                            << " files, not " << cnt << std::endl;
+    		}
+    #ifdef unix
+    		for (uint file = 0; file < cnt; file++) {
+    			::close( mgr->files[file] );
+    		}
+    		free( mgr );
+    		free( pagezero );
+    #else
+    		for (uint file = 0; file < cnt; file++) {
+    			CloseHandle( mgr->files[file] );
+    		}
+    		GlobalFree( mgr );
+    		VirtualFree( pagezero, 0, MEM_RELEASE );
+    #endif
+    		return NULL;
+    	}
+    	else {
+    		mgr->stripepages = pagezero->stripepages ? pagezero->stripepages : EXT_pages;
+    	}
+
+    	// address space is reserved for the largest pool,
+    	// only the frames in use are ever touched
+    	if (poolmax < nodemax) {
+    		poolmax = nodemax;
+    	}
     
     	// calculate number of latch hash table entries
-    	mgr->nlatchpage = (nodemax/16 * sizeof(HashEntry) + mgr->page_size - 1) / mgr->page_size;
+    	mgr->nlatchpage = (poolmax/16 * sizeof(HashEntry) + mgr->page_size - 1) / mgr->page_size;
     	mgr->latchhash  = ((uid)mgr->nlatchpage << mgr->page_bits) / sizeof(HashEntry);
     
-    	mgr->nlatchpage += nodemax;		// size of the buffer pool in pages
-    	mgr->nlatchpage += (sizeof(LatchSet) * nodemax + mgr->page_size - 1)/mgr->page_size;
-    	mgr->latchtotal  = nodemax;
+    	mgr->nlatchpage += poolmax;		// size of the buffer pool in pages
+    	mgr->nlatchpage += (sizeof(LatchSet) * poolmax + mgr->page_size - 1)/mgr->page_size;
+    	mgr->latchtotal  = poolmax;
+
+    	// hash slots in use start at the size for nodemax
+    	mgr->latchactive = nodemax;
+    	mgr->hashtarget = hashslots( nodemax, bits );
+    	mgr->hashlevel = (uid)mgr->hashtarget << 32;
+
+    #ifdef unix
+    	// an in-memory btree's pages are the pool frames, page
+    	// number and latch slot the same, page zero in slot zero.
+    	// Address space for poolmax pages is reserved, only the
+    	// pages in use are ever touched, and none is evicted.
+    	if (memory) {
+    		mgr->mapsize = (uid)mgr->nlatchpage << mgr->page_bits;
+    		mgr->mapbase = (uchar*)mmap( 0, mgr->mapsize, PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0 );
+
+    		if (MAP_FAILED == mgr->mapbase) {
+    			std::cerr << "Unable to mmap in-memory btree pages, error = "
+                            << errno << std::endl;
+    			free( mgr );
+    			free( pagezero );
+    			return NULL;
+    		}
+
+    		mgr->hashtable = (HashEntry*)mgr->mapbase;
+    		mgr->pagepool = mgr->mapbase
+                            + ((uid)(mgr->nlatchpage - mgr->latchtotal) << mgr->page_bits);
+    		mgr->memnext = MIN_lvl + 1;
+    	}
+    #endif
     
     	if (!initit) goto mgrlatch;
     
@@ -184,6 +400,11 @@ namespace mongo {
     	memset( pagezero, 0, 1 << bits );
     	pagezero->alloc->bits = mgr->page_bits;
     	BLTVal::putid( pagezero->alloc->right, MIN_lvl+1 );
+    	*pagezero->epoch = 1;
+    	pagezero->version = FMT_version;
+    	pagezero->clean = 1;
+    	pagezero->stripes = cnt > 1 ? cnt : 0;
+    	pagezero->stripepages = mgr->stripepages;
     
     	if (mgr->writepage( pagezero->alloc, 0 )) {
     		std::cerr << "Unable to create btree page zero" << std::endl;
@@ -229,10 +450,16 @@ namespace mongo {
     #endif
     
     #ifdef unix
-    	// mlock the pagezero page
     	flag = PROT_READ | PROT_WRITE;
-    	mgr->pagezero = (PageZero*)mmap( 0, mgr->page_size, flag, MAP_SHARED, mgr->idx,
-                                            ALLOC_page << mgr->page_bits );
+
+    	if (memory) {
+    		mgr->pagezero = (PageZero*)mgr->pagepool;
+    		goto mgrpool;
+    	}
+
+    	// mlock the pagezero page, a private copy when read-only
+    	mgr->pagezero = (PageZero*)mmap( 0, mgr->page_size, flag, readonly ? MAP_PRIVATE : MAP_SHARED,
+                                            mgr->idx, ALLOC_page << mgr->page_bits );
     	if (MAP_FAILED == mgr->pagezero) {
     		std::cerr << "Unable to mmap btree page zero, error = "
                         << errno << std::endl;
@@ -240,17 +467,100 @@ namespace mongo {
     		return NULL;
     	}
     	mlock( mgr->pagezero, mgr->page_size );
+
+    	// pages are served from segments of a private mapping of
+    	// the file, each mapped when first used. The pool frames
+    	// go untouched, only the latch table is used.
+    	if (flags & BUF_mmap) {
+    		mgr->mapsegs = (uchar* volatile*)calloc( MMAP_segs, sizeof(uchar*) );
+    		mgr->mappages = lseek( mgr->idx, 0L, 2 ) >> mgr->page_bits;
+
+    		if (!mgr->mapsegs) {
+    			std::cerr << "Unable to allocate file mapping segments" << std::endl;
+    			mgr->close();
+    			return NULL;
+    		}
+
+    		// the segment table covers a file of up to MMAP_segs segments
+    		if (mgr->mappages > ((uid)MMAP_segs << MMAP_segbits) >> mgr->page_bits) {
+    			std::cerr << "Unable to map btree file " << names[0] << ", it is too large" << std::endl;
+    			mgr->close();
+    			return NULL;
+    		}
+    	}
     
-    	mgr->hashtable = (HashEntry *)mmap (0, (uid)mgr->nlatchpage << mgr->page_bits,
-                                                flag, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-    	if (MAP_FAILED==mgr->hashtable) {
+    	size = (uid)mgr->nlatchpage << mgr->page_bits;
+
+    	// a pool shared with other processes sits in a named
+    	// segment, set up by the first process to open it
+    	if (flags & BUF_shared) {
+    		if (mgr->attachpool()) {
+    			mgr->close();
+    			return NULL;
+    		}
+    	}
+
+    	// huge pages: frames sit at page size multiples from a
+    	// 2MB aligned base, so no frame straddles a huge page
+    	else if (flags & BUF_hugepages) {
+    		size = (size + HUGE_size - 1) & ~(off64_t)(HUGE_size - 1);
+
+    #ifdef MAP_HUGETLB
+    		mgr->mapbase = (uchar*)mmap( 0, size, flag,
+                                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0 );
+    		if (MAP_FAILED != mgr->mapbase) {
+    			mgr->hashtable = (HashEntry*)mgr->mapbase;
+    			mgr->mapsize = size;
+    			mgr->hugepages = 2;
+    		}
+    		else {
+    			mgr->mapbase = NULL;
+    		}
+    #endif
+
+    		// else transparent huge pages on an aligned region
+    		if (!mgr->mapbase) {
+    			mgr->mapbase = (uchar*)mmap( 0, size + HUGE_size, flag,
+                                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+    			if (MAP_FAILED == mgr->mapbase) {
+    				mgr->mapbase = NULL;
+    			}
+    			else {
+    				mgr->mapsize = size + HUGE_size;
+    				mgr->hashtable = (HashEntry*)(((uid)mgr->mapbase + HUGE_size - 1)
+                                                    & ~(uid)(HUGE_size - 1));
+    #ifdef MADV_HUGEPAGE
+    				if (!madvise( mgr->hashtable, size, MADV_HUGEPAGE )) {
+    					mgr->hugepages = 1;
+    				}
+    #endif
+    			}
+    		}
+
+    		std::cerr << "Buffer pool of " << (size >> 20) << " MB "
+                        << (2 == mgr->hugepages ? "in hugetlb pages" :
+                            1 == mgr->hugepages ? "advised for transparent huge pages" :
+                            "in normal pages, no huge pages available") << std::endl;
+    	}
+
+    	if (!mgr->mapbase) {
+    		mgr->mapbase = (uchar*)mmap( 0, size, flag, MAP_ANONYMOUS | MAP_SHARED
+                                | (poolmax > nodemax ? MAP_NORESERVE : 0), -1, 0 );
+    		mgr->hashtable = (HashEntry*)mgr->mapbase;
+    		mgr->mapsize = size;
+    	}
+
+    	if (MAP_FAILED == mgr->mapbase) {
     		std::cerr << "Unable to mmap anonymous buffer pool pages, error = "
                         << errno << std::endl;
+    		mgr->mapbase = NULL;
     		mgr->close();
     		return NULL;
     	}
+
+    mgrpool:
     #else
-    	flag = PAGE_READWRITE;
+    	flag = readonly ? PAGE_WRITECOPY : PAGE_READWRITE;
     	mgr->halloc = CreateFileMapping( mgr->idx, NULL, flag, 0, mgr->page_size, NULL );
     	if (!mgr->halloc) {
     		std::cerr << "Unable to create page zero memory mapping, error = "
@@ -259,7 +569,7 @@ namespace mongo {
     		return NULL;
     	}
     
-    	flag = FILE_MAP_WRITE;
+    	flag = readonly ? FILE_MAP_COPY : FILE_MAP_WRITE;
     	mgr->pagezero = MapViewOfFile( mgr->halloc, flag, 0, 0, mgr->page_size );
     	if (!mgr->pagezero) {
     		std::cerr << "Unable to map page zero, error = "
@@ -270,7 +580,31 @@ namespace mongo {
     
     	flag = PAGE_READWRITE;
     	size = (uid)mgr->nlatchpage << mgr->page_bits;
-    	mgr->hpool = CreateFileMapping( INVALID_HANDLE_VALUE, NULL, flag, size >> 32, size, NULL );
+
+    	// large pages need the lock memory privilege
+    	if (flags & BUF_hugepages) {
+    		uid large = GetLargePageMinimum();
+
+    		if (large) {
+    			uid bigsize = (size + large - 1) & ~(large - 1);
+    			mgr->hpool = CreateFileMapping( INVALID_HANDLE_VALUE, NULL,
+                                    flag | SEC_COMMIT | SEC_LARGE_PAGES,
+                                    bigsize >> 32, bigsize, NULL );
+    			if (mgr->hpool) {
+    				size = bigsize;
+    				mgr->hugepages = 2;
+    			}
+    		}
+
+    		std::cerr << "Buffer pool of " << (size >> 20) << " MB "
+                        << (mgr->hugepages ? "in large pages" :
+                            "in normal pages, no large pages available") << std::endl;
+    	}
+
+    	if (!mgr->hpool) {
+    		mgr->hpool = CreateFileMapping( INVALID_HANDLE_VALUE, NULL, flag, size >> 32, size, NULL );
+    	}
+
     	if (!mgr->hpool) {
     		std::cerr << "Unable to create buffer pool memory mapping, error = "
                         << GetLastError() << std::endl;
@@ -279,7 +613,8 @@ namespace mongo {
     	}
     
     	flag = FILE_MAP_WRITE;
-    	mgr->hashtable = MapViewOfFile( mgr->pool, flag, 0, 0, size );
+    	mgr->hashtable = MapViewOfFile( mgr->hpool, flag | (mgr->hugepages ? FILE_MAP_LARGE_PAGES : 0),
+                                        0, 0, size );
     	if (!mgr->hashtable) {
     		std::cerr << "Unable to map buffer pool, error = "
                         << GetLastError() << std::endl;
@@ -288,200 +623,3177 @@ namespace mongo {
     	}
     #endif
     
+    	// BLTree::recover runs when the last close was not clean,
+    	// a read-only btree is used as it stands, and so is an
+    	// in-memory btree, unlogged. Processes joining a shared
+    	// pool only read it, the process that set it up logs and
+    	// checkpoints every change.
+    	if (!memory) {
+    		mgr->warmname = strdup( (std::string( names[0] ) + ".warm").c_str() );
+    	}
+
+    	if (!readonly && !memory && (!mgr->shmhdr || mgr->shmowner)) {
+    		mgr->unclean = !mgr->pagezero->clean;
+    		mgr->pagezero->clean = 0;
+    		mgr->redo = RedoLog::create( (std::string( names[0] ) + ".redo").c_str() );
+    	}
+
+    	// a value log is opened whenever there is one, its values
+    	// are read even when no new ones are added to it
+    	if (!memory) {
+    		std::string vlogname( std::string( names[0] ) + ".vlog" );
+
+    		if ((flags & BUF_vlog) || !access( vlogname.c_str(), F_OK )) {
+    			if ( !(mgr->vlog = ValueLog::create( vlogname.c_str(), readonly )) ) {
+    				mgr->close();
+    				return NULL;
+    			}
+
+    			mgr->vlogmin = (flags & BUF_vlog) && !readonly ? VLOG_min : 0;
+    			mgr->vlogpending = *mgr->pagezero->vloghead;
+    		}
+    	}
+
     	mgr->pagepool = (unsigned char *)mgr->hashtable
                             + ((uid)(mgr->nlatchpage - mgr->latchtotal) << mgr->page_bits);
     	mgr->latchsets = (LatchSet *)(mgr->pagepool - (uid)mgr->latchtotal * sizeof(LatchSet));
-    	return mgr;
-    }
-    
-    /**
-    *  FUNCTION: readpage
-    */
-    BLTERR BufMgr::readpage( Page* page, uid page_no ) {
 
-        off64_t off = page_no << page_bits;
-    
-    #ifdef unix
-    	if (pread( idx, page, page_size, page_no << page_bits) < page_size ) {
-    		std::cerr << "Unable to read page " << page_no << " errno = " << errno << std::endl;
-    		return BLTERR_read;
+    	// a shared pool is sharded by the process setting it up,
+    	// the pins of processes that died holding them are dropped
+    	if (mgr->shmhdr && !mgr->shmowner) {
+    		mgr->shards = mgr->shmhdr->shards;
+    		mgr->nshards = mgr->shmhdr->nshards;
+    		mgr->reappool();
+    		return mgr;
     	}
-    #else
-        OVERLAPPED ovl[1];
-        uint amt[1];
-    
-    	memset( ovl, 0, sizeof(OVERLAPPED) );
-    	ovl->Offset = off;
-    	ovl->OffsetHigh = off >> 32;
-    
-    	if (!ReadFile( idx, page, page_size, amt, ovl )) {
-    		std::cerr << "Unable to read page " << page_no << " GetLastError = " << GetLastError() << std::endl;
-    		return BLTERR_read;
+
+    	if (mgr->shardpool( flags )) {
+    		mgr->close();
+    		return NULL;
     	}
-    	if (*amt < page_size) {
-    		std::cerr << "Unable to read page " << page_no << " GetLastError = " << GetLastError() << std::endl;
-    		return BLTERR_read;
+
+    	mgr->sharepool( nodemax );
+
+    	// publish the pool's shape to the processes waiting to attach
+    	if (mgr->shmhdr) {
+    		ShmHdr* hdr = mgr->shmhdr;
+
+    		memcpy( hdr->shards, mgr->shards, mgr->nshards * sizeof(PoolShard) );
+    		free( mgr->shards );
+    		mgr->shards = hdr->shards;
+    		hdr->nshards = mgr->nshards;
+    		hdr->latchactive = mgr->latchactive;
+    		hdr->hashtarget = mgr->hashtarget;
+    		hdr->hashlevel = mgr->hashlevel;
+    		__sync_synchronize();
+    		hdr->magic = SHM_magic;
     	}
-    #endif
-    
-    	return BLTERR_ok;
+
+    	return mgr;
     }
-    
+
     /**
-    *  FUNCTION: writepage
+    *  FUNCTION: attachpool
     *
-    *  write page to permanent location in BLTree file,
-    *  and clear the dirty bit
+    *  BUF_shared: map the buffer pool segment named for the
+    *  btree file, creating it when no process has. A pool
+    *  left by processes that all died is abandoned for a new
+    *  one, their pages are recovered from the btree file and
+    *  redo log. Joining processes take the pool's size from
+    *  its head and only read the btree, since only the process
+    *  that set the pool up logs redo; they stay readers after
+    *  it leaves. A process that dies holding a page lock on a
+    *  page others still pin leaves it locked until every
+    *  process has left the pool.
     */
-    BLTERR BufMgr::writepage( Page* page, uid page_no ) {
-        off64_t off = page_no << page_bits;
-    
+    BLTERR BufMgr::attachpool() {
     #ifdef unix
-    	if (pwrite( idx, page, page_size, off) < page_size) {
-    		return BLTERR_wrt;
-        }
-    #else
-        OVERLAPPED ovl[1];
-        uint amt[1];
-    
-    	memset( ovl, 0, sizeof(OVERLAPPED) );
-    	ovl->Offset = off;
-    	ovl->OffsetHigh = off >> 32;
-    
-    	if (!WriteFile( idx, page, page_size, amt, ovl )) {
-    		return BLTERR_wrt;
+        struct stat st[1];
+        char name[64];
+        int fd;
+
+        if (fstat( idx, st )) {
+            return (err = BLTERR_map);
         }
-    
-    	if (*amt <  page_size) {
-    		return BLTERR_wrt;
+
+        sprintf( name, "/bltree.%lx.%lx", (unsigned long)st->st_dev, (unsigned long)st->st_ino );
+        shmname = strdup( name );
+
+        for (;;) {
+            uid head = sizeof(ShmHdr) + (uid)SHM_procs * latchtotal * sizeof(ushort);
+            head = (head + page_size - 1) & ~(uid)(page_size - 1);
+
+            // the first process sets the pool up
+            if ((fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0666 )) >= 0) {
+                mapsize = head + ((uid)nlatchpage << page_bits);
+
+                if (ftruncate( fd, mapsize )) {
+                    std::cerr << "Unable to size shared buffer pool " << name
+                                << ", errno = " << errno << std::endl;
+                    ::close( fd );
+                    shm_unlink( name );
+                    return (err = BLTERR_map);
+                }
+
+                mapbase = (uchar*)mmap( 0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+                ::close( fd );
+
+                if (MAP_FAILED == mapbase) {
+                    std::cerr << "Unable to map shared buffer pool " << name
+                                << ", errno = " << errno << std::endl;
+                    mapbase = NULL;
+                    shm_unlink( name );
+                    return (err = BLTERR_map);
+                }
+
+                shmhdr = (ShmHdr*)mapbase;
+                shmhdr->page_bits = page_bits;
+                shmhdr->nlatchpage = nlatchpage;
+                shmhdr->latchtotal = latchtotal;
+                shmhdr->latchhash = latchhash;
+                shmhdr->pids[0] = getpid();
+                shmowner = 1;
+                break;
+            }
+
+            if (EEXIST != errno || (fd = shm_open( name, O_RDWR, 0 )) < 0) {
+                if (ENOENT == errno) continue;
+
+                std::cerr << "Unable to open shared buffer pool " << name
+                            << ", errno = " << errno << std::endl;
+                return (err = BLTERR_map);
+            }
+
+            // wait for the process setting it up
+            uint wait = 0;
+
+            while (!fstat( fd, st ) && st->st_size < (off_t)sizeof(ShmHdr) && wait++ < SHM_wait) {
+                usleep( 10000 );
+            }
+
+            // it died before sizing the pool
+            if (st->st_size < (off_t)sizeof(ShmHdr)) {
+                ::close( fd );
+                shm_unlink( name );
+                continue;
+            }
+
+            mapsize = st->st_size;
+            mapbase = (uchar*)mmap( 0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            ::close( fd );
+
+            if (MAP_FAILED == mapbase) {
+                std::cerr << "Unable to map shared buffer pool " << name
+                            << ", errno = " << errno << std::endl;
+                mapbase = NULL;
+                return (err = BLTERR_map);
+            }
+
+            shmhdr = (ShmHdr*)mapbase;
+
+            while (SHM_magic != shmhdr->magic && !shmhdr->dead && wait++ < SHM_wait) {
+                usleep( 10000 );
+            }
+
+            SpinLatch::spinwritelock( shmhdr->attach );
+
+            uint live = 0;
+            uint slot = SHM_procs;
+
+            // the slots of dead processes are freed as they are reaped
+            for (uint proc = 0; proc < SHM_procs; proc++) {
+                pid_t pid = shmhdr->pids[proc];
+
+                if (pid && (!kill( pid, 0 ) || ESRCH != errno)) {
+                    live++;
+                }
+                else if (!pid && slot == SHM_procs) {
+                    slot = proc;
+                }
+            }
+
+            // set up by processes now gone, or never finished
+            if (SHM_magic != shmhdr->magic || !live || shmhdr->dead) {
+                if (!shmhdr->dead) {
+                    shmhdr->dead = 1;
+                    shm_unlink( name );
+                }
+
+                SpinLatch::spinreleasewrite( shmhdr->attach );
+                munmap( mapbase, mapsize );
+                mapbase = NULL;
+                shmhdr = NULL;
+                continue;
+            }
+
+            if (slot == SHM_procs || shmhdr->page_bits != page_bits) {
+                SpinLatch::spinreleasewrite( shmhdr->attach );
+                std::cerr << "Unable to join shared buffer pool " << name << ", "
+                            << (slot == SHM_procs ? "too many processes" : "page size differs")
+                            << std::endl;
+                munmap( mapbase, mapsize );
+                mapbase = NULL;
+                shmhdr = NULL;
+                return (err = BLTERR_map);
+            }
+
+            shmhdr->pids[slot] = getpid();
+            shmproc = slot;
+            SpinLatch::spinreleasewrite( shmhdr->attach );
+
+            // take the pool's shape from its head
+            nlatchpage = shmhdr->nlatchpage;
+            latchtotal = shmhdr->latchtotal;
+            latchhash = shmhdr->latchhash;
+            latchactive = shmhdr->latchactive;
+            hashtarget = shmhdr->hashtarget;
+            hashlevel = shmhdr->hashlevel;
+            break;
         }
+
+        uid head = sizeof(ShmHdr) + (uid)SHM_procs * latchtotal * sizeof(ushort);
+        head = (head + page_size - 1) & ~(uid)(page_size - 1);
+
+        pintable = (ushort*)(shmhdr + 1) + (uid)shmproc * latchtotal;
+        hashtable = (HashEntry*)(mapbase + head);
+        lock = shmhdr->alloc;
+        return BLTERR_ok;
+    #else
+        return BLTERR_ok;
     #endif
-    
-    	return BLTERR_ok;
     }
-    
+
     /**
-    *  FUNCTION: close
+    *  FUNCTION: detachpool
+    *
+    *  BUF_shared: leave the pool, the last process out
+    *  removes its name
+    *  @return 1 if no other process is attached
     */
-    void BufMgr::close() {
+    uint BufMgr::detachpool() {
+        uint live = 0;
+
+        if (!shmhdr) return 1;
+
+    #ifdef unix
+        SpinLatch::spinwritelock( shmhdr->attach );
+        shmhdr->pids[shmproc] = 0;
+
+        for (uint proc = 0; proc < SHM_procs; proc++) {
+            pid_t pid = shmhdr->pids[proc];
+
+            if (pid && (!kill( pid, 0 ) || ESRCH != errno)) live++;
+        }
+
+        if (!live && !shmhdr->dead) {
+            shmhdr->dead = 1;
+            shm_unlink( shmname );
+        }
+
+        SpinLatch::spinreleasewrite( shmhdr->attach );
+    #endif
+        free( shmname );
+        shmname = NULL;
+        return !live;
+    }
+
+    /**
+    *  FUNCTION: reappool
+    *
+    *  BUF_shared: release the pins of processes that died
+    *  holding them. A page left unpinned by everyone can
+    *  hold no page lock either, so its locks are cleared.
+    *  Page locks held by a dead process on pages other
+    *  processes still pin are beyond repair.
+    *  @return number of dead processes reaped
+    */
+    uint BufMgr::reappool() {
+        uint reaped = 0;
+
+    #ifdef unix
+        SpinLatch::spinwritelock( shmhdr->attach );
+
+        for (uint proc = 0; proc < SHM_procs; proc++) {
+            pid_t pid = shmhdr->pids[proc];
+
+            if (!pid || pid == getpid() || kill( pid, 0 ) == 0 || ESRCH != errno) {
+                continue;
+            }
+
+            ushort* pins = (ushort*)(shmhdr + 1) + (uid)proc * latchtotal;
+
+            for (uint slot = 1; slot < latchtotal; slot++) {
+                LatchSet* latch = latchsets + slot;
+                ushort cnt = pins[slot];
+
+                if (!cnt) continue;
+
+                pins[slot] = 0;
+
+                if (__sync_sub_and_fetch( &latch->pin, cnt ) & ~CLOCK_bit) {
+                    continue;
+                }
+
+                memset( (void*)latch->readwr, 0, sizeof(BLT_RWLock) );
+                memset( (void*)latch->access, 0, sizeof(BLT_RWLock) );
+                memset( (void*)latch->parent, 0, sizeof(BLT_RWLock) );
+                memset( (void*)latch->atomic, 0, sizeof(BLT_RWLock) );
+                memset( &latch->atomictid, 0, sizeof(latch->atomictid) );
+            }
+
+            std::cerr << "Released the buffer pool pins of dead process " << pid << std::endl;
+            shmhdr->pids[proc] = 0;
+            reaped++;
+        }
+
+        SpinLatch::spinreleasewrite( shmhdr->attach );
+    #endif
+        return reaped;
+    }
+
+    /**
+    *  FUNCTION: pinlog
+    *
+    *  BUF_shared: count our pins of each latch entry in
+    *  the pool, so they can be released if we die
+    */
+    void BufMgr::pinlog( LatchSet* latch, int delta ) {
+        if (!pintable) return;
+
+    #ifdef unix
+        __sync_fetch_and_add( pintable + (latch - latchsets), delta );
+    #endif
+    }
+
+    /**
+    *  FUNCTION: parselist
+    *
+    *  read a sysfs list file, (e.g.) "0-3,8", marking each
+    *  member below max in set
+    *  @return number of members
+    */
+    static uint parselist( const char* path, uchar* set, uint max ) {
+        char buff[4096];
+        uint cnt = 0;
+
+        memset( set, 0, max );
+
+        FILE* in = fopen( path, "r" );
+        if (!in) return 0;
+
+        if (!fgets( buff, sizeof(buff), in )) {
+            fclose( in );
+            return 0;
+        }
+
+        fclose( in );
+
+        for (char* tok = strtok( buff, ",\n" ); tok; tok = strtok( NULL, ",\n" )) {
+            uint lo = strtoul( tok, NULL, 10 );
+            uint hi = lo;
+            char* dash = strchr( tok, '-' );
+
+            if (dash) hi = strtoul( dash + 1, NULL, 10 );
+
+            for (uint idx = lo; idx <= hi && idx < max; idx++) {
+                if (!set[idx]) cnt++;
+                set[idx] = 1;
+            }
+        }
+
+        return cnt;
+    }
+
+    /**
+    *  FUNCTION: shardpool
+    *
+    *  split the latch slots into one shard per NUMA node with
+    *  BUF_numa, otherwise a single shard. Each shard's frames
+    *  and latch sets are bound to its node with mbind.
+    */
+    BLTERR BufMgr::shardpool( uint flags ) {
+        uchar nodes[NUMA_max];
+        uchar cpus[CPU_max];
+        uint nodeid[NUMA_max];
+        char path[256];
+
+        nshards = 0;
+
+    #ifdef unix
+        memset( cpunode, 0, sizeof(cpunode) );
+
+        if (flags & BUF_numa) {
+            parselist( "/sys/devices/system/node/online", nodes, NUMA_max );
+
+            for (uint node = 0; node < NUMA_max && nshards < (latchactive - 1) / 16; node++) {
+                if (!nodes[node]) continue;
+
+                sprintf( path, "/sys/devices/system/node/node%d/cpulist", node );
+                parselist( path, cpus, CPU_max );
+
+                for (uint cpu = 0; cpu < CPU_max; cpu++) {
+                    if (cpus[cpu]) cpunode[cpu] = nshards;
+                }
+
+                nodeid[nshards++] = node;
+            }
+        }
+    #endif
+
+        if (!nshards) {
+            nodeid[nshards++] = 0;
+        }
+
+        shards = (PoolShard*)calloc( nshards, sizeof(PoolShard) );
+        uint per = (latchtotal - 1) / nshards;
+
+        for (uint idx = 0; idx < nshards; idx++) {
+            PoolShard* shard = shards + idx;
+
+            shard->first = 1 + idx * per;
+            shard->cap = (idx + 1 < nshards) ? per : latchtotal - shard->first;
+            shard->node = nodeid[idx];
+
+    #ifdef unix
+            if (nshards < 2) continue;
+
+            unsigned long mask[NUMA_max / (8 * sizeof(unsigned long))];
+            memset( mask, 0, sizeof(mask) );
+            mask[shard->node / (8 * sizeof(unsigned long))] |=
+                        1UL << (shard->node % (8 * sizeof(unsigned long)));
+
+            // the latch sets, inside whole pages, and the frames
+            uid lo = ((uid)(latchsets + shard->first) + 4095) & ~(uid)4095;
+            uid hi = (uid)(latchsets + shard->first + shard->cap) & ~(uid)4095;
+
+            if (hi > lo) {
+                syscall( SYS_mbind, lo, hi - lo, MPOL_BIND, mask, NUMA_max, 0 );
+            }
+
+            if (syscall( SYS_mbind, pagepool + ((uid)shard->first << page_bits),
+                        (uid)shard->cap << page_bits, MPOL_BIND, mask, NUMA_max, 0 )) {
+                std::cerr << "Unable to bind buffer pool shard to node " << shard->node
+                            << ", errno = " << errno << std::endl;
+            }
+    #endif
+        }
+
+        if (flags & BUF_numa) {
+            std::cerr << "Buffer pool split into " << nshards << " NUMA shards of "
+                        << (latchactive - 1) / nshards << " pages" << std::endl;
+        }
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: sharepool
+    *
+    *  share a pool of nodemax pages among the shards,
+    *  and aim the hash table at that size
+    */
+    void BufMgr::sharepool( uint nodemax ) {
+        uint per = (nodemax - 1) / nshards;
+
+        for (uint idx = 0; idx < nshards; idx++) {
+            PoolShard* shard = shards + idx;
+            uint cnt = (idx + 1 < nshards) ? per : nodemax - 1 - idx * per;
+
+            shard->cnt = std::min( cnt, shard->cap );
+        }
+
+        // the hash table only grows, a smaller pool keeps its slots
+        hashtarget = std::max( (uint)hashtarget, std::min( hashslots( nodemax, page_bits ), latchhash ) );
+        latchactive = nodemax;
+    }
+
+    /**
+    *  FUNCTION: resize
+    *
+    *  grow or shrink the buffer pool online to nodemax pages,
+    *  up to the poolmax given to create. The resize thread
+    *  splits hash slots for a larger pool, and evicts the
+    *  pages of frames retired by a smaller one.
+    */
+    BLTERR BufMgr::resize( uint nodemax ) {
+        if (shmhdr || memory) {
+            std::cerr << "Unable to resize a shared or in-memory buffer pool" << std::endl;
+            return (err = BLTERR_struct);
+        }
+
+        if (nodemax < 16 * nshards || nodemax > latchtotal) {
+            std::cerr << "Buffer pool size " << nodemax << " outside "
+                        << 16 * nshards << " to " << latchtotal << std::endl;
+            return (err = BLTERR_struct);
+        }
+
+        sharepool( nodemax );
+
+    #ifdef unix
+        __sync_fetch_and_add( &resizing, 1 );
+    #else
+        _InterlockedIncrement( &resizing );
+    #endif
+
+        if (resizetid) {
+            return BLTERR_ok;
+        }
+
+        resizestop = 0;
+
+    #ifdef unix
+        if (pthread_create( &resizetid, NULL, BufMgr::resizethread, this )) {
+            resizetid = 0;
+            return (err = BLTERR_struct);
+        }
+    #else
+        if ( !(resizetid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::resizethread,
+                                        this, 0, NULL )) ) {
+            return (err = BLTERR_struct);
+        }
+    #endif
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: resizethread
+    *
+    *  split hash slots a batch at a time and evict retired
+    *  frames, until the pool matches its last resize
+    */
+    void* BufMgr::resizethread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+
+        while (!mgr->resizestop) {
+            uint pending = mgr->resizing;
+
+            if (!pending) {
+    #ifdef unix
+                usleep( 100000 );
+    #else
+                Sleep( 100 );
+    #endif
+                continue;
+            }
+
+            uint split = 0;
+
+            while (split < RESIZE_batch && mgr->splitbucket()) {
+                split++;
+            }
+
+            uint left = mgr->evictretired();
+
+            if (split == RESIZE_batch) continue;
+
+            // retired pages still pinned, try again later
+            if (left) {
+    #ifdef unix
+                usleep( 100000 );
+    #else
+                Sleep( 100 );
+    #endif
+                continue;
+            }
+
+    #ifdef unix
+            if (!__sync_bool_compare_and_swap( &mgr->resizing, pending, 0 )) continue;
+    #else
+            if (_InterlockedCompareExchange( &mgr->resizing, 0, pending ) != pending) continue;
+    #endif
+
+            std::cerr << "Buffer pool resized to " << mgr->latchactive << " pages, "
+                        << (uint)(mgr->hashlevel >> 32) + (uint)mgr->hashlevel
+                        << " hash slots" << std::endl;
+        }
+
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: prefetch
+    *
+    *  queue a read-ahead of cnt pages along the right links
+    *  from page_no, starting the prefetch thread on first
+    *  use. A full queue drops the request.
+    */
+    void BufMgr::prefetch( uid page_no, uint cnt ) {
+        // in-memory pages are always there
+        if (memory) return;
+
+    #ifdef unix
+        pthread_mutex_lock( ramutex );
+    #else
+        EnterCriticalSection( ramutex );
+    #endif
+
+        if (!ratid && !rastop) {
+    #ifdef unix
+            if (pthread_create( &ratid, NULL, BufMgr::prefetchthread, this )) {
+                ratid = 0;
+            }
+    #else
+            ratid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::prefetchthread,
+                                    this, 0, NULL );
+    #endif
+        }
+
+        if (ratid && rahead - ratail < RA_queue) {
+            raqueue[rahead % RA_queue].page_no = page_no;
+            raqueue[rahead % RA_queue].cnt = cnt;
+            rahead++;
+    #ifdef unix
+            pthread_cond_signal( racond );
+    #else
+            WakeConditionVariable( racond );
+    #endif
+        }
+
+    #ifdef unix
+        pthread_mutex_unlock( ramutex );
+    #else
+        LeaveCriticalSection( ramutex );
+    #endif
+    }
+
+    /**
+    *  FUNCTION: prefetchthread
+    *
+    *  load queued read-aheads into the pool. Prefetched pages
+    *  are unpinned without their CLOCK bit, so the victim
+    *  scan takes them before any page a reader has touched.
+    */
+    void* BufMgr::prefetchthread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+        uint reads = 0;
+        uint writes = 0;
+        LatchSet* latch;
+        ReadAhead req[1];
+
+        memset( req, 0, sizeof(ReadAhead) );
+
+        for (;;) {
+    #ifdef unix
+            pthread_mutex_lock( mgr->ramutex );
+
+            while (!mgr->rastop && mgr->rahead == mgr->ratail) {
+                pthread_cond_wait( mgr->racond, mgr->ramutex );
+            }
+    #else
+            EnterCriticalSection( mgr->ramutex );
+
+            while (!mgr->rastop && mgr->rahead == mgr->ratail) {
+                SleepConditionVariableCS( mgr->racond, mgr->ramutex, INFINITE );
+            }
+    #endif
+
+            if (!mgr->rastop) {
+                *req = mgr->raqueue[mgr->ratail++ % RA_queue];
+            }
+
+    #ifdef unix
+            pthread_mutex_unlock( mgr->ramutex );
+    #else
+            LeaveCriticalSection( mgr->ramutex );
+    #endif
+
+            if (mgr->rastop) break;
+
+            while (req->page_no && req->cnt--) {
+                if ( !(latch = mgr->pinlatch( req->page_no, 1, &reads, &writes )) ) {
+                    break;
+                }
+
+                Page* page = mgr->mappage( latch );
+
+                BufMgr::lockpage( LockRead, latch );
+                req->page_no = page->free ? 0 : BLTVal::getid( page->right );
+                BufMgr::unlockpage( LockRead, latch );
+                mgr->pinlog( latch, -1 );
+
+    #ifdef unix
+                __sync_fetch_and_add( &latch->pin, -1 );
+    #else
+                _InterlockedDecrement16( &latch->pin );
+    #endif
+            }
+        }
+
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: hashof
+    *
+    *  linear hashing over the hash slots in use: slots
+    *  below the split point have been split in two
+    *  @return hash table slot of page_no
+    */
+    uint BufMgr::hashof( uid page_no ) {
+        uid level = hashlevel;
+        uid round = level >> 32;
+        uint idx = page_no % round;
+
+        if (idx < (uint)level) {
+            idx = page_no % (2 * round);
+        }
+
+        return idx;
+    }
+
+    /**
+    *  FUNCTION: splitbucket
+    *
+    *  split the next hash slot, moving the pages that now
+    *  hash to its new slot. Only the resize thread splits.
+    *  @return 1 if a slot was split, 0 if at the target
+    */
+    uint BufMgr::splitbucket() {
+        uid level = hashlevel;
+        uint round = level >> 32;
+        uint split = (uint)level;
+        uint oldidx = split;
+        uint newidx = round + split;
         LatchSet* latch;
+
+        if (newidx >= hashtarget) {
+            return 0;
+        }
+
+        // nothing hashes to newidx until hashlevel advances
+        SpinLatch::spinwritelock( hashtable[oldidx].latch );
+        SpinLatch::spinwritelock( hashtable[newidx].latch );
+
+        uint slot = hashtable[oldidx].slot;
+
+        while (slot) {
+            latch = latchsets + slot;
+            uint next = latch->next;
+
+            if (latch->page_no % (2 * (uid)round) == newidx) {
+                if (latch->prev) {
+                    latchsets[latch->prev].next = latch->next;
+                }
+                else {
+                    hashtable[oldidx].slot = latch->next;
+                }
+
+                if (latch->next) {
+                    latchsets[latch->next].prev = latch->prev;
+                }
+
+                if ( (latch->next = hashtable[newidx].slot) ) {
+                    latchsets[latch->next].prev = slot;
+                }
+
+                hashtable[newidx].slot = slot;
+                latch->prev = 0;
+            }
+
+            slot = next;
+        }
+
+        if (++split == round) {
+            hashlevel = (uid)(2 * round) << 32;
+        }
+        else {
+            hashlevel = ((uid)round << 32) | split;
+        }
+
+        SpinLatch::spinreleasewrite( hashtable[newidx].latch );
+        SpinLatch::spinreleasewrite( hashtable[oldidx].latch );
+        return 1;
+    }
+
+    /**
+    *  FUNCTION: evictretired
+    *
+    *  write back and unlink the pages of frames beyond
+    *  each shard's size, and return the frames' memory
+    *  @return number of retired pages still pinned
+    */
+    uint BufMgr::evictretired() {
+        uint left = 0;
+
+        for (uint idx = 0; idx < nshards; idx++) {
+            PoolShard* shard = shards + idx;
+            uint end = std::min( (uint)shard->deployed, shard->cap );
+
+            for (uint off = shard->cnt; off < end; off++) {
+                uint slot = shard->first + off;
+                LatchSet* latch = latchsets + slot;
+                uid page_no = latch->page_no;
+
+                if (!page_no) continue;
+
+                uint hashidx = hashof( page_no );
+
+                if (!SpinLatch::spinwritetry( hashtable[hashidx].latch )) {
+                    left++;
+                    continue;
+                }
+
+                // regrown, reused, or rehashed meanwhile
+                if (off < shard->cnt || latch->page_no != page_no || hashof( page_no ) != hashidx) {
+                    SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                    continue;
+                }
+
+                // claim the entry unless it is pinned
+                ushort pin = latch->pin;
+
+    #ifdef unix
+                if ((pin & ~CLOCK_bit) || !__sync_bool_compare_and_swap( &latch->pin, pin, 1 )) {
+    #else
+                if ((pin & ~CLOCK_bit) || _InterlockedCompareExchange16( &latch->pin, 1, pin ) != pin) {
+    #endif
+                    SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                    left++;
+                    continue;
+                }
+
+                Page* page = mappage( latch );
+
+                if (latch->dirty) {
+                    if (writepage( page, page_no )) {
+                        latch->pin = pin;
+                        SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                        left++;
+                        continue;
+                    }
+
+                    latch->dirty = 0;
+                }
+
+                if (latch->locked) {
+    #ifdef unix
+                    munlock( page, page_size );
+    #else
+                    VirtualUnlock( page, page_size );
+    #endif
+                    latch->locked = 0;
+                }
+
+                tierstash( page, page_no );
+                cacheadmit( page, page_no );
+
+                if (latch->prev) {
+                    latchsets[latch->prev].next = latch->next;
+                }
+                else {
+                    hashtable[hashidx].slot = latch->next;
+                }
+
+                if (latch->next) {
+                    latchsets[latch->next].prev = latch->prev;
+                }
+
+                // give the frame's memory back, or a mapped
+                // page's private copy
+    #ifdef unix
+                if (mapsegs) {
+                    madvise( page, page_size, MADV_DONTNEED );
+                }
+                else {
+                    madvise( page, page_size, hugepages ? MADV_DONTNEED : MADV_REMOVE );
+                }
+    #else
+                VirtualAlloc( page, page_size, MEM_RESET, PAGE_READWRITE );
+    #endif
+
+                latch->page_no = 0;
+                latch->next = latch->prev = 0;
+
+    #ifdef unix
+                __sync_fetch_and_add( &latchdeployed, -1 );
+    #else
+                _InterlockedDecrement( &latchdeployed );
+    #endif
+
+                latch->pin = 0;
+                SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+            }
+        }
+
+        return left;
+    }
+
+    /**
+    *  FUNCTION: shardof
+    *
+    *  @return the pool shard of the calling thread's NUMA node
+    */
+    uint BufMgr::shardof() {
+    #ifdef unix
+        if (nshards > 1) {
+            int cpu = sched_getcpu();
+
+            if (cpu >= 0 && cpu < CPU_max) {
+                return cpunode[cpu];
+            }
+        }
+    #endif
+        return 0;
+    }
+
+    /**
+    *  FUNCTION: bindthread
+    *
+    *  run the calling thread on the cpus of the node of
+    *  shard (idx % number of shards), so its pool misses
+    *  are filled from node local memory
+    */
+    BLTERR BufMgr::bindthread( uint idx ) {
+    #ifdef unix
+        cpu_set_t set[1];
+
+        if (nshards < 2) return BLTERR_ok;
+
+        CPU_ZERO( set );
+        idx %= nshards;
+
+        for (uint cpu = 0; cpu < CPU_max && cpu < CPU_SETSIZE; cpu++) {
+            if (cpunode[cpu] == idx) CPU_SET( cpu, set );
+        }
+
+        if (pthread_setaffinity_np( pthread_self(), sizeof(cpu_set_t), set )) {
+            return (err = BLTERR_struct);
+        }
+    #endif
+        return BLTERR_ok;
+    }
+    
+    /**
+    *  FUNCTION: pagefile
+    *
+    *  find where a page lives: stripe units of stripepages
+    *  pages go to the files in turn, so a thread's extent
+    *  stays on one file and adjacent extents on different ones
+    *  @return index in files of the page's file, with the
+    *  page's offset in that file
+    */
+    uint BufMgr::pagefile( uid page_no, off64_t* off ) {
+    	if (nfiles < 2) {
+    		*off = page_no << page_bits;
+    		return 0;
+    	}
+
+        uid unit = page_no / stripepages;
+
+    	*off = ((unit / nfiles) * stripepages + page_no % stripepages) << page_bits;
+    	return unit % nfiles;
+    }
+
+    /**
+    *  FUNCTION: striperun
+    *
+    *  @return how many of cnt pages from page_no lie
+    *  together in one file
+    */
+    uint BufMgr::striperun( uid page_no, uint cnt ) {
+    	if (nfiles < 2) {
+    		return cnt;
+    	}
+
+    	return std::min( (uid)cnt, stripepages - page_no % stripepages );
+    }
+
+    /**
+    *  FUNCTION: stripesize
+    *
+    *  @return length of file when the btree has the
+    *  given number of pages
+    */
+    off64_t BufMgr::stripesize( uint file, uid pages ) {
+    	if (nfiles < 2) {
+    		return pages << page_bits;
+    	}
+
+        uid units = pages / stripepages;
+        uid size = (units / nfiles + (file < units % nfiles)) * stripepages;
+
+    	// the partial last unit
+    	if (file == units % nfiles) {
+    		size += pages % stripepages;
+    	}
+
+    	return size << page_bits;
+    }
+
+    /**
+    *  FUNCTION: readpage
+    *
+    *  read a page from the BLTree file, checking the
+    *  checksum of a written page when verifycrc is set.
+    *  When compressing, only the first block is read
+    *  until the page turns out to be stored raw.
+    */
+    BLTERR BufMgr::readpage( Page* page, uid page_no ) {
+
+        off64_t off;
+        uint file = pagefile( page_no, &off );
+        uint have = page_size;
+        BLTERR err;
+    
+    #ifdef unix
+    	if (compress && page_size > PACK_block) {
+    		have = PACK_block;
+    	}
+
+        ssize_t got = pread( files[file], page, have, off );
+
+    	// a compressed last page ends the file early
+    	if (got >= (ssize_t)sizeof(PackHdr) && ((PackHdr*)page)->magic == PACK_magic) {
+    		have = got;
+    	}
+    	else if (got < have) {
+    		std::cerr << "Unable to read page " << page_no << " errno = " << errno << std::endl;
+    		return BLTERR_read;
+    	}
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+    
+    	memset( ovl, 0, sizeof(OVERLAPPED) );
+    	ovl->Offset = off;
+    	ovl->OffsetHigh = off >> 32;
+    
+    	if (!ReadFile( files[file], page, page_size, amt, ovl )) {
+    		std::cerr << "Unable to read page " << page_no << " GetLastError = " << GetLastError() << std::endl;
+    		return BLTERR_read;
+    	}
+    	if (*amt >= sizeof(PackHdr) && ((PackHdr*)page)->magic == PACK_magic) {
+    		have = *amt;
+    	}
+    	else if (*amt < page_size) {
+    		std::cerr << "Unable to read page " << page_no << " GetLastError = " << GetLastError() << std::endl;
+    		return BLTERR_read;
+    	}
+    #endif
+
+    	if ((err = unpackpage( page, have, page_no ))) {
+    		return err;
+    	}
+
+    	// reserved and punched pages read as zeros
+    	if (verifycrc && page->bits && page->crc != Page::checksum( page, page_size )) {
+    		std::cerr << "Checksum mismatch on page " << page_no << std::endl;
+    		return BLTERR_crc;
+    	}
+    
+    	return BLTERR_ok;
+    }
+    
+    /**
+    *  FUNCTION: unpackpage
+    *
+    *  finish reading a page whose first have bytes are in
+    *  place: a compressed image is inflated over the page,
+    *  a raw page has the rest of its bytes read in
+    */
+    BLTERR BufMgr::unpackpage( Page* page, uint have, uid page_no ) {
+        off64_t off;
+        uint file = pagefile( page_no, &off );
+        PackHdr hdr[1];
+    
+    	memcpy( hdr, page, sizeof(PackHdr) );
+
+    	if (hdr->magic != PACK_magic) {
+    		if (have == page_size) {
+    			return BLTERR_ok;
+    		}
+    #ifdef unix
+    		if (pread( files[file], (uchar*)page + have, page_size - have, off + have ) < page_size - have) {
+    			std::cerr << "Unable to read page " << page_no << " errno = " << errno << std::endl;
+    			return BLTERR_read;
+    		}
+    #endif
+    		return BLTERR_ok;
+    	}
+
+    	if (hdr->len > page_size - sizeof(PackHdr)) {
+    		std::cerr << "Unable to unpack page " << page_no << std::endl;
+    		return BLTERR_crc;
+    	}
+
+        uint need = sizeof(PackHdr) + hdr->len;
+        uchar* buff = (uchar*)malloc( need );
+        uLongf len = page_size;
+
+    	memcpy( buff, page, std::min( have, need ) );
+
+    #ifdef unix
+    	if (need > have && pread( files[file], buff + have, need - have, off + have ) < need - have) {
+    		std::cerr << "Unable to read page " << page_no << " errno = " << errno << std::endl;
+    		free( buff );
+    		return BLTERR_read;
+    	}
+    #endif
+
+    	if (uncompress( (Bytef*)page, &len, buff + sizeof(PackHdr), hdr->len ) != Z_OK || len != page_size) {
+    		std::cerr << "Unable to unpack page " << page_no << std::endl;
+    		free( buff );
+    		return BLTERR_crc;
+    	}
+
+    	free( buff );
+    	return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: writepage
+    *
+    *  write page to permanent location in BLTree file,
+    *  and clear the dirty bit
+    */
+    BLTERR BufMgr::writepage( Page* page, uid page_no ) {
+        off64_t off;
+
+    	// an in-memory page is written where it lives
+    	if (memory) {
+    		Page* frame = (Page*)(pagepool + (page_no << page_bits));
+
+    		if (frame != page) {
+    			memcpy( frame, page, page_size );
+    		}
+    		return BLTERR_ok;
+    	}
+
+        uint file = pagefile( page_no, &off );
+
+    	// stamp page with the current backup epoch
+    	if (pagezero) {
+    		page->epoch = *pagezero->epoch;
+        }
+
+    	page->crc = Page::checksum( page, page_size );
+
+    	// tier and cache file copies of the page are now stale
+    	tierdrop( page_no );
+    	cachedrop( page_no );
+
+    	// page zero stays raw, open reads it to learn the page size
+    	if (compress && page_no > ALLOC_page) {
+    		return writepacked( page, page_no );
+    	}
+    
+    #ifdef unix
+    	if (pwrite( files[file], page, page_size, off) < page_size) {
+    		return BLTERR_wrt;
+        }
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+    
+    	memset( ovl, 0, sizeof(OVERLAPPED) );
+    	ovl->Offset = off;
+    	ovl->OffsetHigh = off >> 32;
+    
+    	if (!WriteFile( files[file], page, page_size, amt, ovl )) {
+    		return BLTERR_wrt;
+        }
+    
+    	if (*amt <  page_size) {
+    		return BLTERR_wrt;
+        }
+    #endif
+    
+    	return BLTERR_ok;
+    }
+    
+    /**
+    *  FUNCTION: packpage
+    *
+    *  compress a page behind a PackHdr into buff, which
+    *  holds page_size bytes, padding it to a whole block
+    *  @return bytes to write, or zero when the
+    *  compressed image would not save a block
+    */
+    uint BufMgr::packpage( Page* page, uchar* buff ) {
+        PackHdr* hdr = (PackHdr*)buff;
+        uLongf len = page_size - sizeof(PackHdr);
+        uint total;
+
+    	if (compress2( buff + sizeof(PackHdr), &len, (Bytef*)page, page_size, Z_BEST_SPEED ) != Z_OK) {
+    		return 0;
+    	}
+
+    	total = (sizeof(PackHdr) + len + PACK_block - 1) & ~(PACK_block - 1);
+
+    	if (total >= page_size) {
+    		return 0;
+    	}
+
+    	hdr->magic = PACK_magic;
+    	hdr->len = len;
+    	memset( buff + sizeof(PackHdr) + len, 0, total - sizeof(PackHdr) - len );
+    	return total;
+    }
+
+    /**
+    *  FUNCTION: writepacked
+    *
+    *  write a stamped page compressed into the front of its
+    *  slot in the file and punch out the rest of the slot,
+    *  or raw when it does not compress by a block
+    */
+    BLTERR BufMgr::writepacked( Page* page, uid page_no ) {
+        off64_t off;
+        uint file = pagefile( page_no, &off );
+        uchar* buff = (uchar*)valloc( page_size );
+        uint len = packpage( page, buff );
+        void* image = len ? (void*)buff : (void*)page;
+
+    	if (!len) {
+    		len = page_size;
+    	}
+
+    #ifdef unix
+    	if (pwrite( files[file], image, len, off ) < len) {
+    		free( buff );
+    		return BLTERR_wrt;
+    	}
+
+    	// stale bytes past the image are never read,
+    	// so a failed punch only costs the space
+    	if (len < page_size) {
+    		fallocate( files[file], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off + len, page_size - len );
+    	}
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+    
+    	memset( ovl, 0, sizeof(OVERLAPPED) );
+    	ovl->Offset = off;
+    	ovl->OffsetHigh = off >> 32;
+    
+    	if (!WriteFile( files[file], image, len, amt, ovl ) || *amt < len) {
+    		free( buff );
+    		return BLTERR_wrt;
+    	}
+    #endif
+
+    	free( buff );
+    	return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: writepages
+    *
+    *  write cnt adjacent pages from a buffer to their
+    *  permanent location with one write, or one write
+    *  per page when pages are compressed
+    */
+    BLTERR BufMgr::writepages( Page* pages, uid page_no, uint cnt ) {
+        uchar* buff = (uchar*)pages;
+        BLTERR err;
+
+    	// cache file copies of the pages are now stale
+    	for (uint i = 0; ncachesets && i < cnt; i++) {
+    		cachedrop( page_no + i );
+    	}
+
+    	if (compress) {
+    		for (uint i = 0; i < cnt; i++) {
+    			if ((err = writepacked( (Page*)(buff + ((uid)i << page_bits)), page_no + i ))) {
+    				return err;
+    			}
+    		}
+    		return BLTERR_ok;
+    	}
+
+    	// a run crossing into another stripe unit goes
+    	// out as one write per unit
+    	for (uint run; cnt; cnt -= run) {
+            off64_t off;
+            uint file = pagefile( page_no, &off );
+            uint len;
+
+    		run = striperun( page_no, cnt );
+    		len = run << page_bits;
+    
+    #ifdef unix
+    		if (pwrite( files[file], buff, len, off ) < len) {
+    			return BLTERR_wrt;
+    		}
+    #else
+            OVERLAPPED ovl[1];
+            uint amt[1];
+    
+    		memset( ovl, 0, sizeof(OVERLAPPED) );
+    		ovl->Offset = off;
+    		ovl->OffsetHigh = off >> 32;
+    
+    		if (!WriteFile( files[file], buff, len, amt, ovl ) || *amt < len) {
+    			return BLTERR_wrt;
+    		}
+    #endif
+    		buff += len;
+    		page_no += run;
+    	}
+    
+    	return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: close
+    */
+    void BufMgr::close() {
+
+    	// finish a background warm-up
+    	if (warmtid) {
+    #ifdef unix
+    		pthread_join( warmtid, NULL );
+    #else
+    		WaitForSingleObject( warmtid, INFINITE );
+    		CloseHandle( warmtid );
+    #endif
+    	}
+
+    	// stop read-ahead, dropping queued requests
+    	if (ratid) {
+    #ifdef unix
+    		pthread_mutex_lock( ramutex );
+    		rastop = 1;
+    		pthread_cond_signal( racond );
+    		pthread_mutex_unlock( ramutex );
+    		pthread_join( ratid, NULL );
+    #else
+    		EnterCriticalSection( ramutex );
+    		rastop = 1;
+    		WakeConditionVariable( racond );
+    		LeaveCriticalSection( ramutex );
+    		WaitForSingleObject( ratid, INFINITE );
+    		CloseHandle( ratid );
+    #endif
+    		ratid = 0;
+    	}
+
+    #ifdef unix
+    	pthread_cond_destroy( racond );
+    	pthread_mutex_destroy( ramutex );
+    #else
+    	DeleteCriticalSection( ramutex );
+    #endif
+
+    	// stop background resizing
+    	if (resizetid) {
+    		resizestop = 1;
+    #ifdef unix
+    		pthread_join( resizetid, NULL );
+    #else
+    		WaitForSingleObject( resizetid, INFINITE );
+    		CloseHandle( resizetid );
+    #endif
+    	}
+
+    	// stop background syncs
+    	if (synctid) {
+    		syncstop = 1;
+    #ifdef unix
+    		pthread_join( synctid, NULL );
+    #else
+    		WaitForSingleObject( synctid, INFINITE );
+    		CloseHandle( synctid );
+    #endif
+    	}
+
+    	// stop value log collection
+    	if (gctid) {
+    		gcstop = 1;
+    #ifdef unix
+    		pthread_join( gctid, NULL );
+    #else
+    		WaitForSingleObject( gctid, INFINITE );
+    		CloseHandle( gctid );
+    #endif
+    	}
+
+    	// stop background checkpoints
+    	if (ckpttid) {
+    		ckptstop = 1;
+    #ifdef unix
+    		pthread_join( ckpttid, NULL );
+    #else
+    		WaitForSingleObject( ckpttid, INFINITE );
+    		CloseHandle( ckpttid );
+    #endif
+    	}
+
+        uint num = 0;
+
+    	// unless durability is off, the file is synced before close;
+    	// pages that could not be written keep the redo log for recovery
+    	BLTERR flushed = writeback( &num, durable != DURABLE_none ? 2 : 0 );
+    	std::cerr << num << " buffer pool pages flushed" << std::endl;
+
+    	if (flushed) {
+    		std::cerr << "Unable to write back the buffer pool, keeping the redo log" << std::endl;
+    	}
+
+    	if ((tierbytes || ncachesets) && shards) {
+    		hitratios();
+    	}
+
+    	if (residentlvl && latchsets) {
+    		num = residentpages();
+    		std::cerr << num << " resident interior pages, "
+                        << ((uid)num << page_bits >> 10) << " KB" << std::endl;
+    	}
+
+    	// remember the hot page set for the next open
+    	if (warmname && latchsets) {
+    		savewarm();
+    	}
+    	free( warmname );
+    	warmname = NULL;
+
+    	if (!shmhdr) {
+    		free( shards );
+    	}
+    	shards = NULL;
+    	free( tierring );
+    	free( tierslots );
+    	tierring = NULL;
+    	tierslots = NULL;
+    	tierbytes = 0;
+
+    	if (ncachesets) {
+    #ifdef unix
+    		::close( cacheidx );
+    #else
+    		CloseHandle( cacheidx );
+    #endif
+    		free( cachesets );
+    		free( cacheways );
+    		ncachesets = 0;
+    	}
+
+    	// the logged values are synced before the redo log that
+    	// also holds them goes, and the space of collected
+    	// values is released now their pages are written
+    	if (vlog) {
+    		if (!readonly && !flushed && !vlog->sync()) {
+    			*pagezero->vloghead = vlogpending;
+    			vlog->discard( vlogpending );
+    		}
+    		vlog->close();
+    		free( vlog );
+    		vlog = NULL;
+    	}
+
+    	// every logged change is now in the btree file
+    	if (redo) {
+    		if (!flushed && !redo->truncate( 0 )) {
+    			*pagezero->redolsn = 0;
+            }
+    		redo->close();
+    		free( redo );
+    		redo = NULL;
+    	}
+
+    	// the last process out of a shared pool closes the btree,
+    	// left unclean for recovery when its pages were not written
+    	if (detachpool() && pagezero && !flushed) {
+    		pagezero->clean = 1;
+        }
+    
+    #ifdef unix
+    	if (mapsegs) {
+    		for (uint seg = 0; seg < MMAP_segs; seg++) {
+    			if (mapsegs[seg]) {
+    				munmap( mapsegs[seg], (uid)1 << MMAP_segbits );
+    			}
+    		}
+    		free( (void*)mapsegs );
+    		mapsegs = NULL;
+    	}
+    	if (mapbase) {
+    		munmap( mapbase, mapsize );
+    	}
+    	shmhdr = NULL;
+    	pintable = NULL;
+
+    	// an in-memory page zero went with the pool
+    	if (!memory) {
+    		munmap( pagezero, page_size );
+    	}
+    #else
+    	FlushViewOfFile( pagezero, 0 );
+    	UnmapViewOfFile( pagezero );
+    	UnmapViewOfFile( hashtable );
+    	CloseHandle( halloc );
+    	CloseHandle( hpool );
+    #endif
+    
+    	for (uint file = 0; file < nfiles; file++) {
+    #ifdef unix
+    		::close( files[file] );
+    #else
+    		FlushFileBuffers( files[file] );
+    		CloseHandle( files[file] );
+    #endif
+    	}
+    	//free( mgr );
+    }
+    
+    /**
+    *  FUNCTION: flushpage
+    *
+    *  write a page back now, ahead of any page
+    *  that will link to it on disk
+    *  call with page locked
+    */
+    BLTERR BufMgr::flushpage( LatchSet* latch ) {
+        if ( (err = writepage( mappage( latch ), latch->page_no )) ) {
+            return err;
+        }
+
+        latch->dirty = 0;
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: flushpages
+    *
+    *  write all dirty pool pages to the btree and sync it
+    *  @return BLTERR_ok once every page is written
+    */
+    BLTERR BufMgr::flushpages() {
+        uint num = 0;
+
+        return writeback( &num, 2 );
+    }
+
+    /**
+    *  flush writer thread argument
+    */
+    struct FlushArg {
+        BufMgr* mgr;
+        std::pair< uid, uint >* pages;  // (page_no, latch slot) in ascending order
+        uint cnt;                   // number of pages
+        uint written;               // pages written back
+        uint sync;                  // start kernel write-back of each run
+        BLTERR err;                 // first write error
+    };
+
+    /**
+    *  orders dirty pages by file, then page number, so
+    *  each write-back thread mostly has one file to itself
+    */
+    struct StripeOrder {
+        BufMgr* mgr;
+
+        bool operator()( const std::pair< uid, uint >& a, const std::pair< uid, uint >& b ) const {
+            off64_t off;
+            uint filea = mgr->pagefile( a.first, &off );
+            uint fileb = mgr->pagefile( b.first, &off );
+
+            return filea != fileb ? filea < fileb : a.first < b.first;
+        }
+    };
+
+    /**
+    *  FUNCTION: writeback
+    *
+    *  write the dirty pool pages back in page number order,
+    *  adjacent pages coalesced into one write, the sorted
+    *  pages split among the flush threads. With sync 1 the
+    *  kernel starts writing each run at once, with sync 2
+    *  the file is then synced once.
+    *  A page is tested for dirty under its read lock, and
+    *  write-backs run one at a time, so every change logged
+    *  before the call is on disk when it returns.
+    *  @return first write error, with *written pages written
+    */
+    BLTERR BufMgr::writeback( uint* written, uint sync ) {
+        std::vector< std::pair< uid, uint > > pages;
+        uint threads = std::max( nflushers, nfiles );
+        BLTERR status = BLTERR_ok;
+        StripeOrder order;
+
+        // an in-memory btree has nowhere to write
+        if (memory) {
+            return BLTERR_ok;
+        }
+
+        // a page another write-back has copied but not yet
+        // written is no longer dirty, wait for that write
+        SpinLatch::spinwritelock( flushlatch );
+
+        // a leaf is logged and marked dirty under its write
+        // lock, so a change logged before this scan is seen
+        for (uint slot = 1; slot < latchtotal; slot++) {
+            LatchSet* latch = latchsets + slot;
+
+            if (!latch->page_no) continue;
+
+            lockpage( LockRead, latch );
+
+            if (latch->dirty && latch->page_no) {
+                pages.push_back( std::make_pair( latch->page_no, slot ) );
+            }
+
+            unlockpage( LockRead, latch );
+        }
+
+        order.mgr = this;
+        std::sort( pages.begin(), pages.end(), order );
+
+        if (threads > pages.size()) threads = pages.size();
+
+        FlushArg* args = new FlushArg[threads];
+        uint chunk = threads ? (pages.size() + threads - 1) / threads : 0;
+
+    #ifdef unix
+        pthread_t tid[threads];
+    #else
+        HANDLE tid[threads];
+    #endif
+
+        for (uint idx = 0; idx < threads; idx++) {
+            args[idx].mgr = this;
+            args[idx].pages = &pages[idx * chunk];
+            args[idx].cnt = std::min( chunk, (uint)pages.size() - idx * chunk );
+            args[idx].written = 0;
+            args[idx].sync = sync;
+            args[idx].err = BLTERR_ok;
+
+            // the first range is written by this thread
+            if (!idx) continue;
+    #ifdef unix
+            pthread_create( &tid[idx], NULL, BufMgr::flushwriter, &args[idx] );
+    #else
+            tid[idx] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::flushwriter,
+                                    &args[idx], 0, NULL );
+    #endif
+        }
+
+        if (threads) {
+            flushwriter( args );
+        }
+
+        for (uint idx = 0; idx < threads; idx++) {
+            if (idx) {
+    #ifdef unix
+                pthread_join( tid[idx], NULL );
+    #else
+                WaitForSingleObject( tid[idx], INFINITE );
+                CloseHandle( tid[idx] );
+    #endif
+            }
+
+            if (args[idx].err) {
+                status = args[idx].err;
+            }
+
+            *written += args[idx].written;
+        }
+
+        delete [] args;
+
+        for (uint file = 0; sync > 1 && file < nfiles; file++) {
+    #ifdef unix
+            if (fdatasync( files[file] )) {
+                status = BLTERR_wrt;
+            }
+    #else
+            FlushFileBuffers( files[file] );
+    #endif
+        }
+
+        SpinLatch::spinreleasewrite( flushlatch );
+
+        if (status) {
+            err = status;
+        }
+
+        return status;
+    }
+
+    /**
+    *  FUNCTION: flushwriter
+    *
+    *  copy each dirty page into a run buffer under its read
+    *  lock, clearing its dirty bit, and write each run of
+    *  adjacent pages with one write. The pages stay pinned
+    *  until their run is on disk, so none is evicted and
+    *  read back stale meanwhile. Holding no page lock over
+    *  the write, the pages are locked in any order.
+    */
+    void* BufMgr::flushwriter( void* arg ) {
+        FlushArg* args = (FlushArg*)arg;
+        BufMgr* mgr = args->mgr;
+        uint max = std::max( FLUSH_bytes >> mgr->page_bits, 1 );
+        LatchSet* staged[max];
+        uint cnt = 0;
+        uid start = 0;
+
+    #ifdef unix
+        uchar* buff = (uchar*)valloc( (uid)max << mgr->page_bits );
+    #else
+        uchar* buff = (uchar*)VirtualAlloc( NULL, (uid)max << mgr->page_bits,
+                                            MEM_COMMIT, PAGE_READWRITE );
+    #endif
+
+        for (uint idx = 0; idx <= args->cnt; idx++) {
+            LatchSet* latch = NULL;
+            uid page_no = 0;
+
+            // pin the page, unless it was evicted meanwhile
+            if (idx < args->cnt) {
+                page_no = args->pages[idx].first;
+
+                if ( (latch = mgr->findlatch( page_no ))
+                        && latch != mgr->latchsets + args->pages[idx].second ) {
+                    mgr->unpinlatch( latch );
+                    latch = NULL;
+                }
+            }
+
+            // write the run when this page does not extend it
+            if (cnt && (!latch || page_no != start + cnt || cnt == max
+                        || mgr->striperun( start, cnt + 1 ) <= cnt)) {
+                BLTERR err = mgr->writepages( (Page*)buff, start, cnt );
+
+    #ifdef unix
+                if (!err && args->sync) {
+                    off64_t off;
+                    uint file = mgr->pagefile( start, &off );
+
+                    sync_file_range( mgr->files[file], off,
+                                    (uid)cnt << mgr->page_bits, SYNC_FILE_RANGE_WRITE );
+                }
+    #endif
+
+                for (uint off = 0; off < cnt; off++) {
+                    if (err) {
+                        staged[off]->dirty = 1;
+                    }
+
+                    mgr->unpinlatch( staged[off] );
+                }
+
+                if (err) {
+                    args->err = err;
+                }
+                else {
+                    args->written += cnt;
+                }
+
+                cnt = 0;
+            }
+
+            if (!latch) continue;
+
+            lockpage( LockRead, latch );
+
+            if (!latch->dirty) {
+                unlockpage( LockRead, latch );
+                mgr->unpinlatch( latch );
+                continue;
+            }
+
+            Page* page = mgr->mappage( latch );
+
+            // stamp page with the current backup epoch
+            page->epoch = *mgr->pagezero->epoch;
+
+            if (!cnt) {
+                start = page_no;
+            }
+
+            Page* copy = (Page*)(buff + ((uid)cnt << mgr->page_bits));
+            memcpy( copy, page, mgr->page_size );
+            latch->dirty = 0;
+            unlockpage( LockRead, latch );
+
+            copy->crc = Page::checksum( copy, mgr->page_size );
+            staged[cnt++] = latch;
+        }
+
+    #ifdef unix
+        free( buff );
+    #else
+        VirtualFree( buff, 0, MEM_RELEASE );
+    #endif
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: flushers
+    *
+    *  write back dirty pages with this many threads
+    */
+    void BufMgr::flushers( uint threads ) {
+        nflushers = threads;
+    }
+
+    /**
+    *  FUNCTION: dirtypages
+    *
+    *  @return number of dirty pool pages
+    */
+    uint BufMgr::dirtypages() {
+        uint num = 0;
+
+        if (memory) return 0;
+
+        for (uint slot = 1; slot < latchtotal; slot++) {
+            if (latchsets[slot].dirty) num++;
+        }
+
+        return num;
+    }
+
+    /**
+    *  FUNCTION: checkpoint
+    *
+    *  fuzzy checkpoint: note the end of the redo log, write
+    *  back dirty pages in page order while the tree stays
+    *  online, then advance the recovery start in PageZero
+    *  and release the log space ahead of it.
+    *  Changes are logged and their page marked dirty under the
+    *  leaf write lock, and writeback tests dirty under the read
+    *  lock, so every record before the noted lsn is in a page
+    *  written here or earlier: the noted lsn is the lowest
+    *  record whose page may not be on disk.
+    */
+    BLTERR BufMgr::checkpoint() {
+        uid head = vlogpending;
+        uid lsn = 0;
+        uint num = 0;
+
+        // skip if a checkpoint is already running
+        if (!SpinLatch::spinwritetry( ckptlatch )) {
+            return BLTERR_ok;
+        }
+
+        if (redo && redo->tail( &lsn )) {
+            SpinLatch::spinreleasewrite( ckptlatch );
+            return (err = BLTERR_wrt);
+        }
+
+        if (writeback( &num, 2 )) {
+            SpinLatch::spinreleasewrite( ckptlatch );
+            return err;
+        }
+
+        // values logged ahead of lsn leave the redo log, and the
+        // pages pointing past the collected values are written
+        if (vlog) {
+            if (vlog->sync()) {
+                SpinLatch::spinreleasewrite( ckptlatch );
+                return (err = BLTERR_wrt);
+            }
+            *pagezero->vloghead = head;
+        }
+
+        // the checkpoint marker
+        *pagezero->redolsn = lsn;
+        *pagezero->ckpttime = time( NULL );
+
+    #ifdef unix
+        msync( pagezero, page_size, MS_SYNC );
+    #else
+        FlushViewOfFile( pagezero, 0 );
+    #endif
+
+        if (redo) {
+            redo->discard( lsn );
+        }
+
+        if (vlog) {
+            vlog->discard( head );
+        }
+
+        SpinLatch::spinreleasewrite( ckptlatch );
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: checkpointer
+    *
+    *  start background checkpoints every secs seconds,
+    *  or whenever dirty pages reach bytes, zero disables either
+    */
+    BLTERR BufMgr::checkpointer( uint secs, uid bytes ) {
+        if (ckpttid || readonly || memory || (shmhdr && !shmowner) || !(secs || bytes)) {
+            return BLTERR_ok;
+        }
+
+        ckptsecs = secs;
+        ckptbytes = bytes;
+        ckptstop = 0;
+
+    #ifdef unix
+        if (pthread_create( &ckpttid, NULL, BufMgr::ckptthread, this )) {
+            ckpttid = 0;
+            return (err = BLTERR_struct);
+        }
+    #else
+        if ( !(ckpttid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::ckptthread,
+                                        this, 0, NULL )) ) {
+            return (err = BLTERR_struct);
+        }
+    #endif
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: ckptthread
+    */
+    void* BufMgr::ckptthread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+        time_t last = time( NULL );
+
+        while (!mgr->ckptstop) {
+    #ifdef unix
+            usleep( 100000 );
+    #else
+            Sleep( 100 );
+    #endif
+
+            uint due = mgr->ckptsecs && time( NULL ) - last >= mgr->ckptsecs;
+
+            if (!due && mgr->ckptbytes) {
+                due = ((uid)mgr->dirtypages() << mgr->page_bits) >= mgr->ckptbytes;
+            }
+
+            if (!due) continue;
+
+            if (mgr->checkpoint()) {
+                std::cerr << "Checkpoint failed, errno = " << errno << std::endl;
+            }
+
+            // release pages freed since the last checkpoint
+            mgr->punchfree( NULL, 0 );
+
+            mgr->savewarm();
+
+            last = time( NULL );
+        }
+
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: durability
+    *
+    *  choose when changes reach the disk: DURABLE_none leaves
+    *  it to the kernel, DURABLE_periodic syncs every secs
+    *  seconds and at close, DURABLE_commit syncs at each
+    *  commit and at close
+    */
+    BLTERR BufMgr::durability( uint mode, uint secs ) {
+        if (readonly || memory) {
+            return BLTERR_ok;
+        }
+
+        durable = mode;
+        syncsecs = secs ? secs : 1;
+
+        if (synctid || mode != DURABLE_periodic) {
+            return BLTERR_ok;
+        }
+
+        syncstop = 0;
+
+    #ifdef unix
+        if (pthread_create( &synctid, NULL, BufMgr::syncthread, this )) {
+            synctid = 0;
+            return (err = BLTERR_struct);
+        }
+    #else
+        if ( !(synctid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::syncthread,
+                                        this, 0, NULL )) ) {
+            return (err = BLTERR_struct);
+        }
+    #endif
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: commit
+    *
+    *  under DURABLE_commit, make the changes so far durable:
+    *  the redo log up to its end when there is one, else
+    *  the dirty pages themselves. A commit whose records
+    *  another commit already synced returns at once.
+    */
+    BLTERR BufMgr::commit() {
         uint num = 0;
-        Page* page;
+
+        if (durable != DURABLE_commit) {
+            return BLTERR_ok;
+        }
+
+        if (!redo) {
+            return writeback( &num, 2 );
+        }
+
+        // records that never reached the log file aren't synced
+        uid lsn;
+
+        if (redo->tail( &lsn )) {
+            return (err = BLTERR_wrt);
+        }
+
+        if (lsn <= synclsn) {
+            return BLTERR_ok;
+        }
+
+    #ifdef unix
+        if (fdatasync( redo->idx )) {
+            return (err = BLTERR_wrt);
+        }
+    #endif
+
+        // advance the synced lsn, unless a later commit already has
+        for (uid synced = synclsn; synced < lsn; synced = synclsn) {
+    #ifdef unix
+            if (__sync_bool_compare_and_swap( &synclsn, synced, lsn )) break;
+    #else
+            if (_InterlockedCompareExchange64( (LONG64*)&synclsn, lsn, synced ) == synced) break;
+    #endif
+        }
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: sync
+    *
+    *  start kernel write-back of the redo log and the btree
+    *  file, and with wait set, sync both
+    */
+    BLTERR BufMgr::sync( uint wait ) {
+        uid lsn = 0;
+
+        if (redo && redo->tail( &lsn )) {
+            return (err = BLTERR_wrt);
+        }
+
+    #ifdef unix
+        if (redo) {
+            sync_file_range( redo->idx, 0, 0, SYNC_FILE_RANGE_WRITE );
+        }
+
+        if (vlog) {
+            sync_file_range( vlog->idx, 0, 0, SYNC_FILE_RANGE_WRITE );
+        }
+
+        for (uint file = 0; file < nfiles; file++) {
+            sync_file_range( files[file], 0, 0, SYNC_FILE_RANGE_WRITE );
+        }
+
+        if (!wait) {
+            return BLTERR_ok;
+        }
+
+        if (redo && fdatasync( redo->idx )) {
+            return (err = BLTERR_wrt);
+        }
+
+        if (vlog && vlog->sync()) {
+            return (err = BLTERR_wrt);
+        }
+
+        for (uint file = 0; file < nfiles; file++) {
+            if (fdatasync( files[file] )) {
+                return (err = BLTERR_wrt);
+            }
+        }
+    #else
+        if (!wait) {
+            return BLTERR_ok;
+        }
+
+        for (uint file = 0; file < nfiles; file++) {
+            FlushFileBuffers( files[file] );
+        }
+    #endif
+
+        if (lsn > synclsn) {
+            synclsn = lsn;
+        }
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: syncthread
+    *
+    *  DURABLE_periodic syncs, with write-back started
+    *  halfway through each interval
+    */
+    void* BufMgr::syncthread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+        time_t last = time( NULL );
+        uint started = 0;
+
+        while (!mgr->syncstop) {
+    #ifdef unix
+            usleep( 100000 );
+    #else
+            Sleep( 100 );
+    #endif
+
+            time_t now = time( NULL );
+
+            if (!started && 2 * (now - last) >= mgr->syncsecs) {
+                mgr->sync( 0 );
+                started = 1;
+            }
+
+            if (now - last < mgr->syncsecs) continue;
+
+            if (mgr->sync( 1 )) {
+                std::cerr << "Periodic sync failed, errno = " << errno << std::endl;
+            }
+
+            last = now;
+            started = 0;
+        }
+
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: savewarm
+    *
+    *  write the page numbers resident in the pool to the
+    *  warm file, interior levels first, then by heat.
+    *  Heat decays each time, so it follows recent use.
+    *  @return number of page numbers written
+    */
+    uint BufMgr::savewarm() {
+        std::vector< std::pair< uid, uid > > hot;     // (level:heat, page_no)
+        LatchSet* latch;
+        WarmHdr hdr[1];
+        uid page_no;
+
+        if (!warmname || readonly || (shmhdr && !shmowner)) return 0;
+
+        std::string tmpname( std::string( warmname ) + ".tmp" );
+
+        for (uint slot = 1; slot < latchtotal; slot++) {
+            latch = latchsets + slot;
+
+            if ( !(page_no = latch->page_no) ) continue;
+
+            // pin the frame so it is not evicted while its level is read
+            LatchSet* found = findlatch( page_no );
+
+            if (found != latch) {
+                if (found) unpinlatch( found );
+                continue;
+            }
+
+            hot.push_back( std::make_pair( ((uid)mappage( latch )->lvl << 32) | latch->hits,
+                                            page_no ) );
+            latch->hits >>= 1;
+
+            // unpin without setting the CLOCK bit, this is no use
+            pinlog( latch, -1 );
+    #ifdef unix
+            __sync_fetch_and_add( &latch->pin, -1 );
+    #else
+            _InterlockedDecrement16( &latch->pin );
+    #endif
+        }
+
+        std::sort( hot.begin(), hot.end(), std::greater< std::pair< uid, uid > >() );
+
+        FILE* out = fopen( tmpname.c_str(), "wb" );
+        if (!out) {
+            std::cerr << "Unable to create " << tmpname << std::endl;
+            return 0;
+        }
+
+        hdr->magic = WARM_magic;
+        hdr->page_bits = page_bits;
+        hdr->cnt = hot.size();
+        fwrite( hdr, sizeof(WarmHdr), 1, out );
+
+        for (uint idx = 0; idx < hot.size(); idx++) {
+            fwrite( &hot[idx].second, sizeof(uid), 1, out );
+        }
+
+        // replace the old file only with a complete one
+        if (fclose( out ) || rename( tmpname.c_str(), warmname )) {
+            std::cerr << "Unable to write " << warmname << std::endl;
+            return 0;
+        }
+
+        return hot.size();
+    }
+
+    /**
+    *  warm-up reader thread argument
+    */
+    struct WarmArg {
+        BufMgr* mgr;
+        uid* pages;                 // page numbers in ascending order
+        uint cnt;                   // number of page numbers
+        uint loaded;                // pages brought into the pool
+    };
+
+    /**
+    *  FUNCTION: warmup
+    *
+    *  reload the hot page set saved by a previous close into
+    *  unused pool frames, so no resident page is evicted.
+    *  The best pages are split into ascending ranges, read
+    *  in runs of consecutive pages by parallel threads.
+    *  With background set this returns at once, and the
+    *  pool warms while traffic is served.
+    *  @return number of pages loaded
+    */
+    uint BufMgr::warmup( uint threads, uint background ) {
+        uid max = BLTVal::getid( pagezero->alloc->right );
+        std::vector< uid > pages;
+        WarmHdr hdr[1];
+        uid page_no;
+        uint loaded = 0;
+
+        if (memory) return 0;
+
+        if (!threads) threads = 1;
+
+        if (background) {
+            warmthreads = threads;
+    #ifdef unix
+            if (pthread_create( &warmtid, NULL, BufMgr::warmthread, this )) {
+                warmtid = 0;
+            }
+    #else
+            warmtid = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::warmthread,
+                                    this, 0, NULL );
+    #endif
+            return 0;
+        }
+
+        FILE* in = warmname ? fopen( warmname, "rb" ) : NULL;
+        if (!in) return 0;
+
+        if (fread( hdr, sizeof(WarmHdr), 1, in ) < 1
+                || hdr->magic != WARM_magic || hdr->page_bits != page_bits) {
+            std::cerr << "Ignoring invalid warm file " << warmname << std::endl;
+            fclose( in );
+            return 0;
+        }
+
+        // keep the best pages that fit the pool
+        while (pages.size() < hdr->cnt && pages.size() < latchactive - 1) {
+            if (fread( &page_no, sizeof(uid), 1, in ) < 1) break;
+            if (page_no > ALLOC_page && page_no < max) pages.push_back( page_no );
+        }
+
+        fclose( in );
+
+        if (pages.empty()) return 0;
+
+        std::sort( pages.begin(), pages.end() );
+
+        if (threads > pages.size()) threads = pages.size();
+
+        WarmArg* args = new WarmArg[threads];
+        uint chunk = (pages.size() + threads - 1) / threads;
+
+    #ifdef unix
+        pthread_t tid[threads];
+    #else
+        HANDLE tid[threads];
+    #endif
+
+        for (uint idx = 0; idx < threads; idx++) {
+            args[idx].mgr = this;
+            args[idx].pages = &pages[idx * chunk];
+            args[idx].cnt = std::min( chunk, (uint)pages.size() - idx * chunk );
+            args[idx].loaded = 0;
+    #ifdef unix
+            pthread_create( &tid[idx], NULL, BufMgr::warmreader, &args[idx] );
+    #else
+            tid[idx] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE)BufMgr::warmreader,
+                                    &args[idx], 0, NULL );
+    #endif
+        }
+
+        for (uint idx = 0; idx < threads; idx++) {
+    #ifdef unix
+            pthread_join( tid[idx], NULL );
+    #else
+            WaitForSingleObject( tid[idx], INFINITE );
+            CloseHandle( tid[idx] );
+    #endif
+            loaded += args[idx].loaded;
+        }
+
+        delete [] args;
+        std::cerr << loaded << " buffer pool pages warmed" << std::endl;
+        return loaded;
+    }
+
+    /**
+    *  FUNCTION: warmthread
+    *
+    *  background warm-up
+    */
+    void* BufMgr::warmthread( void* arg ) {
+        BufMgr* mgr = (BufMgr*)arg;
+
+        mgr->warmup( mgr->warmthreads, 0 );
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: warmreader
+    *
+    *  ask the kernel to read each run of consecutive pages
+    *  ahead in one request, then pin its pages into the pool,
+    *  each read once, from the file cache
+    */
+    void* BufMgr::warmreader( void* arg ) {
+        WarmArg* args = (WarmArg*)arg;
+        BufMgr* mgr = args->mgr;
+        uint reads = 0;
+        uint writes = 0;
+        LatchSet* latch;
+        uint run;
+
+        for (uint idx = 0; idx < args->cnt; idx += run) {
+            uid page_no = args->pages[idx];
+
+            for (run = 1; idx + run < args->cnt && run < WARM_run; run++) {
+                if (args->pages[idx + run] != page_no + run) break;
+            }
+
+            run = mgr->striperun( page_no, run );
+
+    #ifdef unix
+            off64_t off;
+            uint file = mgr->pagefile( page_no, &off );
+
+            posix_fadvise( mgr->files[file], off, (uid)run << mgr->page_bits,
+                            POSIX_FADV_WILLNEED );
+    #endif
+
+            for (uint off = 0; off < run; off++) {
+
+                // stop once the pool has no unused frames
+                if (mgr->latchdeployed >= mgr->latchactive - 1) {
+                    run = args->cnt - idx;
+                    break;
+                }
+
+                if ( (latch = mgr->pinlatch( page_no + off, 1, &reads, &writes )) ) {
+                    mgr->unpinlatch( latch );
+                    args->loaded++;
+                }
+            }
+        }
+
+        return NULL;
+    }
+
+    /**
+    *  FUNCTION: poolaudit
+    */
+    void BufMgr::poolaudit() {
+        LatchSet *latch;
+        uint slot = 0;
     
-    	// flush dirty pool pages to the btree
-    	for (uint slot = 1; slot <= latchdeployed; slot++ ) {
-    		page = (Page*)(((uid)slot << page_bits) + pagepool);
+    	while( ++slot < latchtotal ) {
     		latch = latchsets + slot;
     
-    		if (latch->dirty) {
-    			writepage( page, latch->page_no );
-    			latch->dirty = 0;
-                num++;
+    		if (*latch->readwr->rin & MASK) {
+    			std::cerr << "latchset " << slot
+                            << " rwlocked for page " << latch->page_no << std::endl;
+            }
+    		memset ((ushort *)latch->readwr, 0, sizeof(BLT_RWLock));
+    
+    		if (*latch->access->rin & MASK) {
+    			std::cerr << "latchset " << slot
+                            << " accesslocked for page " << latch->page_no << std::endl;
+            }
+    		memset( (ushort *)latch->access, 0, sizeof(BLT_RWLock) );
+    
+    		if (*latch->parent->rin & MASK) {
+    			std::cerr << "latchset " << slot
+                            << " parentlocked for page " << latch->page_no << std::endl;
+            }
+    		memset ((ushort *)latch->parent, 0, sizeof(BLT_RWLock));
+    
+    		if (latch->pin & ~CLOCK_bit) {
+    			std::cerr << "latchset " << slot
+                            << " pinned for page " << latch->page_no << std::endl;
+    			latch->pin = 0;
+    		}
+    	}
+    }
+
+    /**
+    *  incremental backup file header,
+    *  followed by (page_no, page image) records
+    */
+    struct BackupHdr {
+        uint magic;                 // BACKUP_magic
+        uint page_bits;             // page size in bits
+        uid since;                  // lowest page epoch copied
+        uid upto;                   // backup epoch closed by this backup
+        uid pages;                  // number of page records
+    };
+
+    #define BACKUP_magic 0x424c5442
+
+    /**
+    *  FUNCTION: backup
+    *
+    *  copy every page written since the given epoch, plus
+    *  dirty pool pages, to the backup file at path.
+    *  since == 0 produces a full backup.
+    *  @return epoch to pass as since for the next backup, or 0 on error
+    */
+    uid BufMgr::backup( const char* path, uid since ) {
+        BackupHdr hdr[1];
+        LatchSet* latch;
+        uint take;
+
+        err = BLTERR_ok;
+
+    	if (memory) {
+    		std::cerr << "Unable to back up an in-memory btree" << std::endl;
+    		err = BLTERR_wrt;
+    		return 0;
+    	}
+
+    	// close the current epoch, later writes are stamped upto+1
+    #ifdef unix
+    	uid upto = __sync_fetch_and_add( pagezero->epoch, 1 );
+    #else
+    	uid upto = _InterlockedIncrement64( pagezero->epoch ) - 1;
+    #endif
+
+    	int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    	if (-1 == fd) {
+    		std::cerr << "Unable to open backup file " << path << std::endl;
+    		err = BLTERR_wrt;
+    		return 0;
+    	}
+
+    	Page* page = (Page*)valloc( page_size );
+    	uid maxpage = BLTVal::getid( pagezero->alloc->right );
+    	off64_t off = sizeof(BackupHdr);
+
+    	memset( hdr, 0, sizeof(BackupHdr) );
+    	hdr->magic = BACKUP_magic;
+    	hdr->page_bits = page_bits;
+    	hdr->since = since;
+    	hdr->upto = upto;
+
+    	// page zero goes last so an interrupted restore
+    	// cannot advance the chain epoch
+    	for (uid page_no = ROOT_page; page_no <= maxpage; page_no++) {
+    		if (page_no == maxpage) {
+    			memcpy( page, pagezero, page_size );
+    			page_no = ALLOC_page;
+    			take = 1;
+    		}
+    		else if ( (latch = findlatch( page_no )) ) {
+    			lockpage( LockRead, latch );
+    			if ( (take = latch->dirty || mappage( latch )->epoch >= since) ) {
+    				memcpy( page, mappage( latch ), page_size );
+    				page->crc = Page::checksum( page, page_size );
+                }
+    			unlockpage( LockRead, latch );
+    			unpinlatch( latch );
+    		}
+    		else {
+    			// reserved and punched pages read as zeros, and
+    			// nothing reads them before they are rewritten,
+    			// a short read is a page past the end of the file
+    			off64_t off;
+    			uint file = pagefile( page_no, &off );
+
+    			memset( page, 0, page_size );
+    			if (pread( files[file], page, page_size, off ) < 0) {
+    				std::cerr << "Unable to read page " << page_no << " errno = " << errno << std::endl;
+    				err = BLTERR_read;
+    				break;
+    			}
+
+    			// compressed pages are backed up raw
+    			if ((err = unpackpage( page, page_size, page_no ))) {
+    				break;
+    			}
+    			take = page->bits && page->epoch >= since;
+            }
+
+    		if (!take) continue;
+
+    		if (pwrite( fd, &page_no, sizeof(uid), off ) != sizeof(uid)
+    				|| pwrite( fd, page, page_size, off + sizeof(uid) ) < page_size) {
+    			err = BLTERR_wrt;
+    			break;
+    		}
+
+    		off += sizeof(uid) + page_size;
+    		hdr->pages++;
+
+    		if (page_no == ALLOC_page) break;
+    	}
+
+    	if (!err && pwrite( fd, hdr, sizeof(BackupHdr), 0 ) != sizeof(BackupHdr)) {
+    		err = BLTERR_wrt;
+        }
+
+    	::close( fd );
+    	free( page );
+
+    	if (err) {
+    		std::cerr << "Backup to " << path << " failed" << std::endl;
+    		return 0;
+    	}
+
+    	std::cerr << hdr->pages << " pages backed up for epochs "
+                    << since << " to " << upto << std::endl;
+    	return upto + 1;
+    }
+
+    /**
+    *  FUNCTION: restore
+    *
+    *  apply one backup file to the closed btree file name.
+    *  apply a full backup first, then each incremental in order.
+    */
+    BLTERR BufMgr::restore( const char* name, const char* path ) {
+        BackupHdr hdr[1];
+        PageZero* pagezero;
+        uid page_no;
+
+    	int src = open( path, O_RDONLY );
+    	if (-1 == src) {
+    		std::cerr << "Unable to open backup file " << path << std::endl;
+    		return BLTERR_read;
+    	}
+
+    	if (pread( src, hdr, sizeof(BackupHdr), 0 ) != sizeof(BackupHdr)
+    			|| hdr->magic != BACKUP_magic) {
+    		std::cerr << "Invalid backup file " << path << std::endl;
+    		::close( src );
+    		return BLTERR_read;
+    	}
+
+    	int dst = open( name, O_RDWR | O_CREAT, 0666 );
+    	if (-1 == dst) {
+    		std::cerr << "Unable to open btree file " << name << std::endl;
+    		::close( src );
+    		return BLTERR_wrt;
+    	}
+
+    	uint page_size = 1 << hdr->page_bits;
+    	pagezero = (PageZero*)valloc( page_size );
+
+    	// an incremental backup must continue the chain
+    	// restored so far
+    	if (hdr->since) {
+    		if (pread( dst, pagezero, page_size, 0 ) < page_size
+    				|| pagezero->alloc->bits != hdr->page_bits
+    				|| *pagezero->epoch != hdr->since) {
+    			std::cerr << "Backup " << path << " does not continue the chain in "
+                            << name << std::endl;
+    			::close( src );
+    			::close( dst );
+    			free( pagezero );
+    			return BLTERR_struct;
+    		}
+        }
+
+    	off64_t off = sizeof(BackupHdr);
+    	BLTERR err = BLTERR_ok;
+
+    	for (uid cnt = 0; cnt < hdr->pages; cnt++) {
+    		if (pread( src, &page_no, sizeof(uid), off ) != sizeof(uid)
+    				|| pread( src, pagezero, page_size, off + sizeof(uid) ) < page_size) {
+    			err = BLTERR_read;
+    			break;
+    		}
+
+    		// a striped btree restores into the one file
+    		if (page_no == ALLOC_page) {
+    			pagezero->stripes = 0;
+    		}
+
+    		if (pwrite( dst, pagezero, page_size, page_no << hdr->page_bits ) < page_size) {
+    			err = BLTERR_wrt;
+    			break;
+    		}
+
+    		off += sizeof(uid) + page_size;
+    	}
+
+    	// page zero comes last, and the file ends at its alloc
+    	if (!err && hdr->pages && page_no == ALLOC_page) {
+    		if (ftruncate( dst, BLTVal::getid( pagezero->alloc->right ) << hdr->page_bits )) {
+    			err = BLTERR_wrt;
     		}
-            //madvise( page, page_size, MADV_DONTNEED );
     	}
+
+    	::close( src );
+    	::close( dst );
+    	free( pagezero );
+
+    	if (err) {
+    		std::cerr << "Restore of " << path << " failed" << std::endl;
+        }
+    	return err;
+    }
+
+    /**
+    *  FUNCTION: latchlink
+    *
+    *  Link latch table entry into head of latch hash table.
+    *  A page that cannot be loaded is unlinked again, its
+    *  frame left empty and unpinned for the victim scan;
+    *  the caller still releases the hash chain latch.
+    */
+    BLTERR BufMgr::latchlink( uint hashidx, uint slot, uid page_no,
+                                uint load_it, uint* reads ) {
     
-    	std::cerr << num << " buffer pool pages flushed" << std::endl;
+        Page* page = (Page*)(((uid)slot << page_bits) + pagepool);
+        LatchSet* latch = latchsets + slot;
+    
+        if (latch->next = hashtable[hashidx].slot) {
+            latchsets[latch->next].prev = slot;
+        }
     
+        hashtable[hashidx].slot = slot;
+        memset( &latch->atomictid, 0, sizeof(latch->atomictid) );
+        latch->page_no = page_no;
+        latch->entry = slot;
+        latch->split = 0;
+        latch->prev = 0;
+        latch->hits = 0;
+        latch->pin = 1;
+
+        // a mapped page is read by the faults touching it
+        if (mapsegs) {
+            if (load_it) {
+                shards[shardof()].misses++;
+            }
+
+            if (page_no < mappages || !mapextend( page_no )) {
+                return (err = BLTERR_ok);
+            }
+        }
+        else if (load_it) {
+            shards[shardof()].misses++;
+
+            if (tierfetch( page, page_no ) || cachefetch( page, page_no )) {
+                return (err = BLTERR_ok);
+            }
+            else if ( !(err = readpage( page, page_no )) ) {
+                (*reads)++;
+                return BLTERR_ok;
+            }
+        }
+        else {
+            return (err = BLTERR_ok);
+        }
+
+        // we are still at the head of the chain
+        if ( (hashtable[hashidx].slot = latch->next) ) {
+            latchsets[latch->next].prev = 0;
+        }
+
+        latch->page_no = 0;
+        latch->next = 0;
+
     #ifdef unix
-    	munmap( hashtable, (uid)nlatchpage << page_bits );
-    	munmap( pagezero, page_size );
+        __sync_fetch_and_add( &latchdeployed, -1 );
     #else
-    	FlushViewOfFile( pagezero, 0 );
-    	UnmapViewOfFile( pagezero );
-    	UnmapViewOfFile( hashtable );
-    	CloseHandle( halloc );
-    	CloseHandle( hpool );
+        _InterlockedDecrement( &latchdeployed );
     #endif
+
+        latch->pin = 0;
+        return err;
+    }
     
+    /**
+    *  FUNCTION: tier
+    *
+    *  keep up to bytes of evicted clean pages compressed
+    *  in memory, where a pool miss looks before reading
+    *  the file; call before the btree is used
+    */
+    BLTERR BufMgr::tier( uid bytes ) {
+        uint want = TIER_slots * (uint)(bytes >> page_bits);
+
+    	// a mapped file has no pool misses to fill
+    	if (!bytes || tierbytes || mapsegs || shmhdr || memory) {
+    		return BLTERR_ok;
+    	}
+
+    	for (ntierslots = 1; ntierslots < want; ntierslots <<= 1);
+
+    	tierring = (uchar*)malloc( bytes );
+    	tierslots = (TierSlot*)calloc( ntierslots, sizeof(TierSlot) );
+
+    	if (!tierring || !tierslots) {
+    		free( tierring );
+    		free( tierslots );
+    		tierring = NULL;
+    		tierslots = NULL;
+    		return (err = BLTERR_struct);
+    	}
+
+    	tierhead = 0;
+    	tierbytes = bytes;
+    	return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: tierstash
+    *
+    *  append a clean page leaving the pool to the tier ring,
+    *  overwriting the oldest images. The image leaves out
+    *  the free gap between the slot array and the keys, or
+    *  of an overflow page, everything past its value bytes.
+    */
+    void BufMgr::tierstash( Page* page, uid page_no ) {
+        uint head = sizeof(Page) + page->cnt * sizeof(Slot);
+        uint len = head + page_size - page->min;
+
+    	if (!tierbytes || page->free || page->min > page_size) {
+    		return;
+    	}
+
+    	// an overflow page keeps its value right after the header
+    	if (page->ovfl && !page->cnt) {
+    		head = sizeof(Page) + page->min;
+    		len = head;
+
+    		if (head > page_size) {
+    			return;
+    		}
+    	}
+
+    	// nor is a page without keys that is not marked, such as
+    	// the overflow pages of files written before the marker
+    	else if (!page->cnt || head > page->min) {
+    		return;
+    	}
+
+    	if (len > tierbytes) {
+    		return;
+    	}
+
+        TierSlot* slot = tierslots + (page_no & (ntierslots - 1));
+
+    	SpinLatch::spinwritelock( tierlatch );
+
+        uid pos = tierhead;
+
+    	// images never wrap around the end of the ring
+    	if (pos % tierbytes + len > tierbytes) {
+    		pos += tierbytes - pos % tierbytes;
+    	}
+
+        uchar* image = tierring + pos % tierbytes;
+
+    	memcpy( image, page, head );
+    	memcpy( image + head, (uchar*)page + page->min, len - head );
+    	tierhead = pos + len;
+    	slot->page_no = page_no;
+    	slot->pos = pos;
+    	slot->len = len;
+    	tierstored++;
+
+    	SpinLatch::spinreleasewrite( tierlatch );
+    }
+
+    /**
+    *  FUNCTION: tierfetch
+    *
+    *  load a page from the tier into its pool frame,
+    *  taking it out of the tier
+    *  @return 1 if the tier had the page
+    */
+    uint BufMgr::tierfetch( Page* page, uid page_no ) {
+    	if (!tierbytes) {
+    		return 0;
+    	}
+
+        TierSlot* slot = tierslots + (page_no & (ntierslots - 1));
+
+    	SpinLatch::spinwritelock( tierlatch );
+
+    	if (slot->page_no != page_no || tierhead - slot->pos > tierbytes) {
+    		SpinLatch::spinreleasewrite( tierlatch );
+    		return 0;
+    	}
+
+        uchar* image = tierring + slot->pos % tierbytes;
+        Page* hdr = (Page*)image;
+        uint head = sizeof(Page) + hdr->cnt * sizeof(Slot);
+
+    	// an overflow page's image is the page up to its last value byte
+    	if (hdr->ovfl && !hdr->cnt) {
+    		head = sizeof(Page) + hdr->min;
+    		memcpy( page, image, head );
+    		memset( (uchar*)page + head, 0, page_size - head );
+    	}
+    	else {
+    		memcpy( page, image, head );
+    		memset( (uchar*)page + head, 0, page->min - head );
+    		memcpy( (uchar*)page + page->min, image + head, page_size - page->min );
+    	}
+
+    	slot->page_no = 0;
+    	tierhits++;
+
+    	SpinLatch::spinreleasewrite( tierlatch );
+    	return 1;
+    }
+
+    /**
+    *  FUNCTION: tierdrop
+    *
+    *  forget the tier image of a page written to the file
+    */
+    void BufMgr::tierdrop( uid page_no ) {
+    	if (!tierbytes) {
+    		return;
+    	}
+
+        TierSlot* slot = tierslots + (page_no & (ntierslots - 1));
+
+    	SpinLatch::spinwritelock( tierlatch );
+
+    	if (slot->page_no == page_no) {
+    		slot->page_no = 0;
+    	}
+
+    	SpinLatch::spinreleasewrite( tierlatch );
+    }
+
+    /**
+    *  FUNCTION: hitratios
+    *
+    *  report how many pins the pool, then the compressed
+    *  tier, then the cache file satisfied
+    */
+    void BufMgr::hitratios() {
+        uid hits = 0, misses = 0;
+
+    	for (uint idx = 0; idx < nshards; idx++) {
+    		hits += shards[idx].hits;
+    		misses += shards[idx].misses;
+    	}
+
+    	std::cerr << "pool hits " << hits << " misses " << misses << " ratio "
+                    << (hits + misses ? 100.0 * hits / (hits + misses) : 0) << "%" << std::endl;
+
+    	if (tierbytes) {
+    		std::cerr << "tier hits " << tierhits << " misses " << misses - tierhits << " ratio "
+                        << (misses ? 100.0 * tierhits / misses : 0) << "%, "
+                        << tierstored << " pages stashed" << std::endl;
+    	}
+
+    	// the cache file sees what the tier missed
+    	misses -= tierhits;
+
+    	if (ncachesets) {
+    		std::cerr << "cache file hits " << cachehits << " misses " << misses - cachehits << " ratio "
+                        << (misses ? 100.0 * cachehits / misses : 0) << "%, "
+                        << cachestored << " pages written" << std::endl;
+    	}
+    }
+
+    /**
+    *  FUNCTION: cachefile
+    *
+    *  keep up to bytes of pages evicted from the pool in a
+    *  secondary cache file at path, for a btree file on slow
+    *  storage. The cache file starts empty at every open;
+    *  call before the btree is used.
+    */
+    BLTERR BufMgr::cachefile( const char* path, uid bytes ) {
+        uid sets = (bytes >> page_bits) / CACHE_ways;
+
+    	if (!sets || ncachesets || mapsegs || shmhdr || memory) {
+    		return BLTERR_ok;
+    	}
+
     #ifdef unix
-    	::close( idx );
-    	//free( mgr );
+    	cacheidx = open( path, O_RDWR | O_CREAT | O_TRUNC, 0666 );
+
+    	if (cacheidx == -1) {
+    		std::cerr << "Unable to open cache file " << path << " errno = " << errno << std::endl;
+    		return (err = BLTERR_struct);
+    	}
+    #else
+    	cacheidx = CreateFile( path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+
+    	if (cacheidx == INVALID_HANDLE_VALUE) {
+    		std::cerr << "Unable to open cache file " << path << " GetLastError = " << GetLastError() << std::endl;
+    		return (err = BLTERR_struct);
+    	}
+    #endif
+
+    	cachesets = (CacheSet*)calloc( sets, sizeof(CacheSet) );
+    	cacheways = (CacheWay*)calloc( sets * CACHE_ways, sizeof(CacheWay) );
+    	ncachesets = sets;
+    	return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: cacheadmit
+    *
+    *  write a clean page leaving the pool into a frame of its
+    *  set, unless the frame already holds it. The set's
+    *  CLOCK passes over frames hit since it last came by.
+    */
+    void BufMgr::cacheadmit( Page* page, uid page_no ) {
+    	if (!ncachesets || page->free) {
+    		return;
+    	}
+
+        uid set = page_no % ncachesets;
+        CacheSet* cache = cachesets + set;
+        CacheWay* ways = cacheways + set * CACHE_ways;
+        uint way;
+
+    	SpinLatch::spinwritelock( cache->latch );
+
+    	// any write of the page dropped its frame
+    	for (way = 0; way < CACHE_ways; way++) {
+    		if (ways[way].page_no == page_no) {
+    			ways[way].ref = 1;
+    			SpinLatch::spinreleasewrite( cache->latch );
+    			return;
+    		}
+    	}
+
+    	for (;;) {
+    		way = cache->hand++ % CACHE_ways;
+
+    		if (!ways[way].page_no || !ways[way].ref) {
+    			break;
+    		}
+
+    		ways[way].ref = 0;
+    	}
+
+    	// the checksum is checked when the frame is read back
+    	page->crc = Page::checksum( page, page_size );
+    	ways[way].page_no = 0;
+    	ways[way].ref = 0;
+
+        off64_t off = (set * CACHE_ways + way) << page_bits;
+
+    #ifdef unix
+    	if (pwrite( cacheidx, page, page_size, off ) == page_size) {
+    		ways[way].page_no = page_no;
+    		cachestored++;
+    	}
     #else
-    	FlushFileBuffers( idx );
-    	CloseHandle( idx );
-    	//GlobalFree( mgr);
+        OVERLAPPED ovl[1];
+        uint amt[1];
+
+    	memset( ovl, 0, sizeof(OVERLAPPED) );
+    	ovl->Offset = off;
+    	ovl->OffsetHigh = off >> 32;
+
+    	if (WriteFile( cacheidx, page, page_size, amt, ovl ) && *amt == page_size) {
+    		ways[way].page_no = page_no;
+    		cachestored++;
+    	}
+    #endif
+
+    	SpinLatch::spinreleasewrite( cache->latch );
+    }
+
+    /**
+    *  FUNCTION: cachefetch
+    *
+    *  load a page from its cache file frame, which
+    *  stays cached while the page is clean
+    *  @return 1 if the cache file had the page
+    */
+    uint BufMgr::cachefetch( Page* page, uid page_no ) {
+    	if (!ncachesets) {
+    		return 0;
+    	}
+
+        uid set = page_no % ncachesets;
+        CacheSet* cache = cachesets + set;
+        CacheWay* ways = cacheways + set * CACHE_ways;
+        uint found = 0;
+        uint way;
+
+    	SpinLatch::spinwritelock( cache->latch );
+
+    	for (way = 0; way < CACHE_ways; way++) {
+    		if (ways[way].page_no == page_no) {
+    			break;
+    		}
+    	}
+
+    	if (way < CACHE_ways) {
+            off64_t off = (set * CACHE_ways + way) << page_bits;
+
+    #ifdef unix
+    		found = pread( cacheidx, page, page_size, off ) == page_size;
+    #else
+            OVERLAPPED ovl[1];
+            uint amt[1];
+
+    		memset( ovl, 0, sizeof(OVERLAPPED) );
+    		ovl->Offset = off;
+    		ovl->OffsetHigh = off >> 32;
+    		found = ReadFile( cacheidx, page, page_size, amt, ovl ) && *amt == page_size;
     #endif
+
+    		// a bad frame is dropped, the btree file has the page
+    		if (found && page->crc != Page::checksum( page, page_size )) {
+    			found = 0;
+    		}
+
+    		if (found) {
+    			ways[way].ref = 1;
+    			cachehits++;
+    		}
+    		else {
+    			ways[way].page_no = 0;
+    		}
+    	}
+
+    	SpinLatch::spinreleasewrite( cache->latch );
+    	return found;
     }
-    
+
     /**
-    *  FUNCTION: poolaudit
+    *  FUNCTION: cachedrop
+    *
+    *  forget the cache file frame of a page being written
     */
-    void BufMgr::poolaudit() {
-        LatchSet *latch;
-        uint slot = 0;
-    
-    	while( slot++ < latchdeployed ) {
-    		latch = latchsets + slot;
-    
-    		if (*latch->readwr->rin & MASK) {
-    			std::cerr << "latchset " << slot
-                            << " rwlocked for page " << latch->page_no << std::endl;
-            }
-    		memset ((ushort *)latch->readwr, 0, sizeof(BLT_RWLock));
-    
-    		if (*latch->access->rin & MASK) {
-    			std::cerr << "latchset " << slot
-                            << " accesslocked for page " << latch->page_no << std::endl;
-            }
-    		memset( (ushort *)latch->access, 0, sizeof(BLT_RWLock) );
-    
-    		if (*latch->parent->rin & MASK) {
-    			std::cerr << "latchset " << slot
-                            << " parentlocked for page " << latch->page_no << std::endl;
-            }
-    		memset ((ushort *)latch->parent, 0, sizeof(BLT_RWLock));
-    
-    		if (latch->pin & ~CLOCK_bit) {
-    			std::cerr << "latchset " << slot
-                            << " pinned for page " << latch->page_no << std::endl;
-    			latch->pin = 0;
+    void BufMgr::cachedrop( uid page_no ) {
+    	if (!ncachesets) {
+    		return;
+    	}
+
+        uid set = page_no % ncachesets;
+        CacheSet* cache = cachesets + set;
+        CacheWay* ways = cacheways + set * CACHE_ways;
+
+    	SpinLatch::spinwritelock( cache->latch );
+
+    	for (uint way = 0; way < CACHE_ways; way++) {
+    		if (ways[way].page_no == page_no) {
+    			ways[way].page_no = 0;
     		}
     	}
+
+    	SpinLatch::spinreleasewrite( cache->latch );
     }
 
     /**
-    *  FUNCTION: latchlink
+    *  FUNCTION: mappage
     *
-    *  Link latch table entry into head of latch hash table.
+    *  @return cached page address
     */
-    BLTERR BufMgr::latchlink( uint hashidx, uint slot, uid page_no,
-                                uint load_it, uint* reads ) {
-    
-        Page* page = (Page*)(((uid)slot << page_bits) + pagepool);
-        LatchSet* latch = latchsets + slot;
-    
-        if (latch->next = hashtable[hashidx].slot) {
-            latchsets[latch->next].prev = slot;
+    Page* BufMgr::mappage( LatchSet* latch ) {
+        if (mapsegs) {
+            return mapfile( latch->page_no );
         }
-    
-        hashtable[hashidx].slot = slot;
-        memset( &latch->atomictid, 0, sizeof(latch->atomictid) );
-        latch->page_no = page_no;
-        latch->entry = slot;
-        latch->split = 0;
-        latch->prev = 0;
-        latch->pin = 1;
-    
-        if (load_it) {
-            if ( (err = readpage( page, page_no )) ) {
-                return err;
+
+        Page* page = (Page*)(((uid)latch->entry << page_bits) + pagepool);
+        return page;
+    }
+
+    /**
+    *  FUNCTION: mapfile
+    *
+    *  BUF_mmap: the page's place in the file mapping, mapping
+    *  its segment first if need be. The mapping is private,
+    *  so changes stay in memory until write-back writes the
+    *  pages in the order the btree needs, as it does from the
+    *  pool. Segments are advised for random access; scans
+    *  read ahead through the prefetch thread.
+    *  @return mapped page address, or NULL past the last
+    *  segment or when the segment cannot be mapped
+    */
+    Page* BufMgr::mapfile( uid page_no ) {
+        uid off = page_no << page_bits;
+        uid seg = off >> MMAP_segbits;
+
+        if (seg >= MMAP_segs) {
+            std::cerr << "Page " << page_no << " lies past the last file mapping segment" << std::endl;
+            return NULL;
+        }
+
+        uchar* base = mapsegs[seg];
+
+    #ifdef unix
+        if (!base) {
+            base = (uchar*)mmap( 0, (uid)1 << MMAP_segbits, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE, idx, seg << MMAP_segbits );
+
+            if (MAP_FAILED == base) {
+                std::cerr << "Unable to map btree file segment " << seg
+                            << ", error = " << errno << std::endl;
+                return NULL;
             }
-            else {
-                *reads++;
+
+            madvise( base, (uid)1 << MMAP_segbits, MADV_RANDOM );
+
+            // another thread mapped it first
+            if (!__sync_bool_compare_and_swap( &mapsegs[seg], NULL, base )) {
+                munmap( base, (uid)1 << MMAP_segbits );
+                base = mapsegs[seg];
             }
         }
-        return (err = BLTERR_ok);
+    #endif
+
+        return (Page*)(base + (off & (((uid)1 << MMAP_segbits) - 1)));
     }
-    
+
     /**
-    *  FUNCTION: mappage
+    *  FUNCTION: mapextend
     *
-    *  @return cached page address
+    *  BUF_mmap: grow the file over page_no before its mapping
+    *  is touched, a mapped page past the end of the file
+    *  faults. The file grows an extent at a time.
     */
-    Page* BufMgr::mappage( LatchSet* latch ) {
-        Page* page = (Page*)(((uid)latch->entry << page_bits) + pagepool);
-        return page;
+    BLTERR BufMgr::mapextend( uid page_no ) {
+    #ifdef unix
+        struct stat st[1];
+
+        SpinLatch::spinwritelock( maplatch );
+
+        if (page_no >= mappages) {
+            uid pages = (page_no | (EXT_pages - 1)) + 1;
+
+            // pages written past mappages lengthen the file too
+            if (fstat( idx, st ) || ((uid)st->st_size < (pages << page_bits)
+                        && ftruncate( idx, pages << page_bits ))) {
+                SpinLatch::spinreleasewrite( maplatch );
+                std::cerr << "Unable to extend btree file, errno = " << errno << std::endl;
+                return (err = BLTERR_wrt);
+            }
+
+            mappages = pages;
+        }
+
+        SpinLatch::spinreleasewrite( maplatch );
+    #endif
+        return BLTERR_ok;
     }
     
     /**
@@ -492,11 +3804,42 @@ namespace mongo {
     */
     LatchSet* BufMgr::pinlatch( uid page_no, uint load_it,
                                     uint* reads, uint* writes ) {
-        uint hashidx = page_no % latchhash;
         LatchSet* latch;
+        uint hashidx;
+
+        // an in-memory page's latch is in its own slot
+        if (memory) {
+            if (page_no >= latchtotal) {
+                err = BLTERR_struct;
+                return NULL;
+            }
+
+            latch = latchsets + page_no;
+            latch->page_no = page_no;
+            latch->entry = page_no;
+    #ifdef unix
+            __sync_fetch_and_add( &latch->pin, 1 );
+    #endif
+            return latch;
+        }
+
+        // map a file page's segment first, so mappage of
+        // a pinned page cannot fail
+        if (mapsegs && !mapfile( page_no )) {
+            err = BLTERR_map;
+            return NULL;
+        }
     
+        //  lock our hash chain, rechecking it after a split
+        for (;;) {
+            hashidx = hashof( page_no );
+            SpinLatch::spinwritelock( hashtable[hashidx].latch );
+
+            if (hashidx == hashof( page_no )) break;
+            SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+        }
+
         //  try to find our entry
-        SpinLatch::spinwritelock( hashtable[hashidx].latch );
     
         uint slot = hashtable[hashidx].slot;
         if (slot) {
@@ -516,97 +3859,317 @@ namespace mongo {
             _InterlockedIncrement16( &latch->pin );
     #endif
     
+            latch->hits++;
+            shards[shardof()].hits++;
             SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+            pinlog( latch, 1 );
             return latch;
         }
     
         //  see if there are any unused pool entries
+        //  in the shard of our NUMA node
+        PoolShard* shard = shards + shardof();
     
     #ifdef unix
-        slot = __sync_fetch_and_add( &latchdeployed, 1 ) + 1;
+        slot = __sync_fetch_and_add( &shard->deployed, 1 );
     #else
-        slot = _InterlockedIncrement( &latchdeployed );
+        slot = _InterlockedIncrement( &shard->deployed ) - 1;
     #endif
     
-        if (slot < latchtotal) {
+        if (slot < shard->cnt) {
+            slot += shard->first;
             latch = latchsets + slot;
-            if (latchlink( hashidx, slot, page_no, load_it, reads )) return NULL;
-            SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
-            return latch;
+
+            // a regrown pool's victim scan may have taken it
+            if (claimlatch( latch )) {
+    #ifdef unix
+                __sync_fetch_and_add( &latchdeployed, 1 );
+    #else
+                _InterlockedIncrement( &latchdeployed );
+    #endif
+                if (latchlink( hashidx, slot, page_no, load_it, reads )) {
+                    SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                    return NULL;
+                }
+                SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                if (load_it) lockresident( latch );
+                pinlog( latch, 1 );
+                return latch;
+            }
         }
-    
+        else {
     #ifdef unix
-        __sync_fetch_and_add( &latchdeployed, -1 );
+            __sync_fetch_and_add( &shard->deployed, -1 );
     #else
-        _InterlockedDecrement( &latchdeployed );
+            _InterlockedDecrement( &shard->deployed );
     #endif
+        }
     
-        //  find and reuse previous entry on victim
-        while (1) {
+        //  find and reuse previous entry on the shard's victim clock
+        for (uint scan = 0; ; scan++) {
+
+            // a shared pool pinned full may hold a dead process's pins
+            if (pintable && scan && !(scan % (4 * shard->cnt))) {
+                reappool();
+            }
     
     #ifdef unix
-            slot = __sync_fetch_and_add( &latchvictim, 1 );
+            slot = __sync_fetch_and_add( &shard->victim, 1 );
     #else
-            slot = _InterlockedIncrement( &latchvictim ) - 1;
+            slot = _InterlockedIncrement( &shard->victim ) - 1;
     #endif
     
             // try to get write lock on hash chain 
             // skip entry if not obtained or has outstanding pins
-            slot %= latchtotal;
+            slot = shard->first + slot % shard->cnt;
     
             if (!slot) continue;
     
             latch = latchsets + slot;
-            uint idx = latch->page_no % latchhash;
-    
-            // see we are on same chain as hashidx
-            if (idx == hashidx) continue;
-            if (!SpinLatch::spinwritetry( hashtable[idx].latch) ) continue;
-    
-            // skip this slot if it is pinned or the CLOCK bit is set
-            if (latch->pin) {
-                if (latch->pin & CLOCK_bit) {
-    
+
+            // take a frame emptied by a shrink, in use again after a grow
+            if (!latch->page_no) {
+                if (!claimlatch( latch )) continue;
+    #ifdef unix
+                __sync_fetch_and_add( &latchdeployed, 1 );
+    #else
+                _InterlockedIncrement( &latchdeployed );
+    #endif
+                if (latchlink( hashidx, slot, page_no, load_it, reads )) {
+                    SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                    return NULL;
+                }
+                SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                if (load_it) lockresident( latch );
+                pinlog( latch, 1 );
+                return latch;
+            }
+
+            uint idx = hashof( latch->page_no );
+    
+            // see we are on same chain as hashidx
+            if (idx == hashidx) continue;
+            if (!SpinLatch::spinwritetry( hashtable[idx].latch) ) continue;
+    
+            // skip an entry still being deployed by another thread
+            if (!latch->page_no || hashof( latch->page_no ) != idx) {
+                SpinLatch::spinreleasewrite( hashtable[idx].latch );
+                continue;
+            }
+    
+            // skip this slot if it is pinned or the CLOCK bit is set,
+            // else pin it against an empty frame claim
+    #ifdef unix
+            if (!__sync_bool_compare_and_swap( &latch->pin, 0, 1 )) {
+    #else
+            if (_InterlockedCompareExchange16( &latch->pin, 1, 0 )) {
+    #endif
+                if (latch->pin & CLOCK_bit) {
+    
+    #ifdef unix
+                    __sync_fetch_and_and( &latch->pin, ~CLOCK_bit );
+    #else
+                    _InterlockedAnd16( &latch->pin, ~CLOCK_bit );
+    #endif
+                }
+                SpinLatch::spinreleasewrite( hashtable[idx].latch );
+                continue;
+            }
+    
+            //  update permanent page area in btree from buffer pool
+            Page* page = mappage( latch );
+    
+            // keep resident levels, unless two sweeps found nothing else
+            if (residentlvl && page->lvl >= residentlvl && !page->free
+                    && scan < 2 * shard->cnt) {
+                latch->pin = 0;
+                SpinLatch::spinreleasewrite( hashtable[idx].latch );
+                continue;
+            }
+    
+            if (latch->locked) {
+    #ifdef unix
+                munlock( page, page_size );
+    #else
+                VirtualUnlock( page, page_size );
+    #endif
+                latch->locked = 0;
+            }
+    
+            if (latch->dirty) {
+                if (writepage( page, latch->page_no )) {
+                    latch->pin = 0;
+                    SpinLatch::spinreleasewrite( hashtable[idx].latch );
+                    SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                    return NULL;
+                }
+                else {
+                    latch->dirty = 0;
+                    (*writes)++;
+                }
+            }
+
+            // keep second copies while no one can pin the page
+            tierstash( page, latch->page_no );
+            cacheadmit( page, latch->page_no );
+
+    #ifdef unix
+            // drop a mapped page's private copy, the file has it
+            if (mapsegs) {
+                madvise( page, page_size, MADV_DONTNEED );
+            }
+    #endif
+    
+            //  unlink our available slot from its hash chain
+            if (latch->prev) {
+                latchsets[latch->prev].next = latch->next;
+            }
+            else {
+                hashtable[idx].slot = latch->next;
+            }
+    
+            if (latch->next) {
+                latchsets[latch->next].prev = latch->prev;
+            }
+    
+            // keep other victim scans off the entry until it is relinked
+            latch->pin = 1;
+            SpinLatch::spinreleasewrite( hashtable[idx].latch );
+            if (latchlink( hashidx, slot, page_no, load_it, reads )) {
+                SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+                return NULL;
+            }
+            SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
+            if (load_it) lockresident( latch );
+            pinlog( latch, 1 );
+            return latch;
+        }
+    }
+
+    /**
+    *  FUNCTION: claimlatch
+    *
+    *  pin an empty latch entry for deployment
+    *  @return 1 if claimed, 0 if another thread has it
+    */
+    uint BufMgr::claimlatch( LatchSet* latch ) {
+    #ifdef unix
+        if (!__sync_bool_compare_and_swap( &latch->pin, 0, 1 )) return 0;
+    #else
+        if (_InterlockedCompareExchange16( &latch->pin, 1, 0 )) return 0;
+    #endif
+
+        if (!latch->page_no) return 1;
+
+        // deployed since we looked
+    #ifdef unix
+        __sync_fetch_and_add( &latch->pin, -1 );
+    #else
+        _InterlockedDecrement16( &latch->pin );
+    #endif
+        return 0;
+    }
+
+    /**
+    *  FUNCTION: residency
+    *
+    *  keep pages at level lvl and above resident in the pool,
+    *  lvl 1 being all interior pages and zero turning it off.
+    *  With lockit set their frames are also mlocked.
+    */
+    void BufMgr::residency( uint lvl, uint lockit ) {
+        if (memory) return;
+
+        residentlvl = lvl;
+        residentlock = lvl ? lockit : 0;
+    }
+
+    /**
+    *  FUNCTION: lockresident
+    *
+    *  mlock the frame of a newly loaded resident page
+    */
+    void BufMgr::lockresident( LatchSet* latch ) {
+        Page* page = mappage( latch );
+
+        if (!residentlock || latch->locked || page->free || page->lvl < residentlvl) {
+            return;
+        }
+
+    #ifdef unix
+        if (!mlock( page, page_size )) {
+            latch->locked = 1;
+        }
+    #else
+        if (VirtualLock( page, page_size )) {
+            latch->locked = 1;
+        }
+    #endif
+    }
+
+    /**
+    *  FUNCTION: residentpages
+    *
+    *  @return number of pool pages kept resident by level
+    */
+    uint BufMgr::residentpages() {
+        uint num = 0;
+
+        for (uint slot = 1; residentlvl && slot < latchtotal; slot++) {
+            Page* page = mappage( latchsets + slot );
+
+            if (latchsets[slot].page_no && !page->free && page->lvl >= residentlvl) {
+                num++;
+            }
+        }
+
+        return num;
+    }
+
+    /**
+    *  FUNCTION: findlatch
+    *
+    *  find latchset of a page already in the buffer pool
+    *  @return with latchset pinned, or NULL if not resident
+    */
+    LatchSet* BufMgr::findlatch( uid page_no ) {
+        LatchSet* latch = NULL;
+        uint hashidx;
+
+        if (memory) {
+            return page_no < latchtotal && latchsets[page_no].page_no
+                        ? pinlatch( page_no, 0, NULL, NULL ) : NULL;
+        }
+
+        for (;;) {
+            hashidx = hashof( page_no );
+            SpinLatch::spinreadlock( hashtable[hashidx].latch );
+
+            if (hashidx == hashof( page_no )) break;
+            SpinLatch::spinreleaseread( hashtable[hashidx].latch );
+        }
+
+        uint slot = hashtable[hashidx].slot;
+        while (slot) {
+            latch = latchsets + slot;
+            if (page_no == latch->page_no) break;
+            slot = latch->next;
+        }
+
+        if (slot) {
     #ifdef unix
-                    __sync_fetch_and_and( &latch->pin, ~CLOCK_bit );
+            __sync_fetch_and_add( &latch->pin, 1 );
     #else
-                    _InterlockedAnd16( &latch->pin, ~CLOCK_bit );
+            _InterlockedIncrement16( &latch->pin );
     #endif
-                }
-                SpinLatch::spinreleasewrite( hashtable[idx].latch );
-                continue;
-            }
-    
-            //  update permanent page area in btree from buffer pool
-            Page* page = (Page*)( ((uid)slot << page_bits) + pagepool );
-    
-            if (latch->dirty) {
-                if (writepage( page, latch->page_no )) {
-                    return NULL;
-                }
-                else {
-                    latch->dirty = 0;
-                    *writes++;
-                }
-            }
-    
-            //  unlink our available slot from its hash chain
-            if (latch->prev) {
-                latchsets[latch->prev].next = latch->next;
-            }
-            else {
-                hashtable[idx].slot = latch->next;
-            }
-    
-            if (latch->next) {
-                latchsets[latch->next].prev = latch->prev;
-            }
-    
-            SpinLatch::spinreleasewrite( hashtable[idx].latch );
-            if (latchlink( hashidx, slot, page_no, load_it, reads )) return NULL;
-            SpinLatch::spinreleasewrite( hashtable[hashidx].latch );
-            return latch;
+            pinlog( latch, 1 );
+        }
+        else {
+            latch = NULL;
         }
+
+        SpinLatch::spinreleaseread( hashtable[hashidx].latch );
+        return latch;
     }
 
     /**
@@ -616,6 +4179,8 @@ namespace mongo {
     *  decrement pin count
     */
     void BufMgr::unpinlatch( LatchSet* latch) {
+        pinlog( latch, -1 );
+
     #ifdef unix
 	    if (~latch->pin & CLOCK_bit)
 	    	__sync_fetch_and_or( &latch->pin, CLOCK_bit );
@@ -630,17 +4195,38 @@ namespace mongo {
     /**
     *  FUNCTION: newpage
     *
-    *  allocate a new page
-    *  @return with page latched but unlocked
+    *  allocate a new page, from the thread's extent when
+    *  given one, refilled with the free extent nearest to
+    *  page near, else a new extent at the end of the file
+    *  @return with page latched but unlocked, or an error
+    *  with nothing pinned when the page can't be written
     */
     int BufMgr::newpage( PageSet* set, Page* contents,
-                            uint* reads, uint* writes ) {
+                            uint* reads, uint* writes,
+                            PageExtent* ext, uid near ) {
+        uid page_no;
+        uint cnt;
+
+        // the thread's extent needs no allocation latch
+        if (ext && ext->next < ext->end) {
+            page_no = ext->next++;
+            goto newframe;
+        }
+
+        // nor does an in-memory btree
+        if (memory) {
+            if ( !(page_no = memalloc( ext )) ) {
+                std::cerr << "In-memory btree is full at " << latchtotal << " pages" << std::endl;
+                return (err = BLTERR_ovflw);
+            }
+            goto newframe;
+        }
     
         // lock allocation page
         SpinLatch::spinwritelock( lock );
     
         // use empty chain first, else allocate empty page
-        uid page_no = BLTVal::getid( pagezero->chain );
+        page_no = BLTVal::getid( pagezero->chain );
         if (page_no) {
             if (set->latch = pinlatch( page_no, 1, reads, writes )) {
                 set->page = mappage( set->latch );
@@ -648,20 +4234,59 @@ namespace mongo {
             else {
                 return (err = BLTERR_struct);
             }
+
+            // a run of free pages: hand out its last page,
+            // the head stays on the chain
+            if (!set->page->min && set->page->cnt > 1) {
+                page_no += --set->page->cnt;
+
+                if (flushpage( set->latch )) {
+                    set->latch->dirty = 1;
+                }
+
+                unpinlatch( set->latch );
+                SpinLatch::spinreleasewrite( lock );
+                goto newframe;
+            }
     
             BLTVal::putid( pagezero->chain, BLTVal::getid(set->page->right) );
             SpinLatch::spinreleasewrite( lock );
             memcpy( set->page, contents, page_size );
-            set->latch->dirty = 1;
-            return (err = BLTERR_ok);
+            lockresident( set->latch );
+
+            // write new pages through, so no page on disk
+            // can link to a page that was never written
+            if (flushpage( set->latch )) {
+                unpinlatch( set->latch );
+                return err;
+            }
+
+            return BLTERR_ok;
+        }
+
+        cnt = ext ? EXT_pages : 1;
+
+        if ( (page_no = takeextent( near, &cnt )) ) {
+            if (ext) {
+                ext->next = page_no + 1;
+                ext->end = page_no + cnt;
+            }
+        }
+        else {
+            page_no = BLTVal::getid( pagezero->alloc->right );
+            cnt = ext ? EXT_pages : 1;
+            BLTVal::putid( pagezero->alloc->right, page_no + cnt );
+
+            if (ext) {
+                ext->next = page_no + 1;
+                ext->end = page_no + cnt;
+            }
         }
-    
-        page_no = BLTVal::getid( pagezero->alloc->right );
-        BLTVal::putid( pagezero->alloc->right, page_no+1 );
     
         // unlock allocation latch
         SpinLatch::spinreleasewrite( lock );
-    
+
+    newframe:
         // don't load cache from btree page
         if ( (set->latch = pinlatch( page_no, 0, reads, writes )) ) {
             set->page = mappage( set->latch );
@@ -671,8 +4296,377 @@ namespace mongo {
         }
     
         memcpy( set->page, contents, page_size );
-        set->latch->dirty = 1;
-        return (err = BLTERR_ok);
+        lockresident( set->latch );
+
+        if (flushpage( set->latch )) {
+            unpinlatch( set->latch );
+            return err;
+        }
+
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: memalloc
+    *
+    *  BUF_memory: pop a freed page, else take a page, or an
+    *  extent of them for ext, never used before. The free
+    *  stack head carries a tag against reuse of its top.
+    *  The last pages of the pool go out one at a time.
+    *  @return page number, or zero when the pool is full
+    */
+    uid BufMgr::memalloc( PageExtent* ext ) {
+        uid page_no;
+        uid head;
+
+    #ifdef unix
+        while ( (page_no = (uint)(head = memfree)) ) {
+            Page* page = (Page*)(pagepool + (page_no << page_bits));
+            uid next = BLTVal::getid( page->right );
+
+            if (__sync_bool_compare_and_swap( &memfree, head, (((head >> 32) + 1) << 32) | next )) {
+                return page_no;
+            }
+        }
+
+        uint cnt = ext ? EXT_pages : 1;
+
+        // reserve pages only once they fit the pool, an
+        // extent that doesn't fit falls back to one page
+        do {
+            page_no = memnext;
+
+            if (page_no + cnt > latchtotal) {
+                cnt = 1;
+            }
+
+            if (page_no + cnt > latchtotal) {
+                return 0;
+            }
+        } while (!__sync_bool_compare_and_swap( &memnext, page_no, page_no + cnt ));
+
+        if (ext) {
+            ext->next = page_no + 1;
+            ext->end = page_no + cnt;
+        }
+    #endif
+        return page_no;
+    }
+
+    /**
+    *  FUNCTION: mempush
+    *
+    *  BUF_memory: push a free page on the free stack
+    */
+    void BufMgr::mempush( uid page_no ) {
+        Page* page = (Page*)(pagepool + (page_no << page_bits));
+        uid head;
+
+    #ifdef unix
+        do {
+            head = memfree;
+            BLTVal::putid( page->right, (uint)head );
+        } while (!__sync_bool_compare_and_swap( &memfree, head, (((head >> 32) + 1) << 32) | page_no ));
+    #endif
+    }
+
+    /**
+    *  FUNCTION: takeextent
+    *
+    *  take up to *cnt pages from the free extent nearest to
+    *  page near holding at least least pages, or starting at
+    *  near, the allocation latch must be held
+    *  @return first page number with *cnt set, or zero
+    */
+    uid BufMgr::takeextent( uid near, uint* cnt, uint least ) {
+        uint best = EXT_map;
+        uid dist = ~(uid)0;
+
+        for (uint idx = 0; idx < pagezero->extcnt; idx++) {
+            uid start = pagezero->extmap[idx] >> 8;
+            uid gap = start > near ? start - near : near - start;
+
+            if (gap && (pagezero->extmap[idx] & 0xff) < least) {
+                continue;
+            }
+
+            if (gap < dist) {
+                dist = gap;
+                best = idx;
+            }
+        }
+
+        if (best == EXT_map) {
+            return 0;
+        }
+
+        uid entry = pagezero->extmap[best];
+        uid page_no = entry >> 8;
+        uint avail = entry & 0xff;
+
+        if (*cnt < avail) {
+            pagezero->extmap[best] = (page_no + *cnt) << 8 | (avail - *cnt);
+        }
+        else {
+            pagezero->extmap[best] = pagezero->extmap[--pagezero->extcnt];
+            *cnt = avail;
+        }
+
+        return page_no;
+    }
+
+    /**
+    *  FUNCTION: growextent
+    *
+    *  refill an exhausted extent with a run of contiguous
+    *  pages, from the free extent nearest page near holding
+    *  at least least pages, else from the end of the file
+    */
+    void BufMgr::growextent( PageExtent* ext, uid near, uint least ) {
+        uint cnt = EXT_pages;
+        uid page_no;
+
+        SpinLatch::spinwritelock( lock );
+
+        if ( !(page_no = takeextent( near, &cnt, least )) ) {
+            page_no = BLTVal::getid( pagezero->alloc->right );
+            BLTVal::putid( pagezero->alloc->right, page_no + cnt );
+        }
+
+        ext->next = page_no;
+        ext->end = page_no + cnt;
+
+        SpinLatch::spinreleasewrite( lock );
+    }
+
+    /**
+    *  FUNCTION: freeextent
+    *
+    *  return the unused pages of a thread's extent to the
+    *  free extent map, or to the free chain when the map
+    *  is full
+    */
+    void BufMgr::freeextent( PageExtent* ext ) {
+        if (ext->next >= ext->end) {
+            return;
+        }
+
+        if (memory) {
+            while (ext->next < ext->end) {
+                Page* page = (Page*)(pagepool + (ext->next << page_bits));
+
+                page->bits = page_bits;
+                page->free = 1;
+                mempush( ext->next++ );
+            }
+            return;
+        }
+
+        SpinLatch::spinwritelock( lock );
+
+        if (pagezero->extcnt < EXT_map) {
+            pagezero->extmap[pagezero->extcnt++] = ext->next << 8 | (ext->end - ext->next);
+            ext->next = ext->end;
+        }
+
+        // chain the pages, writing each before page zero links to it
+        if (ext->next < ext->end) {
+    #ifdef unix
+            Page* frame = (Page*)valloc( page_size );
+    #else
+            Page* frame = (Page*)VirtualAlloc( NULL, page_size, MEM_COMMIT, PAGE_READWRITE );
+    #endif
+
+            while (ext->next < ext->end) {
+                memset( frame, 0, page_size );
+                frame->bits = page_bits;
+                frame->free = 1;
+                memcpy( frame->right, pagezero->chain, BtId );
+
+                if (writepage( frame, ext->next )) {
+                    break;
+                }
+
+                BLTVal::putid( pagezero->chain, ext->next++ );
+            }
+
+    #ifdef unix
+            free( frame );
+    #else
+            VirtualFree( frame, 0, MEM_RELEASE );
+    #endif
+        }
+
+        SpinLatch::spinreleasewrite( lock );
+    }
+    
+    /**
+    *  FUNCTION: punchfree
+    *
+    *  release free pages to the file system. The free chain
+    *  and free extents are detached, their holes punched,
+    *  free pages at the end of the file are truncated off,
+    *  and the rest relinked as extents and runs, lowest
+    *  first. extra are freed pages that are on no chain.
+    *  @return number of pages truncated off the file
+    */
+    uid BufMgr::punchfree( uid* extra, uint cnt ) {
+        std::vector< std::pair< uid, uid > > runs;      // (first page_no, pages)
+        uint reads = 0, writes = 0;
+        LatchSet* latch;
+        uid trimmed = 0;
+        uint out = 0;
+
+        // an in-memory btree has no file to release pages to
+        if (memory) return 0;
+
+        // detach the free space, it cannot be allocated meanwhile
+        SpinLatch::spinwritelock( lock );
+
+        uid page_no = BLTVal::getid( pagezero->chain );
+        BLTVal::putid( pagezero->chain, 0 );
+
+        for (uint idx = 0; idx < pagezero->extcnt; idx++) {
+            runs.push_back( std::make_pair( pagezero->extmap[idx] >> 8,
+                                            pagezero->extmap[idx] & 0xff ) );
+        }
+
+        pagezero->extcnt = 0;
+        SpinLatch::spinreleasewrite( lock );
+
+        for (uint idx = 0; idx < cnt; idx++) {
+            runs.push_back( std::make_pair( extra[idx], (uid)1 ) );
+        }
+
+        // older files chain single pages, with min set
+        while (page_no) {
+            if ( !(latch = pinlatch( page_no, 1, &reads, &writes )) ) {
+                std::cerr << "Unable to read free page " << page_no
+                            << ", rest of free chain dropped" << std::endl;
+                break;
+            }
+
+            Page* page = mappage( latch );
+
+            runs.push_back( std::make_pair( page_no,
+                                (uid)(!page->min && page->cnt ? page->cnt : 1) ) );
+            page_no = BLTVal::getid( page->right );
+            unpinlatch( latch );
+        }
+
+        if (runs.empty()) {
+            return 0;
+        }
+
+        // coalesce neighbouring runs
+        std::sort( runs.begin(), runs.end() );
+
+        for (uint idx = 1; idx < runs.size(); idx++) {
+            if (runs[idx].first <= runs[out].first + runs[out].second) {
+                runs[out].second = std::max( runs[out].second,
+                                        runs[idx].first + runs[idx].second - runs[out].first );
+            }
+            else {
+                runs[++out] = runs[idx];
+            }
+        }
+
+        runs.resize( out + 1 );
+
+        // nothing reads a detached free page, so punch them all,
+        // run heads are rewritten below
+    #ifdef unix
+        for (uint idx = 0; idx < runs.size(); idx++) {
+            for (uid page_no = runs[idx].first, run; page_no < runs[idx].first + runs[idx].second; page_no += run) {
+                off64_t off;
+                uint file = pagefile( page_no, &off );
+
+                run = striperun( page_no, runs[idx].first + runs[idx].second - page_no );
+                fallocate( files[file], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            off, run << page_bits );
+            }
+        }
+    #endif
+
+        SpinLatch::spinwritelock( lock );
+
+        // truncate a run at the end of the file
+        uid right = BLTVal::getid( pagezero->alloc->right );
+
+        if (runs.back().first + runs.back().second == right) {
+            trimmed = runs.back().second;
+            right = runs.back().first;
+            BLTVal::putid( pagezero->alloc->right, right );
+            runs.pop_back();
+        }
+
+        // the free extent map takes what it can hold, lowest first
+        for (out = 0; out < runs.size() && pagezero->extcnt < EXT_map; ) {
+            uid take = std::min( runs[out].second, (uid)0xff );
+
+            pagezero->extmap[pagezero->extcnt++] = runs[out].first << 8 | take;
+            runs[out].first += take;
+
+            if ( !(runs[out].second -= take) ) {
+                out++;
+            }
+        }
+
+        // chain the remaining runs by their head pages, lowest first
+        page_no = BLTVal::getid( pagezero->chain );
+
+        for (uint idx = runs.size(); idx-- > out; ) {
+            if ( !(latch = pinlatch( runs[idx].first, 0, &reads, &writes )) ) {
+                break;
+            }
+
+            Page* page = mappage( latch );
+
+            memset( page, 0, page_size );
+            page->bits = page_bits;
+            page->free = 1;
+            page->cnt = runs[idx].second;
+            BLTVal::putid( page->right, page_no );
+
+            if (flushpage( latch )) {
+                unpinlatch( latch );
+                break;
+            }
+
+            unpinlatch( latch );
+            page_no = runs[idx].first;
+        }
+
+        BLTVal::putid( pagezero->chain, page_no );
+
+        // page zero must stop linking to the tail before it goes
+        if (trimmed) {
+    #ifdef unix
+            msync( pagezero, page_size, MS_SYNC );
+
+            for (uint file = 0; file < nfiles; file++) {
+                ftruncate( files[file], stripesize( file, right ) );
+            }
+
+            // pages past the new end are mapped again only after
+            // the file grows back over them
+            SpinLatch::spinwritelock( maplatch );
+            mappages = std::min( (uid)mappages, right );
+            SpinLatch::spinreleasewrite( maplatch );
+    #else
+            FlushViewOfFile( pagezero, 0 );
+
+            for (uint file = 0; file < nfiles; file++) {
+                off64_t size = stripesize( file, right );
+                long hi = size >> 32;
+                SetFilePointer( files[file], (long)size, &hi, FILE_BEGIN );
+                SetEndOfFile( files[file] );
+            }
+    #endif
+        }
+
+        SpinLatch::spinreleasewrite( lock );
+        return trimmed;
     }
     
     /**
@@ -691,19 +4685,29 @@ namespace mongo {
 
         uint mode;
         uint prevmode;
+
+        // a read-only btree is only ever read, unlatched
+        if (readonly && lock != LockNone) {
+            err = BLTERR_wrt;
+            return 0;
+        }
     
         // start at root of btree and drill down
         do {
     
             // determine lock mode of drill level
-            mode = (drill == lvl) ? lock : LockRead; 
+            mode = (drill == lvl) ? lock : readmode; 
         
             if ( !(set->latch = pinlatch( page_no, 1, reads, writes )) ) {
+              if (prevpage) {
+                unlockpage( (BLTLockMode)prevmode, prevlatch );
+                unpinlatch( prevlatch );
+              }
               return 0;
             }
         
              // obtain access lock using lock chaining with Access mode
-            if (page_no > ROOT_page) {
+            if (page_no > ROOT_page && !readonly) {
                 lockpage( LockAccess, set->latch );
             }
         
@@ -737,7 +4741,7 @@ namespace mongo {
                 return 0;
             }
         
-            if (page_no > ROOT_page) {
+            if (page_no > ROOT_page && !readonly) {
                 unlockpage( LockAccess, set->latch );
             }
         
@@ -750,7 +4754,7 @@ namespace mongo {
                     
                 drill = set->page->lvl;
         
-                if (lock != LockRead && drill == lvl) {
+                if (lock != readmode && drill == lvl) {
                     unlockpage( (BLTLockMode)mode, set->latch );
                     unpinlatch( set->latch );
                     continue;
@@ -803,15 +4807,34 @@ namespace mongo {
     *  page must be delete and write locked
     */
     void BufMgr::freepage( PageSet* set ) {
+
+        // an in-memory page goes on the free stack unlatched
+        if (memory) {
+            set->page->free = 1;
+            set->page->min = 0;
+            set->page->cnt = 1;
+            mempush( set->latch->page_no );
+            unlockpage( LockDelete, set->latch );
+            unlockpage( LockWrite, set->latch );
+            unpinlatch( set->latch );
+            return;
+        }
     
         // lock allocation page
         SpinLatch::spinwritelock( lock );
     
-        // store chain
+        // store chain, and write the freed page
+        // before page zero can link to it, as a run of one
         memcpy( set->page->right, pagezero->chain, BtId );
-        BLTVal::putid( pagezero->chain, set->latch->page_no );
-        set->latch->dirty = 1;
         set->page->free = 1;
+        set->page->min = 0;
+        set->page->cnt = 1;
+
+        if (flushpage( set->latch )) {
+            set->latch->dirty = 1;
+        }
+
+        BLTVal::putid( pagezero->chain, set->latch->page_no );
     
         // unlock released page
         unlockpage( LockDelete, set->latch );
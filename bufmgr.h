@@ -55,11 +55,15 @@
 #include "mongo/db/storage/bltree/common.h"
 #include "mongo/db/storage/bltree/page.h"
 #include "mongo/db/storage/bltree/latchmgr.h"
+#include "mongo/db/storage/bltree/redolog.h"
+#include "mongo/db/storage/bltree/valuelog.h"
 #else
 #include "blterr.h"
 #include "common.h"
 #include "page.h"
 #include "latchmgr.h"
+#include "redolog.h"
+#include "valuelog.h"
 #endif
 
 namespace mongo {
@@ -77,14 +81,192 @@ namespace mongo {
     };
     
     #define CLOCK_bit 0x8000        // bit in pool->pin
+
+    /**
+    *  BufMgr::create flags
+    */
+    #define BUF_hugepages   0x1     // back the buffer pool with huge pages
+    #define BUF_numa        0x2     // one pool shard per NUMA node
+    #define BUF_nocrc       0x4     // skip page checksum checks on read
+    #define BUF_compress    0x8     // store pages compressed on disk
+    #define BUF_mmap        0x10    // serve pages from a mapping of the file
+    #define BUF_readonly    0x20    // open read-only, pages are read unlatched
+    #define BUF_shared      0x40    // share the buffer pool with other processes
+    #define BUF_memory      0x80    // no file, pages live only in the pool
+    #define BUF_vlog        0x100   // keep values longer than VLOG_min in a value log
+
+    #define VLOG_min    128         // longest value kept in the btree under BUF_vlog
+    #define VLOG_chunk  (16 << 20)  // value log bytes collected per pass
+
+    /**
+    *  BufMgr::durability modes
+    */
+    #define DURABLE_none        0   // the kernel writes back when it likes
+    #define DURABLE_periodic    1   // sync every few seconds, and at close
+    #define DURABLE_commit      2   // sync at every commit, and at close
+
+    #define HUGE_size   (2 * 1024 * 1024)   // huge page size, and pool alignment
+
+    /**
+    *  buffer pool shard: a range of latch slots with its
+    *  own deploy count and victim clock, on one NUMA node
+    */
+    struct PoolShard {
+        uint first;                 // first latch slot of the shard
+        volatile uint cnt;          // number of latch slots in use
+        uint cap;                   // latch slots reserved for the shard
+        volatile uint deployed;     // latch slots deployed so far
+        volatile uint victim;       // next shard slot to examine
+        uint node;                  // NUMA node of the shard's memory
+        uid hits;                   // pins found in the pool, statistics only
+        uid misses;                 // pins that loaded their page
+        uchar filler[24];           // one cache line per shard
+    };
+
+    #define NUMA_max    64          // most NUMA nodes
+    #define SHM_procs   16          // most processes sharing a buffer pool
+    #define SHM_magic   0x4c4f4f50
+    #define SHM_wait    500         // 10ms waits for a pool being set up
+    #define CPU_max     1024        // most cpus
+
+    #define RESIZE_batch 256        // hash buckets split per resize pass
+
+    #ifndef MPOL_BIND
+    #define MPOL_BIND   2
+    #endif
+
+    /**
+    *  hot page set file header, followed by page numbers
+    *  ordered by level then heat
+    */
+    struct WarmHdr {
+        uint magic;                 // WARM_magic
+        uint page_bits;             // page size of the btree
+        uint cnt;                   // number of page numbers
+    };
+
+    #define WARM_magic  0x424c5457
+    #define WARM_run    64          // most pages in one warm-up read
+    #define FLUSH_bytes (1024 * 1024)   // most bytes in one write-back write
     
+    /**
+    *  a queued read-ahead: cnt pages along the right
+    *  links starting at page_no
+    */
+    struct ReadAhead {
+        uid page_no;                // first page to prefetch
+        uint cnt;                   // number of pages to prefetch
+    };
+
+    #define RA_min      4           // first read-ahead window of a scan
+    #define RA_max      64          // largest read-ahead window
+    #define RA_queue    64          // most queued read-aheads
+
+    /**
+    *  leads a compressed page image on disk, the rest
+    *  of the page's slot in the file is punched out
+    */
+    struct PackHdr {
+        uint magic;                 // PACK_magic, never a key count
+        uint len;                   // compressed bytes after the header
+    };
+
+    #define PACK_magic  0x4b434150
+    #define PACK_block  4096        // file system block, the unit packed pages take
+
+    /**
+    *  compressed tier index entry, direct mapped by page
+    *  number; the image is live while the ring head is
+    *  less than a ring length past its position
+    */
+    struct TierSlot {
+        uid page_no;                // page of the image, or zero
+        uid pos;                    // ring position of the image
+        uint len;                   // compressed image bytes
+        uint filler;
+    };
+
+    #define TIER_slots  4           // index slots per page the ring holds raw
+
+    /**
+    *  a page frame of the secondary cache file
+    */
+    struct CacheWay {
+        uid page_no;                // page in the frame, or zero
+        uint ref;                   // CLOCK reference bit
+        uint filler;
+    };
+
+    /**
+    *  a set of CACHE_ways frames a page number maps to,
+    *  replaced by their own CLOCK
+    */
+    struct CacheSet {
+        SpinLatch latch[1];         // the set's frames and hand
+        uint hand;                  // next way to examine
+    };
+
+    #define CACHE_ways  8           // frames per cache file set
+
+    /**
+    *  a thread's reserved run of new pages
+    */
+    struct PageExtent {
+        uid next;                   // next page number to hand out
+        uid end;                    // first page number past the extent
+    };
+
+    #define EXT_pages   64          // pages reserved by a thread at a time
+    #define EXT_map     256         // most free extents in page zero
+
+    #define STRIPE_max  16          // most files a btree is striped across
+
+    #define MMAP_segbits 26         // bytes of a file mapping segment, in bits
+    #define MMAP_segs   65536       // most file mapping segments
+
+    /**
+    *  head of a buffer pool shared by processes, followed
+    *  by each process's pin counts, then the hash table,
+    *  latch sets and page frames. The pool's size is fixed
+    *  by the process that sets it up, and only that process
+    *  changes the btree, the others read it.
+    */
+    struct ShmHdr {
+        volatile uint magic;        // SHM_magic once the pool is set up
+        volatile uint dead;         // pool abandoned, open a new one
+        uint page_bits;             // page size of the btree
+        uint nlatchpage;            // pages of hash table, latch sets and frames
+        uint latchtotal;            // page latch entries
+        uint latchactive;           // page latch entries in use
+        uint latchhash;             // hash table slots
+        uint hashtarget;            // hash table slots in use
+        uid hashlevel;              // hash slots per round << 32
+        uint nshards;               // number of shards
+        SpinLatch attach[1];        // the process table
+        SpinLatch alloc[1];         // page zero allocation, for every process
+        volatile uint pids[SHM_procs];  // attached processes, zero when free
+        PoolShard shards[NUMA_max]; // latch slot shards
+    };
+
+    #define FMT_version 1           // page zero and page header layout of the file
+
     /**
     *  structure for latch manager on ALLOC_page
     */
     struct PageZero {
         Page alloc[1];              // next page_no in right ptr
         unsigned long long dups[1]; // global duplicate key uniqueifier
-        unsigned char chain[BtId];  // head of free page_nos chain
+        unsigned char chain[BtId];  // head of free page runs chain
+        unsigned long long epoch[1];// current incremental backup epoch
+        unsigned long long redolsn[1];  // redo log lsn where recovery starts
+        unsigned long long ckpttime[1]; // time of the last completed checkpoint
+        unsigned char clean;        // file was closed cleanly
+        unsigned int extcnt;        // number of free extents
+        unsigned long long extmap[EXT_map]; // free extents, page_no << 8 | page count
+        unsigned int stripes;       // files the btree is striped across, zero for one
+        unsigned int stripepages;   // pages of a stripe unit, given to each file in turn
+        unsigned long long vloghead[1]; // value log offset of the oldest live value
+        unsigned int version;       // FMT_version the file was created with
     };
     
     /**
@@ -95,9 +277,20 @@ namespace mongo {
         /**
         *  FUNCTION: create
         *
-        *  factory method
+        *  factory method, flags are BUF_ options, poolmax
+        *  is the largest size resize may grow the pool to
         */
-        static BufMgr* create( const char* name, uint bits, uint nodemax );
+        static BufMgr* create( const char* name, uint bits, uint nodemax,
+                                uint flags = 0, uint poolmax = 0 );
+
+        /**
+        *  FUNCTION: create
+        *
+        *  as above, striping a new btree across the cnt
+        *  files names, or opening one striped that way
+        */
+        static BufMgr* create( const char** names, uint cnt, uint bits, uint nodemax,
+                                uint flags = 0, uint poolmax = 0 );
 
         /**
         *  FUNCTION: poolaudit
@@ -117,6 +310,16 @@ namespace mongo {
         BLTERR latchlink( uint hashidx, uint slot, uid page_no, uint load_it,
                             uint* reads );
 
+        /**
+        *  FUNCTION: mapfile
+        */
+        Page* mapfile( uid page_no );
+
+        /**
+        *  FUNCTION: mapextend
+        */
+        BLTERR mapextend( uid page_no );
+
         /**
         *  FUNCTION: pinlatch
         */
@@ -143,13 +346,59 @@ namespace mongo {
         *  FUNCTION: newpage
         */
         int newpage( PageSet* set, Page* contents,
-                            uint* reads, uint* writes );
+                            uint* reads, uint* writes,
+                            PageExtent* ext = NULL, uid near = 0 );
+
+        /**
+        *  FUNCTION: memalloc
+        */
+        uid memalloc( PageExtent* ext );
+
+        /**
+        *  FUNCTION: mempush
+        */
+        void mempush( uid page_no );
+
+        /**
+        *  FUNCTION: takeextent
+        */
+        uid takeextent( uid near, uint* cnt, uint least = 1 );
+
+        /**
+        *  FUNCTION: growextent
+        */
+        void growextent( PageExtent* ext, uid near, uint least = 1 );
+
+        /**
+        *  FUNCTION: freeextent
+        */
+        void freeextent( PageExtent* ext );
+
+        /**
+        *  FUNCTION: punchfree
+        */
+        uid punchfree( uid* extra, uint cnt );
 
         /**
         *  FUNCTION: freepage
         */
         void  freepage( PageSet* set );
 
+        /**
+        *  FUNCTION: pagefile
+        */
+        uint pagefile( uid page_no, off64_t* off );
+
+        /**
+        *  FUNCTION: striperun
+        */
+        uint striperun( uid page_no, uint cnt );
+
+        /**
+        *  FUNCTION: stripesize
+        */
+        off64_t stripesize( uint file, uid pages );
+
         /**
         *  FUNCTION: readpage
         */
@@ -160,6 +409,266 @@ namespace mongo {
         */
         BLTERR writepage( Page* page, uid page_no );
 
+        /**
+        *  FUNCTION: packpage
+        */
+        uint packpage( Page* page, uchar* buff );
+
+        /**
+        *  FUNCTION: writepacked
+        */
+        BLTERR writepacked( Page* page, uid page_no );
+
+        /**
+        *  FUNCTION: unpackpage
+        */
+        BLTERR unpackpage( Page* page, uint have, uid page_no );
+
+        /**
+        *  FUNCTION: flushpage
+        */
+        BLTERR flushpage( LatchSet* latch );
+
+        /**
+        *  FUNCTION: flushpages
+        */
+        BLTERR flushpages();
+
+        /**
+        *  FUNCTION: writepages
+        */
+        BLTERR writepages( Page* pages, uid page_no, uint cnt );
+
+        /**
+        *  FUNCTION: writeback
+        */
+        BLTERR writeback( uint* written, uint sync );
+
+        /**
+        *  FUNCTION: flushwriter
+        */
+        static void* flushwriter( void* arg );
+
+        /**
+        *  FUNCTION: flushers
+        */
+        void flushers( uint threads );
+
+        /**
+        *  FUNCTION: dirtypages
+        */
+        uint dirtypages();
+
+        /**
+        *  FUNCTION: checkpoint
+        */
+        BLTERR checkpoint();
+
+        /**
+        *  FUNCTION: checkpointer
+        */
+        BLTERR checkpointer( uint secs, uid bytes );
+
+        /**
+        *  FUNCTION: ckptthread
+        */
+        static void* ckptthread( void* arg );
+
+        /**
+        *  FUNCTION: durability
+        */
+        BLTERR durability( uint mode, uint secs );
+
+        /**
+        *  FUNCTION: commit
+        */
+        BLTERR commit();
+
+        /**
+        *  FUNCTION: sync
+        */
+        BLTERR sync( uint wait );
+
+        /**
+        *  FUNCTION: syncthread
+        */
+        static void* syncthread( void* arg );
+
+        /**
+        *  FUNCTION: shardpool
+        */
+        BLTERR shardpool( uint flags );
+
+        /**
+        *  FUNCTION: sharepool
+        */
+        void sharepool( uint nodemax );
+
+        /**
+        *  FUNCTION: attachpool
+        */
+        BLTERR attachpool();
+
+        /**
+        *  FUNCTION: detachpool
+        */
+        uint detachpool();
+
+        /**
+        *  FUNCTION: reappool
+        */
+        uint reappool();
+
+        /**
+        *  FUNCTION: pinlog
+        */
+        void pinlog( LatchSet* latch, int delta );
+
+        /**
+        *  FUNCTION: resize
+        */
+        BLTERR resize( uint nodemax );
+
+        /**
+        *  FUNCTION: resizethread
+        */
+        static void* resizethread( void* arg );
+
+        /**
+        *  FUNCTION: prefetch
+        */
+        void prefetch( uid page_no, uint cnt );
+
+        /**
+        *  FUNCTION: prefetchthread
+        */
+        static void* prefetchthread( void* arg );
+
+        /**
+        *  FUNCTION: hashof
+        */
+        uint hashof( uid page_no );
+
+        /**
+        *  FUNCTION: splitbucket
+        */
+        uint splitbucket();
+
+        /**
+        *  FUNCTION: evictretired
+        */
+        uint evictretired();
+
+        /**
+        *  FUNCTION: shardof
+        */
+        uint shardof();
+
+        /**
+        *  FUNCTION: bindthread
+        */
+        BLTERR bindthread( uint idx );
+
+        /**
+        *  FUNCTION: claimlatch
+        */
+        uint claimlatch( LatchSet* latch );
+
+        /**
+        *  FUNCTION: residency
+        */
+        void residency( uint lvl, uint lockit );
+
+        /**
+        *  FUNCTION: tier
+        */
+        BLTERR tier( uid bytes );
+
+        /**
+        *  FUNCTION: tierstash
+        */
+        void tierstash( Page* page, uid page_no );
+
+        /**
+        *  FUNCTION: tierfetch
+        */
+        uint tierfetch( Page* page, uid page_no );
+
+        /**
+        *  FUNCTION: tierdrop
+        */
+        void tierdrop( uid page_no );
+
+        /**
+        *  FUNCTION: cachefile
+        */
+        BLTERR cachefile( const char* path, uid bytes );
+
+        /**
+        *  FUNCTION: cacheadmit
+        */
+        void cacheadmit( Page* page, uid page_no );
+
+        /**
+        *  FUNCTION: cachefetch
+        */
+        uint cachefetch( Page* page, uid page_no );
+
+        /**
+        *  FUNCTION: cachedrop
+        */
+        void cachedrop( uid page_no );
+
+        /**
+        *  FUNCTION: hitratios
+        */
+        void hitratios();
+
+        /**
+        *  FUNCTION: lockresident
+        */
+        void lockresident( LatchSet* latch );
+
+        /**
+        *  FUNCTION: residentpages
+        */
+        uint residentpages();
+
+        /**
+        *  FUNCTION: savewarm
+        */
+        uint savewarm();
+
+        /**
+        *  FUNCTION: warmup
+        */
+        uint warmup( uint threads, uint background );
+
+        /**
+        *  FUNCTION: warmthread
+        */
+        static void* warmthread( void* arg );
+
+        /**
+        *  FUNCTION: warmreader
+        */
+        static void* warmreader( void* arg );
+
+        /**
+        *  FUNCTION: findlatch
+        */
+        LatchSet* findlatch( uid page_no );
+
+        /**
+        *  FUNCTION: backup
+        */
+        uid backup( const char* path, uid since );
+
+        /**
+        *  FUNCTION: restore
+        */
+        static BLTERR restore( const char* name, const char* path );
+
         /**
         *  FUNCTION: lockpage
         */
@@ -175,21 +684,116 @@ namespace mongo {
         uint page_bits;             // page size in bits    
 
     #ifdef unix
-        int idx;
+        int idx;                    // the first file, holding page zero
+        int files[STRIPE_max];      // the files the btree is striped across
+        int cacheidx;               // secondary cache file
     #else
         HANDLE idx;
+        HANDLE files[STRIPE_max];
+        HANDLE cacheidx;
     #endif
+        uint nfiles;                // number of files
+        uint stripepages;           // pages of a stripe unit
+        uchar* volatile* mapsegs;   // BUF_mmap file mapping segments, or NULL
+        volatile uid mappages;      // pages the file is known to cover
+        SpinLatch maplatch[1];      // file growth for the mapping
 
         PageZero *pagezero;         // mapped allocation page
-        SpinLatch lock[1];          // allocation area lite latch
-        uint latchdeployed;         // highest number of latch entries deployed
+        SpinLatch* lock;            // allocation area lite latch
+        SpinLatch alloclock[1];     // the latch, unless the pool is shared
+        uint latchdeployed;         // number of latch entries deployed
         uint nlatchpage;            // number of latch pages at BT_latch
-        uint latchtotal;            // number of page latch entries
-        uint latchhash;             // number of latch hash table slots
-        uint latchvictim;           // next latch entry to examine
+        uint latchtotal;            // number of page latch entries reserved
+        uint latchactive;           // number of page latch entries in use
+        uint latchhash;             // number of latch hash table slots reserved
+        volatile uid hashlevel;     // hash slots per round << 32 | next slot to split
+        volatile uint hashtarget;   // hash slots wanted for the pool size
+        PoolShard* shards;          // latch slot shards, one per NUMA node
+        uint nshards;               // number of shards
+        uchar cpunode[CPU_max];     // shard of each cpu's node
         HashEntry* hashtable;       // the buffer pool hash table entries
         LatchSet* latchsets;        // mapped latch set from buffer pool
         uchar* pagepool;            // mapped to the buffer pool pages
+        uchar* mapbase;             // buffer pool mapping, as returned by mmap
+        uid mapsize;                // buffer pool mapping size
+        uint hugepages;             // 2 => hugetlb/large pages, 1 => THP advised
+        ShmHdr* shmhdr;             // BUF_shared pool head, or NULL
+        char* shmname;              // BUF_shared pool name
+        uint shmproc;               // our process slot in the shared pool
+        uint shmowner;              // we set up the shared pool
+        ushort* pintable;           // our pin counts by latch slot, or NULL
+        RedoLog* redo;              // leaf key redo log, or NULL
+        uint unclean;               // open found an unclean shutdown
+        SpinLatch ckptlatch[1];     // one checkpoint at a time
+        SpinLatch flushlatch[1];    // one write-back at a time
+        uint ckptsecs;              // checkpoint interval in seconds, or zero
+        uid ckptbytes;              // checkpoint at this many dirty bytes, or zero
+        volatile uint ckptstop;     // tell the checkpoint thread to exit
+        uint durable;               // DURABLE_ mode
+        uint syncsecs;              // DURABLE_periodic sync interval
+        volatile uint syncstop;     // tell the sync thread to exit
+        volatile uid synclsn;       // redo log is synced up to here
+        ValueLog* vlog;             // value log of long values, or NULL
+        uint vlogmin;               // longer values go to the value log, zero if none do
+        volatile uid vloggarbage;   // bytes of replaced and deleted logged values
+        volatile uid vlogpending;   // value log head once the next checkpoint is done
+        BLT_RWLock vloglatch[1];    // held shared from a value's append until it is linked
+        SpinLatch gclatch[1];       // one value log collection at a time
+        uint gcsecs;                // value log collection interval in seconds
+        uint gcpct;                 // collect past this percentage of garbage
+        volatile uint gcstop;       // tell the value log collector to exit
+        volatile uint resizing;     // resize work pending for the resize thread
+        volatile uint resizestop;   // tell the resize thread to exit
+        ReadAhead raqueue[RA_queue];// read-aheads waiting for the prefetch thread
+        uint rahead;                // next read-ahead queue entry to fill
+        uint ratail;                // next read-ahead queue entry to take
+        volatile uint rastop;       // tell the prefetch thread to exit
+
+    #ifdef unix
+        pthread_t ckpttid;          // background checkpoint thread
+        pthread_t synctid;          // background periodic sync thread
+        pthread_t warmtid;          // background warm-up thread
+        pthread_t resizetid;        // background rehash and eviction thread
+        pthread_t ratid;            // background read-ahead thread
+        pthread_t gctid;            // background value log collector
+        pthread_mutex_t ramutex[1]; // read-ahead queue mutex
+        pthread_cond_t racond[1];   // signals a queued read-ahead
+    #else
+        HANDLE ckpttid;
+        HANDLE synctid;
+        HANDLE warmtid;
+        HANDLE resizetid;
+        HANDLE ratid;
+        HANDLE gctid;
+        CRITICAL_SECTION ramutex[1];
+        CONDITION_VARIABLE racond[1];
+    #endif
+
+        char* warmname;             // hot page set file name
+        uint residentlvl;           // pages at this level and up stay resident
+        uint residentlock;          // resident pages are also mlocked
+        uint warmthreads;           // background warm-up reader threads
+        uint nflushers;             // threads writing dirty pages back
+        uint verifycrc;             // check page checksums on read
+        uint compress;              // write pages compressed
+        uint readonly;              // opened with BUF_readonly
+        BLTLockMode readmode;       // LockRead, or LockNone when read-only
+        uint memory;                // BUF_memory, latch slot is page number
+        volatile uid memnext;       // BUF_memory next page never used
+        volatile uid memfree;       // BUF_memory freed pages, tag << 32 | page_no
+        uchar* tierring;            // compressed tier of evicted clean pages
+        uid tierbytes;              // compressed tier ring size, or zero
+        uid tierhead;               // ring position of the next image
+        TierSlot* tierslots;        // compressed tier index
+        uint ntierslots;            // index slots, a power of two
+        SpinLatch tierlatch[1];     // compressed tier ring and index
+        uid tierhits;               // pool misses the tier filled
+        uid tierstored;             // pages stashed in the tier
+        uid ncachesets;             // secondary cache file sets, or zero
+        CacheSet* cachesets;        // secondary cache file sets
+        CacheWay* cacheways;        // CACHE_ways frames per set
+        uid cachehits;              // pool misses the cache file filled
+        uid cachestored;            // pages written to the cache file
 
     #ifndef unix
         HANDLE halloc;              // allocation handle
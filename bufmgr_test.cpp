@@ -31,6 +31,7 @@
 #include "common.h"
 #include "logger.h"
 
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
@@ -38,6 +39,7 @@
 #include <stdlib.h>
 #include <string>
 #include <string.h>
+#include <unistd.h>
     
 using namespace std;
 using namespace mongo;
@@ -62,21 +64,32 @@ int main( int argc, char* argv[] ) {
     int fd = open( fname, O_RDWR | O_CREAT, 0666 );
 
     uint docId = 7;
-    size_t nread = pread( fd, page, pageSize, docId << pageBits );
+    size_t nread = pread( fd, page, pageSize, (off_t)docId << pageBits );
     if (nread < pageSize) {
         __OSS__( "readPage(" << docId << ") error: " << strerror(errno) );
         Logger::logError( "main", __ss__, __LOC__ );
         return 1;
     }
-    cout << *page << endl;
+    cout << "page " << docId
+         << " cnt " << page->cnt
+         << " act " << page->act
+         << " min " << page->min
+         << " lvl " << (uint)page->lvl
+         << " right " << BLTVal::getid( page->right ) << endl;
+    close( fd );
 
     uint poolSize = 8192;
-    uint segBits  = 5;
-    uint hashSize = poolSize / 8;
+    uint reads = 0;
+    uint writes = 0;
+    uid leaf = 0;
 
-    BufferMgr* mgr = BufferMgr::create( argv[1], pageBits, poolSize, segBits, hashSize );
+    BufMgr* mgr = BufMgr::create( fname, pageBits, poolSize );
+    if (!mgr) {
+        cout << "unable to open " << fname << endl;
+        return 1;
+    }
 
-    mgr->latchAudit( "main" );
+    mgr->poolaudit();
 
     const char* keys[] = {
         "g6tyz6qx0tlagmqfs5sj",
@@ -91,19 +104,51 @@ int main( int argc, char* argv[] ) {
         "aoit24zylxas12ty" };
 
     for (uint i=0; i<10; ++i) {
-        PageSet* set = new PageSet();
+        PageSet set[1];
 
         const char* key = keys[i];
         uint keylen = strlen( key );
 
-        if (mgr->loadPage( set, (const uchar *)key, keylen, 0, LockRead, "main" )) {
-            __OSS__( "return code: '" << mgr->decodeLastErr() << "' for key '" << key << '\'' );
+        uint slot = mgr->loadpage( set, (uchar *)key, keylen, 0, LockRead, &reads, &writes );
+        if (!slot) {
+            __OSS__( "return code: '" << mgr->err << "' for key '" << key << '\'' );
             Logger::logError( "main", __ss__, __LOC__ );
-         }
+            continue;
+        }
 
-        int slot = mgr->findSlot( set, (const uchar *)key, keylen, "main" );
-        delete set;
+        cout << "key " << key << " leaf " << set->latch->page_no << " slot " << slot << endl;
+        leaf = set->latch->page_no;
+        BufMgr::unlockpage( LockRead, set->latch );
+        mgr->unpinlatch( set->latch );
     }
 
-}
+    mgr->close();
+
+    // a leaf with a flipped byte fails every pin with BLTERR_crc,
+    // and its frame goes back to the pool each time
+    if (leaf) {
+        off_t off = ((off_t)leaf << pageBits) + pageSize - 1;
+        uchar byte, flip;
+
+        fd = open( fname, O_RDWR );
+        assert(pread( fd, &byte, 1, off ) == 1);
+        flip = byte ^ 0xff;
+        assert(pwrite( fd, &flip, 1, off ) == 1);
 
+        mgr = BufMgr::create( fname, pageBits, 64 );
+        assert(mgr != NULL);
+
+        for (uint i=0; i<2 * 64; ++i) {
+            assert(!mgr->pinlatch( leaf, 1, &reads, &writes ));
+            assert(mgr->err == BLTERR_crc);
+        }
+
+        mgr->close();
+        assert(pwrite( fd, &byte, 1, off ) == 1);
+        close( fd );
+        cout << "corrupted leaf " << leaf << " read back BLTERR_crc" << endl;
+    }
+
+    free( page );
+    return 0;
+}
@@ -53,7 +53,7 @@ namespace mongo {
 
 #ifdef STANDALONE
     #define uassert( X, Y, Z )  assert( Z )
-    #define Status              BTERR
+    #define Status              BLTERR
 #endif
 
     // page number constants
@@ -153,6 +153,8 @@ namespace mongo {
         uint prev;              // prev entry in hash table chain
         volatile ushort pin;    // number of outstanding threads
         ushort dirty:1;         // page in cache is dirty
+        uchar locked;           // page frame is mlocked, own byte so it never races dirty
+        uint hits;              // approximate pin count, for warm-up order
 
     #ifdef unix
         pthread_t atomictid;    // thread id holding atomic lock
@@ -32,6 +32,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <string.h>
 #include <utility>
 #include <vector>
     
@@ -47,15 +48,17 @@ int main( int argc, char* argv[] ) {
 
     SpinLatch latch;
 
-    SpinLatch::spinReadLock( &latch, "main" );
-    SpinLatch::spinReleaseRead( &latch, "main" );
+    memset( &latch, 0, sizeof(SpinLatch) );
 
-    int i =  SpinLatch::spinTryWrite( &latch, "main" );
+    SpinLatch::spinreadlock( &latch );
+    SpinLatch::spinreleaseread( &latch );
+
+    int i =  SpinLatch::spinwritetry( &latch );
     cout << "i = " << i << endl;
-    if (i) SpinLatch::spinReleaseWrite( &latch, "main" );
+    if (i) SpinLatch::spinreleasewrite( &latch );
 
-    SpinLatch::spinWriteLock( &latch, "main" );
-    SpinLatch::spinReleaseWrite( &latch, "main" );
+    SpinLatch::spinwritelock( &latch );
+    SpinLatch::spinreleasewrite( &latch );
 
     std::ostringstream* logMain = dynamic_cast< std::ostringstream* >( Logger::getStream( "main" ) );
     cout << "log Main:" << endl << logMain->str() << endl;
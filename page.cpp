@@ -54,6 +54,8 @@
 #include "page.h"
 #endif
 
+#include <stddef.h>
+
 namespace mongo {
 
     void BLTVal::putid( uchar* dest, uid id ) {
@@ -110,4 +112,90 @@ namespace mongo {
 		return good ? higher : 0;
 	}
 
+    /*
+    *  CRC32C (Castagnoli) table for the byte at a time fallback
+    */
+    static uint crctable[256];
+
+    static void crcinit() {
+        for (uint idx = 0; idx < 256; idx++) {
+            uint crc = idx;
+
+            for (uint bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+            }
+
+            crctable[idx] = crc;
+        }
+    }
+
+    static uint crcbytes( uint crc, const uchar* buff, uint len ) {
+        while (len--) {
+            crc = crctable[(crc ^ *buff++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    /*
+    *  SSE4.2 crc32 instruction, eight bytes at a time
+    */
+    __attribute__((target("sse4.2")))
+    static uint crcsse42( uint crc, const uchar* buff, uint len ) {
+        unsigned long long sum = crc;
+
+        for (; len >= 8; len -= 8, buff += 8) {
+            sum = __builtin_ia32_crc32di( sum, *(const unsigned long long*)buff );
+        }
+
+        crc = (uint)sum;
+
+        while (len--) {
+            crc = __builtin_ia32_crc32qi( crc, *buff++ );
+        }
+
+        return crc;
+    }
+#endif
+
+    static int crcsetup() {
+        crcinit();
+    #if defined(__x86_64__) && defined(__GNUC__)
+        return __builtin_cpu_supports( "sse4.2" );
+    #else
+        return 0;
+    #endif
+    }
+
+    static uint crcupdate( uint crc, const uchar* buff, uint len ) {
+        static int hardware = crcsetup();
+
+    #if defined(__x86_64__) && defined(__GNUC__)
+        if (hardware) {
+            return crcsse42( crc, buff, len );
+        }
+    #endif
+
+        return crcbytes( crc, buff, len );
+    }
+
+    /**
+    *  FUNCTION: checksum
+    *
+    *  CRC32C over the header before the crc field, four zero
+    *  bytes in its place, and the rest of the page
+    */
+    uint Page::checksum( Page* page, uint size ) {
+        static const uchar zero[sizeof(uint)] = { 0 };
+        const uchar* base = (const uchar*)page;
+        uint off = offsetof( Page, crc );
+        uint crc = ~0U;
+
+        crc = crcupdate( crc, base, off );
+        crc = crcupdate( crc, zero, sizeof(uint) );
+        off += sizeof(uint);
+        crc = crcupdate( crc, base + off, size - off );
+        return ~crc;
+    }
+
 }   // namespace mongo
@@ -96,6 +96,7 @@ namespace mongo {
         uint dead:1;         // Keys are marked dead, but remain on the page until
                              // cleanup is called. The fence key (highest key) for
                              // a leaf page is always present, even after cleanup.
+        uint ovfl:2;         // value is spilled, to OVFL_pages or OVFL_vlog
     };
     
     /**
@@ -148,6 +149,20 @@ namespace mongo {
     #define MAXKEY       255            // maximum number of bytes in a key
     #define KEYARRAY (MAXKEY + sizeof(BLTKey))
 
+    /*
+    *  A leaf value longer than MAXVAL is spilled to a chain of
+    *  overflow pages, and its slot holds an OVFL_stub value of
+    *  the value length then the first page number. An overflow
+    *  page has no slots, its min is the number of value bytes
+    *  following the page header, and right links the next page.
+    *  A value in the value log has the log offset of its bytes
+    *  in place of the page number.
+    */
+    #define MAXVAL       255            // maximum number of bytes in a slot value
+    #define OVFL_stub    (2 * BtId)     // slot value of a spilled value
+    #define OVFL_pages   1              // Slot::ovfl, value in overflow pages
+    #define OVFL_vlog    2              // Slot::ovfl, value in the value log
+
     /*
     *  The first part of an index page.  It is immediately followed
     *  by the Slot array of keys.
@@ -164,6 +179,13 @@ namespace mongo {
         */
         static int findslot( Page* page, uchar* key, uint keylen );
 
+        /**
+        *  FUNCTION:  checksum
+        *
+        *  CRC32C of a page of size bytes, its crc field as zero
+        */
+        static uint checksum( Page* page, uint size );
+
     public:
         uint cnt;                       // count of keys in page
         uint act;                       // count of active keys
@@ -174,6 +196,10 @@ namespace mongo {
         unsigned char lvl:7;            // level of page
         unsigned char kill:1;           // page is being deleted
         unsigned char right[BtId];      // page number to right
+        uid epoch;                      // backup epoch of last write
+        uint crc;                       // checksum of the page as last written
+        unsigned char ovfl;             // overflow page, holds min bytes of a spilled value
+        unsigned char filler[3];
     };
     
     /**
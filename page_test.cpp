@@ -33,7 +33,9 @@
 #include <fcntl.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
     
@@ -59,7 +61,36 @@ int main( int argc, char* argv[] ) {
             cout << "readPage(" << docId <<") error: " << strerror(errno) << endl;
             return 1;
         }
-        cout << *page << endl;
+        cout << "page " << docId
+             << " cnt " << page->cnt
+             << " act " << page->act
+             << " min " << page->min
+             << " lvl " << (uint32_t)page->lvl
+             << " free " << (uint32_t)page->free
+             << " right " << BLTVal::getid( page->right ) << endl;
+
+        if (page->bits) {
+            cout << "checksum " << (page->crc == Page::checksum( page, pageSize ) ? "ok" : "BAD") << endl;
+        }
     }
+
+    // the cost of checksumming a page
+    memset( page, 0, pageSize );
+
+    uint32_t loops = argc > 3 ? strtoul( argv[3], NULL, 10 ) : 100000;
+    struct timeval start, stop;
+    uint32_t sum = 0;
+
+    gettimeofday( &start, NULL );
+    for (uint32_t i = 0; i < loops; ++i) {
+        page->cnt = i;
+        sum += Page::checksum( page, pageSize );
+    }
+    gettimeofday( &stop, NULL );
+
+    double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+    cout << "checksum " << loops << " pages in " << secs << "s, "
+         << secs * 1e9 / loops << " ns per page, "
+         << ((double)loops * pageSize / secs / (1 << 20)) << " MB/s (" << sum << ")" << endl;
     return 0;
 }
@@ -35,6 +35,14 @@ int main( int argc, char* argv[] ) {
         if (endptr != argv[1]) nkeys = n;
     }
 
+    // longest c field, long ones make values spill to overflow pages
+    uint32_t clen( 32 );
+    if (argc>2) {
+        char* endptr;
+        uint32_t n = strtoul( argv[2], &endptr, 10 );
+        if (endptr != argv[2]) clen = n;
+    }
+
     for (uint32_t i=0; i<nkeys; ++i) {
         string key = randomString( 12, EXACT );
         cout << key << '\t';
@@ -42,6 +50,6 @@ int main( int argc, char* argv[] ) {
             "{ _id: \"" << key << "\","
                " a: \"" << randomString( 32, NON_EXACT ) << "\","
                " b: \"" << randomString( 32, NON_EXACT ) << "\","
-               " c: \"" << randomString( 32, NON_EXACT ) << "\" }" << endl;
+               " c: \"" << randomString( clen, NON_EXACT ) << "\" }" << endl;
     }
 }
@@ -0,0 +1,333 @@
+//@file redolog.cpp
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#ifndef STANDALONE
+#include "mongo/db/storage/bltree/blterr.h"
+#include "mongo/db/storage/bltree/common.h"
+#include "mongo/db/storage/bltree/latchmgr.h"
+#include "mongo/db/storage/bltree/redolog.h"
+#else
+#include "blterr.h"
+#include "common.h"
+#include "latchmgr.h"
+#include "redolog.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory.h>
+#include <stdlib.h>
+#ifdef unix
+#include <linux/falloc.h>
+#include <unistd.h>
+#endif
+
+namespace mongo {
+
+    /**
+    *  FUNCTION: create
+    *
+    *  open/create a redo log, positioned at its end
+    */
+    RedoLog* RedoLog::create( const char* path ) {
+        RedoLog* log = (RedoLog*)calloc( 1, sizeof(RedoLog) );
+
+    #ifdef unix
+        log->idx = open( path, O_RDWR | O_CREAT, 0666 );
+        if (-1 == log->idx) {
+            std::cerr << "Unable to open redo log " << path << std::endl;
+            free( log );
+            return NULL;
+        }
+
+        log->base = lseek( log->idx, 0L, 2 );
+    #else
+        uint hi[1];
+
+        log->idx = CreateFile( path, GENERIC_READ | GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+        if (INVALID_HANDLE_VALUE == log->idx) {
+            std::cerr << "Unable to open redo log " << path << " GetLastError = " << GetLastError() << std::endl;
+            free( log );
+            return NULL;
+        }
+
+        *hi = 0;
+        log->base = GetFileSize( log->idx, hi );
+        log->base |= (uid)*hi << 32;
+    #endif
+        log->buff = (uchar*)malloc( REDO_buff );
+        return log;
+    }
+
+    /**
+    *  FUNCTION: close
+    */
+    void RedoLog::close() {
+        flush();
+    #ifdef unix
+        ::close( idx );
+    #else
+        CloseHandle( idx );
+    #endif
+        free( buff );
+    }
+
+    /**
+    *  FUNCTION: logwrite
+    *
+    *  @return true when all len bytes were written at off
+    */
+    static bool logwrite( RedoLog* log, void* buff, uint len, uid off ) {
+    #ifdef unix
+        return pwrite( log->idx, buff, len, off ) == (ssize_t)len;
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+
+        memset( ovl, 0, sizeof(OVERLAPPED) );
+        ovl->Offset = off;
+        ovl->OffsetHigh = off >> 32;
+
+        return WriteFile( log->idx, buff, len, amt, ovl ) && *amt == len;
+    #endif
+    }
+
+    /**
+    *  FUNCTION: logread
+    *
+    *  @return true when all len bytes were read from off
+    */
+    static bool logread( RedoLog* log, void* buff, uint len, uid off ) {
+    #ifdef unix
+        return pread( log->idx, buff, len, off ) == (ssize_t)len;
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+
+        memset( ovl, 0, sizeof(OVERLAPPED) );
+        ovl->Offset = off;
+        ovl->OffsetHigh = off >> 32;
+
+        return ReadFile( log->idx, buff, len, amt, ovl ) && *amt == len;
+    #endif
+    }
+
+    /**
+    *  FUNCTION: checksum
+    *
+    *  FNV-1a hash of the record bytes
+    */
+    uint RedoLog::checksum( uchar* buff, uint len ) {
+        uint sum = 2166136261U;
+        while (len--) {
+            sum ^= *buff++;
+            sum *= 16777619;
+        }
+        return sum;
+    }
+
+    /**
+    *  FUNCTION: format
+    *
+    *  the records of a batch are formatted into its value
+    */
+    uint RedoLog::format( RedoRec* rec, uid lsn, uint op, uint type,
+                            uchar* key, uint keylen, uchar* val, uint vallen ) {
+        uint len = sizeof(RedoRec) + keylen + vallen;
+
+        // keep records 8 byte aligned
+        len = (len + 7) & ~7;
+
+        if (!rec) return len;
+
+        memset( rec, 0, len );
+        rec->len = len;
+        rec->lsn = lsn;
+        rec->op = op;
+        rec->type = type;
+        rec->keylen = keylen;
+        rec->vallen = vallen;
+        memcpy( rec->data, key, keylen );
+        memcpy( rec->data + keylen, val, vallen );
+        rec->sum = checksum( (uchar*)&rec->len, len - sizeof(uint) );
+        return len;
+    }
+
+    /**
+    *  FUNCTION: append
+    *
+    *  format a record into the append buffer,
+    *  writing the buffer out when it fills
+    */
+    BLTERR RedoLog::append( uint op, uint type, uchar* key, uint keylen,
+                            uchar* val, uint vallen ) {
+        uint len = format( NULL, 0, op, type, key, keylen, val, vallen );
+        BLTERR err = BLTERR_ok;
+        RedoRec* rec;
+
+        SpinLatch::spinwritelock( lock );
+
+        if (buffcnt + len > REDO_buff) {
+            if ( (err = flush()) ) {
+                SpinLatch::spinreleasewrite( lock );
+                return err;
+            }
+        }
+
+        // oversized records bypass the buffer
+        if (len > REDO_buff) {
+            rec = (RedoRec*)malloc( len );
+        }
+        else {
+            rec = (RedoRec*)(buff + buffcnt);
+        }
+
+        format( rec, base + buffcnt, op, type, key, keylen, val, vallen );
+
+        if (len > REDO_buff) {
+            if (!logwrite( this, rec, len, base )) {
+                err = BLTERR_wrt;
+            }
+            else {
+                base += len;
+            }
+            free( rec );
+        }
+        else {
+            buffcnt += len;
+        }
+
+        SpinLatch::spinreleasewrite( lock );
+        return err;
+    }
+
+    /**
+    *  FUNCTION: flush
+    *
+    *  call with the append latch held, or when single threaded
+    */
+    BLTERR RedoLog::flush() {
+        if (!buffcnt) return BLTERR_ok;
+
+        if (!logwrite( this, buff, buffcnt, base )) {
+            std::cerr << "Unable to write redo log, errno = " << errno << std::endl;
+            return BLTERR_wrt;
+        }
+
+        base += buffcnt;
+        buffcnt = 0;
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: read
+    *
+    *  a torn or stale record ends the valid log
+    */
+    uint RedoLog::read( uid lsn, RedoRec* rec, uint max ) {
+        if (!logread( this, rec, sizeof(RedoRec), lsn )) {
+            return 0;
+        }
+
+        if (rec->lsn != lsn || rec->len < sizeof(RedoRec) || rec->len > max) {
+            return 0;
+        }
+
+        if (!logread( this, rec, rec->len, lsn )) {
+            return 0;
+        }
+
+        if (rec->sum != checksum( (uchar*)&rec->len, rec->len - sizeof(uint) )) {
+            return 0;
+        }
+
+        return rec->len;
+    }
+
+    /**
+    *  FUNCTION: tail
+    */
+    BLTERR RedoLog::tail( uid* lsn ) {
+        BLTERR err;
+
+        SpinLatch::spinwritelock( lock );
+        err = flush();
+        *lsn = base + buffcnt;
+        SpinLatch::spinreleasewrite( lock );
+        return err;
+    }
+
+    /**
+    *  FUNCTION: discard
+    *
+    *  punch out whole blocks ahead of lsn, keeping the
+    *  offsets of later records; file systems without hole
+    *  punching, and Windows, keep the space until the next truncate
+    */
+    void RedoLog::discard( uid lsn ) {
+        lsn &= ~(uid)(REDO_block - 1);
+
+    #ifdef unix
+        if (lsn) {
+            fallocate( idx, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, lsn );
+        }
+    #endif
+    }
+
+    /**
+    *  FUNCTION: truncate
+    */
+    BLTERR RedoLog::truncate( uid lsn ) {
+        SpinLatch::spinwritelock( lock );
+
+    #ifdef unix
+        if (ftruncate( idx, lsn )) {
+            SpinLatch::spinreleasewrite( lock );
+            return BLTERR_wrt;
+        }
+    #else
+        long hi = lsn >> 32;
+
+        SetFilePointer( idx, (long)lsn, &hi, FILE_BEGIN );
+        if (!SetEndOfFile( idx )) {
+            SpinLatch::spinreleasewrite( lock );
+            return BLTERR_wrt;
+        }
+    #endif
+
+        base = lsn;
+        buffcnt = 0;
+        SpinLatch::spinreleasewrite( lock );
+        return BLTERR_ok;
+    }
+
+}   // namespace mongo
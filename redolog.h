@@ -0,0 +1,156 @@
+//@file redolog.h
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#pragma once
+
+#ifndef STANDALONE
+#include "mongo/db/storage/bltree/blterr.h"
+#include "mongo/db/storage/bltree/common.h"
+#include "mongo/db/storage/bltree/latchmgr.h"
+#else
+#include "blterr.h"
+#include "common.h"
+#include "latchmgr.h"
+#endif
+
+namespace mongo {
+
+    /**
+    *  redo log record header, followed by key bytes then value bytes.
+    *  The lsn of a record is its byte offset in the log file.
+    */
+    struct RedoRec {
+        uint sum;                   // checksum of the record after this field
+        uint len;                   // record length including header
+        uid lsn;                    // log sequence number of this record
+        uchar op;                   // RedoLog::Insert, Delete or Batch
+        uchar type;                 // Slot type of an inserted key
+        uchar keylen;               // key length, including any dup suffix
+        uchar filler;
+        uint vallen;                // value length
+        uchar data[0];
+    };
+
+    /**
+    *  append-only logical redo log of leaf level key modifications.
+    *  The changes of an atomic batch are the value of one Batch
+    *  record, so a torn batch is not replayed at all.
+    */
+    class RedoLog {
+    public:
+        enum Op {
+            Insert = 1,
+            Delete = 2,
+            Batch = 3
+        };
+
+        /**
+        *  FUNCTION: create
+        *
+        *  factory method, open or create the log file
+        */
+        static RedoLog* create( const char* path );
+
+        /**
+        *  FUNCTION: close
+        */
+        void close();
+
+        /**
+        *  FUNCTION: append
+        */
+        BLTERR append( uint op, uint type, uchar* key, uint keylen, uchar* val, uint vallen );
+
+        /**
+        *  FUNCTION: format
+        *
+        *  format a record at rec, or only size it when rec is NULL
+        *  @return record length
+        */
+        static uint format( RedoRec* rec, uid lsn, uint op, uint type,
+                            uchar* key, uint keylen, uchar* val, uint vallen );
+
+        /**
+        *  FUNCTION: flush
+        *
+        *  write buffered records to the log file
+        */
+        BLTERR flush();
+
+        /**
+        *  FUNCTION: read
+        *
+        *  read the record at lsn into rec, of size max
+        *  @return record length, or 0 at end of a valid log
+        */
+        uint read( uid lsn, RedoRec* rec, uint max );
+
+        /**
+        *  FUNCTION: truncate
+        *
+        *  discard log records at and after lsn
+        */
+        BLTERR truncate( uid lsn );
+
+        /**
+        *  FUNCTION: tail
+        *
+        *  write buffered records and note the lsn of the log end
+        *  @return BLTERR_wrt when the buffered records can't be written
+        */
+        BLTERR tail( uid* lsn );
+
+        /**
+        *  FUNCTION: discard
+        *
+        *  release the file space of records before lsn
+        */
+        void discard( uid lsn );
+
+        /**
+        *  FUNCTION: checksum
+        */
+        static uint checksum( uchar* buff, uint len );
+
+    public:
+    #ifdef unix
+        int idx;                    // log file descriptor
+    #else
+        HANDLE idx;
+    #endif
+        SpinLatch lock[1];          // buffer append latch
+        uchar* buff;                // buffered records not yet written
+        uint buffcnt;               // bytes used in buff
+        uid base;                   // lsn of buff[0]
+    };
+
+    #define REDO_buff   (1 << 20)   // size of the log append buffer
+    #define REDO_block  (1 << 16)   // granularity of discarded log space
+
+}   // namespace mongo
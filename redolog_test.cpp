@@ -0,0 +1,110 @@
+//@file redolog_test.cpp
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#include "common.h"
+#include "redolog.h"
+
+#include <assert.h>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+    
+using namespace std;
+using namespace mongo;
+
+int main( int argc, char* argv[] ) {
+
+    const char* fname = (argc > 1) ? argv[1] : "testdb.redo";
+    uint count = (argc > 2) ? strtoul( argv[2], NULL, 10 ) : 100000;
+    uchar buff[4096];
+    char key[32];
+    char val[32];
+    uid lsn = 0;
+    uid half = 0;
+    uint len;
+    uint idx;
+
+    unlink( fname );
+    RedoLog* log = RedoLog::create( fname );
+    assert(log != NULL);
+
+    for (idx = 0; idx < count; idx++) {
+        if (idx == count / 2) {
+            assert(!log->flush());
+            half = log->base;
+        }
+        sprintf( key, "key%07d", idx );
+        sprintf( val, "val%d", idx );
+        assert(!log->append( idx % 3 ? RedoLog::Insert : RedoLog::Delete, 0,
+                    (uchar*)key, strlen(key), (uchar*)val, strlen(val) ));
+    }
+
+    log->close();
+    free( log );
+
+    // read the records back in order
+    log = RedoLog::create( fname );
+    RedoRec* rec = (RedoRec*)buff;
+
+    for (idx = 0; (len = log->read( lsn, rec, sizeof(buff) )); idx++) {
+        sprintf( key, "key%07d", idx );
+        assert(rec->op == (idx % 3 ? RedoLog::Insert : RedoLog::Delete));
+        assert(rec->keylen == strlen(key));
+        assert(!memcmp( rec->data, key, rec->keylen ));
+        lsn += len;
+    }
+
+    cout << idx << " records read back, log size " << lsn << endl;
+    assert(idx == count);
+
+    // a torn tail ends the log at the last whole record
+    assert(!log->truncate( lsn - 3 ));
+
+    for (lsn = 0, idx = 0; (len = log->read( lsn, rec, sizeof(buff) )); idx++) {
+        lsn += len;
+    }
+
+    assert(idx == count - 1);
+
+    // discard the second half
+    assert(!log->truncate( half ));
+
+    for (lsn = 0, idx = 0; (len = log->read( lsn, rec, sizeof(buff) )); idx++) {
+        lsn += len;
+    }
+
+    cout << idx << " records after truncate" << endl;
+    assert(idx == count / 2);
+
+    log->close();
+    free( log );
+}
+
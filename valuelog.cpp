@@ -0,0 +1,286 @@
+//@file valuelog.cpp
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#ifndef STANDALONE
+#include "mongo/db/storage/bltree/blterr.h"
+#include "mongo/db/storage/bltree/common.h"
+#include "mongo/db/storage/bltree/valuelog.h"
+#else
+#include "blterr.h"
+#include "common.h"
+#include "valuelog.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory.h>
+#include <stdlib.h>
+#ifdef unix
+#include <linux/falloc.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace mongo {
+
+    /**
+    *  FUNCTION: create
+    *
+    *  open/create a value log, appending at its end
+    */
+    ValueLog* ValueLog::create( const char* path, uint readonly ) {
+        ValueLog* log = (ValueLog*)calloc( 1, sizeof(ValueLog) );
+
+    #ifdef unix
+        log->idx = readonly ? open( path, O_RDONLY ) : open( path, O_RDWR | O_CREAT, 0666 );
+        if (-1 == log->idx) {
+            std::cerr << "Unable to open value log " << path << std::endl;
+            free( log );
+            return NULL;
+        }
+
+        log->tail = lseek( log->idx, 0L, 2 );
+    #else
+        uint hi[1];
+
+        log->idx = CreateFile( path, readonly ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, readonly ? OPEN_EXISTING : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+        if (INVALID_HANDLE_VALUE == log->idx) {
+            std::cerr << "Unable to open value log " << path << " GetLastError = " << GetLastError() << std::endl;
+            free( log );
+            return NULL;
+        }
+
+        *hi = 0;
+        log->tail = GetFileSize( log->idx, hi );
+        log->tail |= (uid)*hi << 32;
+    #endif
+        log->tail = (log->tail + VLOG_align - 1) & ~(uid)(VLOG_align - 1);
+        return log;
+    }
+
+    /**
+    *  FUNCTION: close
+    */
+    void ValueLog::close() {
+    #ifdef unix
+        ::close( idx );
+    #else
+        CloseHandle( idx );
+    #endif
+    }
+
+    /**
+    *  FUNCTION: checksum
+    *
+    *  FNV-1a hash of the record bytes, continuing from sum
+    */
+    uint ValueLog::checksum( uint sum, uchar* buff, uint len ) {
+        while (len--) {
+            sum ^= *buff++;
+            sum *= 16777619;
+        }
+        return sum;
+    }
+
+    /**
+    *  FUNCTION: append
+    *
+    *  the header, key and value are gathered straight
+    *  into the reserved space, the value is not copied
+    */
+    BLTERR ValueLog::append( uchar* key, uint keylen, uchar* val, uint vallen, uid* off ) {
+        uint len = sizeof(ValueRec) + keylen + vallen;
+        uchar pad[VLOG_align];
+        ValueRec rec[1];
+
+        // keep records aligned
+        len = (len + VLOG_align - 1) & ~(VLOG_align - 1);
+
+        memset( rec, 0, sizeof(ValueRec) );
+        memset( pad, 0, sizeof(pad) );
+        rec->len = len;
+    #ifdef unix
+        rec->off = __sync_fetch_and_add( &tail, len );
+    #else
+        rec->off = _InterlockedExchangeAdd64( (volatile __int64*)&tail, len );
+    #endif
+        rec->keylen = keylen;
+        rec->vallen = vallen;
+
+        uint padlen = len - sizeof(ValueRec) - keylen - vallen;
+        uint sum = 2166136261U;
+
+        sum = checksum( sum, (uchar*)&rec->len, sizeof(ValueRec) - sizeof(uint) );
+        sum = checksum( sum, key, keylen );
+        sum = checksum( sum, val, vallen );
+        rec->sum = checksum( sum, pad, padlen );
+
+    #ifdef unix
+        struct iovec iov[4];
+
+        iov[0].iov_base = rec;
+        iov[0].iov_len = sizeof(ValueRec);
+        iov[1].iov_base = key;
+        iov[1].iov_len = keylen;
+        iov[2].iov_base = val;
+        iov[2].iov_len = vallen;
+        iov[3].iov_base = pad;
+        iov[3].iov_len = padlen;
+
+        if (pwritev( idx, iov, 4, rec->off ) < (int)len) {
+            std::cerr << "Unable to write value log, errno = " << errno << std::endl;
+            return BLTERR_wrt;
+        }
+    #else
+        // without a gathering write the record is assembled first
+        uchar* buff = (uchar*)malloc( len );
+        OVERLAPPED ovl[1];
+        uint amt[1];
+
+        if (!buff) {
+            return BLTERR_wrt;
+        }
+
+        memcpy( buff, rec, sizeof(ValueRec) );
+        memcpy( buff + sizeof(ValueRec), key, keylen );
+        memcpy( buff + sizeof(ValueRec) + keylen, val, vallen );
+        memcpy( buff + sizeof(ValueRec) + keylen + vallen, pad, padlen );
+
+        memset( ovl, 0, sizeof(OVERLAPPED) );
+        ovl->Offset = rec->off;
+        ovl->OffsetHigh = rec->off >> 32;
+
+        if (!WriteFile( idx, buff, len, amt, ovl ) || *amt < len) {
+            std::cerr << "Unable to write value log, GetLastError = " << GetLastError() << std::endl;
+            free( buff );
+            return BLTERR_wrt;
+        }
+
+        free( buff );
+    #endif
+
+        *off = rec->off + sizeof(ValueRec) + keylen;
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: logread
+    *
+    *  @return true when all len bytes were read from off
+    */
+    static bool logread( ValueLog* log, void* buff, uint len, uid off ) {
+    #ifdef unix
+        return pread( log->idx, buff, len, off ) == (ssize_t)len;
+    #else
+        OVERLAPPED ovl[1];
+        uint amt[1];
+
+        memset( ovl, 0, sizeof(OVERLAPPED) );
+        ovl->Offset = off;
+        ovl->OffsetHigh = off >> 32;
+
+        return ReadFile( log->idx, buff, len, amt, ovl ) && *amt == len;
+    #endif
+    }
+
+    /**
+    *  FUNCTION: fetch
+    *
+    *  a value cut short by the end of the log, or by a
+    *  failed read, is an error rather than a shorter value
+    */
+    BLTERR ValueLog::fetch( uid off, uchar* val, uint len ) {
+        if (!logread( this, val, len, off )) {
+            std::cerr << "Unable to read value log at " << off << std::endl;
+            return BLTERR_read;
+        }
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: read
+    *
+    *  a torn, stale or punched out record is not read
+    */
+    uint ValueLog::read( uid off, ValueRec* rec, uint max ) {
+        if (!logread( this, rec, sizeof(ValueRec), off )) {
+            return 0;
+        }
+
+        if (rec->off != off || rec->len < sizeof(ValueRec) || rec->len > max) {
+            return 0;
+        }
+
+        if (!logread( this, rec, rec->len, off )) {
+            return 0;
+        }
+
+        if (rec->sum != checksum( 2166136261U, (uchar*)&rec->len, rec->len - sizeof(uint) )) {
+            return 0;
+        }
+
+        return rec->len;
+    }
+
+    /**
+    *  FUNCTION: sync
+    */
+    BLTERR ValueLog::sync() {
+    #ifdef unix
+        if (fdatasync( idx )) {
+            return BLTERR_wrt;
+        }
+    #else
+        if (!FlushFileBuffers( idx )) {
+            return BLTERR_wrt;
+        }
+    #endif
+        return BLTERR_ok;
+    }
+
+    /**
+    *  FUNCTION: discard
+    *
+    *  punch out whole blocks ahead of off, keeping the
+    *  offsets of later records; Windows keeps the space
+    */
+    void ValueLog::discard( uid off ) {
+        off &= ~(uid)(VLOG_block - 1);
+
+    #ifdef unix
+        if (off) {
+            fallocate( idx, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, off );
+        }
+    #endif
+    }
+
+}   // namespace mongo
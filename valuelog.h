@@ -0,0 +1,130 @@
+//@file valuelog.h
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#pragma once
+
+#ifndef STANDALONE
+#include "mongo/db/storage/bltree/blterr.h"
+#include "mongo/db/storage/bltree/common.h"
+#else
+#include "blterr.h"
+#include "common.h"
+#endif
+
+namespace mongo {
+
+    /**
+    *  value log record header, followed by key bytes then value bytes.
+    *  A leaf slot points at the value bytes of its record.
+    */
+    struct ValueRec {
+        uint sum;                   // checksum of the record after this field
+        uint len;                   // record length including header
+        uid off;                    // offset of this record in the log
+        uchar keylen;               // key length, including any dup suffix
+        uchar filler[3];
+        uint vallen;                // value length
+        uchar data[0];
+    };
+
+    /**
+    *  append-only log of leaf values kept out of their pages.
+    *  Appends reserve their space and write it through, so
+    *  concurrent appends take no latch. The space ahead of the
+    *  oldest live value is released by garbage collection.
+    */
+    class ValueLog {
+    public:
+        /**
+        *  FUNCTION: create
+        *
+        *  factory method, open or create the log file
+        */
+        static ValueLog* create( const char* path, uint readonly );
+
+        /**
+        *  FUNCTION: close
+        */
+        void close();
+
+        /**
+        *  FUNCTION: append
+        *
+        *  write a record of a key and its value
+        *  @param off  -  set to the offset of the value bytes
+        */
+        BLTERR append( uchar* key, uint keylen, uchar* val, uint vallen, uid* off );
+
+        /**
+        *  FUNCTION: fetch
+        *
+        *  read len value bytes at off into val
+        *  @return BLTERR_read unless all len bytes were read
+        */
+        BLTERR fetch( uid off, uchar* val, uint len );
+
+        /**
+        *  FUNCTION: read
+        *
+        *  read the record at off into rec, of size max
+        *  @return record length, or 0 if there is no
+        *  whole record at off
+        */
+        uint read( uid off, ValueRec* rec, uint max );
+
+        /**
+        *  FUNCTION: sync
+        */
+        BLTERR sync();
+
+        /**
+        *  FUNCTION: discard
+        *
+        *  release the file space of records before off
+        */
+        void discard( uid off );
+
+        /**
+        *  FUNCTION: checksum
+        */
+        static uint checksum( uint sum, uchar* buff, uint len );
+
+    public:
+    #ifdef unix
+        int idx;                    // log file descriptor
+    #else
+        HANDLE idx;
+    #endif
+        volatile uid tail;          // offset of the next record
+    };
+
+    #define VLOG_align  8           // record alignment in the log
+    #define VLOG_block  (1 << 16)   // granularity of discarded log space
+
+}   // namespace mongo
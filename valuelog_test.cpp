@@ -0,0 +1,111 @@
+//@file valuelog_test.cpp
+/*
+*    Copyright (C) 2014 MongoDB Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*    As a special exception, the copyright holders give permission to link the
+*    code of portions of this program with the OpenSSL library under certain
+*    conditions as described in each individual source file and distribute
+*    linked combinations including the program with the OpenSSL library. You
+*    must comply with the GNU Affero General Public License in all respects for
+*    all of the code used other than as permitted herein. If you modify file(s)
+*    with this exception, you may extend this exception to your version of the
+*    file(s), but you are not obligated to do so. If you do not wish to do so,
+*    delete this exception statement from your version. If you delete this
+*    exception statement from all source files in the program, then also delete
+*    it in the license file.
+*/
+
+#include "common.h"
+#include "valuelog.h"
+
+#include <assert.h>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+    
+using namespace std;
+using namespace mongo;
+
+int main( int argc, char* argv[] ) {
+
+    const char* fname = (argc > 1) ? argv[1] : "testdb.vlog";
+    uint count = (argc > 2) ? strtoul( argv[2], NULL, 10 ) : 10000;
+    uchar buff[8192];
+    uchar val[4096];
+    char key[32];
+    uid* offs = (uid*)malloc( count * sizeof(uid) );
+    uid off = 0;
+    uint len;
+    uint idx;
+
+    unlink( fname );
+    ValueLog* log = ValueLog::create( fname, 0 );
+    assert(log != NULL);
+
+    for (idx = 0; idx < count; idx++) {
+        sprintf( key, "key%07d", idx );
+        memset( val, idx, sizeof(val) );
+        assert(!log->append( (uchar*)key, strlen(key), val, 100 + idx % 3900, offs + idx ));
+    }
+
+    log->close();
+    free( log );
+
+    // fetch the values back through their offsets
+    log = ValueLog::create( fname, 1 );
+    assert(log != NULL);
+
+    for (idx = 0; idx < count; idx++) {
+        len = 100 + idx % 3900;
+        assert(!log->fetch( offs[idx], buff, len ));
+        memset( val, idx, len );
+        assert(!memcmp( buff, val, len ));
+    }
+
+    // and the records in order
+    ValueRec* rec = (ValueRec*)buff;
+
+    for (idx = 0; (len = log->read( off, rec, sizeof(buff) )); idx++) {
+        sprintf( key, "key%07d", idx );
+        assert(rec->keylen == strlen(key));
+        assert(!memcmp( rec->data, key, rec->keylen ));
+        assert(off + sizeof(ValueRec) + rec->keylen == offs[idx]);
+        off += len;
+    }
+
+    cout << idx << " records read back, log size " << off << endl;
+    assert(idx == count);
+    assert(off == log->tail);
+
+    log->close();
+    free( log );
+
+    // discarded records are no longer read
+    log = ValueLog::create( fname, 0 );
+    log->discard( offs[count / 2] );
+
+    assert(!log->read( 0, rec, sizeof(buff) ));
+    len = 100 + (count - 1) % 3900;
+    assert(!log->fetch( offs[count - 1], buff, len ));
+
+    // a value running past the end of the log is not read
+    assert(log->fetch( offs[count - 1], buff, len + VLOG_align ) == BLTERR_read);
+
+    log->close();
+    free( log );
+    free( offs );
+}